@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+#include "depth_segmentation/common.h"
+
+namespace depth_segmentation {
+
+// Creates covariance matrices of noisy planar neighborhoods, as they occur in
+// the normal estimation.
+std::vector<cv::Matx33d> createCovariances(const size_t num_matrices) {
+  constexpr size_t kNeighborhoodSize = 49u;
+  cv::RNG rng(42);
+  std::vector<cv::Matx33d> covariances;
+  covariances.reserve(num_matrices);
+  for (size_t i = 0u; i < num_matrices; ++i) {
+    const cv::Vec3d normal = cv::normalize(
+        cv::Vec3d(rng.uniform(-1.0, 1.0), rng.uniform(-1.0, 1.0), -1.0));
+    std::vector<cv::Vec3d> points(kNeighborhoodSize);
+    cv::Vec3d mean(0.0, 0.0, 0.0);
+    for (cv::Vec3d& point : points) {
+      const double x = rng.uniform(-0.01, 0.01);
+      const double y = rng.uniform(-0.01, 0.01);
+      point = cv::Vec3d(x, y,
+                        2.0 - (normal[0] * x + normal[1] * y) / normal[2] +
+                            rng.gaussian(1.0e-4));
+      mean += point;
+    }
+    mean /= static_cast<double>(kNeighborhoodSize);
+    cv::Matx33d covariance = cv::Matx33d::zeros();
+    for (const cv::Vec3d& point : points) {
+      const cv::Vec3d difference = point - mean;
+      covariance += difference * difference.t();
+    }
+    covariances.push_back(covariance);
+  }
+  return covariances;
+}
+
+}  // namespace depth_segmentation
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  const size_t num_matrices = argc > 1 ? std::atoi(argv[1]) : 300000u;
+  CHECK_GT(num_matrices, 0u);
+
+  const std::vector<cv::Matx33d> covariances =
+      depth_segmentation::createCovariances(num_matrices);
+
+  // cv::eigen on float matrices, as previously used in computeOwnNormals.
+  std::vector<cv::Vec3f> cv_normals(num_matrices);
+  cv::Mat covariance(3, 3, CV_32FC1);
+  cv::Mat eigenvalues;
+  cv::Mat eigenvectors;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0u; i < num_matrices; ++i) {
+    cv::Mat(cv::Matx33f(covariances[i])).copyTo(covariance);
+    cv::eigen(covariance, eigenvalues, eigenvectors);
+    cv_normals[i] = eigenvectors.row(2);
+  }
+  const double cv_eigen_ms = std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+
+  std::vector<cv::Vec3f> closed_form_normals(num_matrices);
+  cv::Vec3d closed_form_eigenvalues;
+  cv::Matx33d closed_form_eigenvectors;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0u; i < num_matrices; ++i) {
+    depth_segmentation::computeSymmetricEigen3x3(
+        covariances[i], &closed_form_eigenvalues, &closed_form_eigenvectors);
+    closed_form_normals[i] = cv::Vec3f(closed_form_eigenvectors(2, 0),
+                                       closed_form_eigenvectors(2, 1),
+                                       closed_form_eigenvectors(2, 2));
+  }
+  const double closed_form_ms = std::chrono::duration<double, std::milli>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count();
+
+  // Accuracy of the smallest eigenvector with respect to cv::eigen in double
+  // precision.
+  double cv_eigen_max_error = 0.0;
+  double closed_form_max_error = 0.0;
+  cv::Mat reference_eigenvalues;
+  cv::Mat reference_eigenvectors;
+  for (size_t i = 0u; i < num_matrices; ++i) {
+    cv::eigen(cv::Mat(covariances[i]), reference_eigenvalues,
+              reference_eigenvectors);
+    const cv::Vec3d reference = reference_eigenvectors.row(2);
+    // Eigenvectors are only defined up to their sign.
+    cv_eigen_max_error = std::max(
+        cv_eigen_max_error,
+        1.0 - std::abs(reference.dot(static_cast<cv::Vec3d>(cv_normals[i]))));
+    closed_form_max_error = std::max(
+        closed_form_max_error,
+        1.0 - std::abs(reference.dot(
+                  static_cast<cv::Vec3d>(closed_form_normals[i]))));
+  }
+
+  std::cout << "Solved " << num_matrices << " covariance matrices."
+            << std::endl;
+  std::cout << "cv::eigen (float):  " << cv_eigen_ms << " ms, "
+            << num_matrices / cv_eigen_ms / 1.0e3
+            << " M/s, max 1 - |cos| to reference: " << cv_eigen_max_error
+            << std::endl;
+  std::cout << "closed form:        " << closed_form_ms << " ms, "
+            << num_matrices / closed_form_ms / 1.0e3
+            << " M/s, max 1 - |cos| to reference: " << closed_form_max_error
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+#include "depth_segmentation/common.h"
+
+namespace depth_segmentation {
+
+// Creates a slanted plane with a box in front of it, such that the windows
+// along the box boundaries are affected by the distance threshold.
+cv::Mat createDepthMap(const size_t width, const size_t height) {
+  constexpr float kFocalLength = 574.0527954101562f;
+  const float cx = (width - 1u) / 2.0f;
+  const float cy = (height - 1u) / 2.0f;
+  cv::Mat depth_map(height, width, CV_32FC3);
+  for (size_t y = 0u; y < height; ++y) {
+    for (size_t x = 0u; x < width; ++x) {
+      float z_distance = 2.0f + 0.5f * x / width;
+      if (x > width / 3u && x < 2u * width / 3u && y > height / 3u &&
+          y < 2u * height / 3u) {
+        z_distance = 1.0f;
+      }
+      depth_map.at<cv::Vec3f>(y, x) =
+          cv::Vec3f((x - cx) / kFocalLength * z_distance,
+                    (y - cy) / kFocalLength * z_distance, z_distance);
+    }
+  }
+  return depth_map;
+}
+
+double timeNormals(
+    const std::function<void(const SurfaceNormalParams&, const cv::Mat&,
+                             cv::Mat*)>& compute_normals,
+    const SurfaceNormalParams& params, const cv::Mat& depth_map,
+    const size_t num_iterations) {
+  cv::Mat normals(depth_map.size(), CV_32FC3);
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0u; i < num_iterations; ++i) {
+    compute_normals(params, depth_map, &normals);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         num_iterations;
+}
+
+}  // namespace depth_segmentation
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  const size_t num_iterations = argc > 1 ? std::atoi(argv[1]) : 5u;
+  CHECK_GT(num_iterations, 0u);
+
+  const cv::Mat depth_map = depth_segmentation::createDepthMap(640u, 480u);
+  depth_segmentation::SurfaceNormalParams params;
+
+  std::cout << "Average time per 640x480 frame [ms] over " << num_iterations
+            << " iterations." << std::endl;
+  std::cout << std::setw(8) << "window" << std::setw(16) << "window_filter"
+            << std::setw(16) << "integral" << std::setw(16)
+            << "integral_refine" << std::endl;
+  for (size_t window_size = 3u; window_size <= 31u; window_size += 2u) {
+    params.window_size = window_size;
+    const double window_filter_ms = depth_segmentation::timeNormals(
+        depth_segmentation::computeOwnNormals, params, depth_map,
+        num_iterations);
+    params.use_distance_refinement = false;
+    const double integral_ms = depth_segmentation::timeNormals(
+        depth_segmentation::computeIntegralImageNormals, params, depth_map,
+        num_iterations);
+    params.use_distance_refinement = true;
+    const double integral_refine_ms = depth_segmentation::timeNormals(
+        depth_segmentation::computeIntegralImageNormals, params, depth_map,
+        num_iterations);
+    std::cout << std::fixed << std::setprecision(2) << std::setw(8)
+              << window_size << std::setw(16) << window_filter_ms
+              << std::setw(16) << integral_ms << std::setw(16)
+              << integral_refine_ms << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/rgbd.hpp>
+
+#include "depth_segmentation/depth_segmentation.h"
+#include "depth_segmentation/timing.h"
+
+DEFINE_string(depth_dir, "",
+              "Directory with the depth images, either 16 bit in millimeters "
+              "or 32 bit float in meters. Synthetic scenes are used if empty.");
+DEFINE_string(rgb_dir, "",
+              "Directory with the rgb images matching the depth images by "
+              "sorted file name. A constant color is used if empty.");
+DEFINE_double(fx, 574.0527954101562, "Depth camera focal length in x.");
+DEFINE_double(fy, 574.0527954101562, "Depth camera focal length in y.");
+DEFINE_double(cx, 319.5, "Depth camera principal point in x.");
+DEFINE_double(cy, 239.5, "Depth camera principal point in y.");
+DEFINE_int32(width, 640, "Width of the synthetic scenes.");
+DEFINE_int32(height, 480, "Height of the synthetic scenes.");
+DEFINE_int32(num_synthetic_frames, 20, "Number of synthetic scenes.");
+DEFINE_int32(num_iterations, 3, "Number of passes over all frames.");
+DEFINE_string(threads, "1,2,4,8",
+              "Comma separated OpenMP thread counts to benchmark.");
+DEFINE_bool(concurrent_stages, false,
+            "Run the independent edge map stages concurrently.");
+DEFINE_bool(compact_maps, false,
+            "Store the binary edge maps with one byte per pixel.");
+DEFINE_bool(incremental, false,
+            "Only recompute the maps of the tiles that changed between "
+            "consecutive frames.");
+DEFINE_int32(pyramid_level, 0,
+             "Compute the edge map stages on this pyramid level and report "
+             "the label agreement with and the speedup over the full "
+             "resolution.");
+
+namespace depth_segmentation {
+
+struct Frame {
+  cv::Mat depth_image;
+  cv::Mat rgb_image;
+};
+
+// Creates a slanted plane with a few boxes in front of it, similar to the
+// scenes of the unit tests.
+Frame createSyntheticFrame(const size_t width, const size_t height,
+                           std::mt19937* generator) {
+  CHECK_NOTNULL(generator);
+  Frame frame;
+  frame.depth_image = cv::Mat(height, width, CV_32FC1);
+  for (size_t y = 0u; y < height; ++y) {
+    for (size_t x = 0u; x < width; ++x) {
+      frame.depth_image.at<float>(y, x) = 2.0f + 0.5f * x / width;
+    }
+  }
+  frame.rgb_image = cv::Mat(height, width, CV_8UC3, cv::Scalar(90, 90, 90));
+  std::uniform_int_distribution<int> num_boxes_distribution(1, 8);
+  std::uniform_real_distribution<float> fraction_distribution(0.0f, 0.8f);
+  std::uniform_real_distribution<float> size_distribution(0.05f, 0.2f);
+  std::uniform_real_distribution<float> depth_distribution(0.6f, 1.8f);
+  const int num_boxes = num_boxes_distribution(*generator);
+  for (int i = 0; i < num_boxes; ++i) {
+    const cv::Rect box(width * fraction_distribution(*generator),
+                       height * fraction_distribution(*generator),
+                       width * size_distribution(*generator),
+                       height * size_distribution(*generator));
+    const float depth = depth_distribution(*generator);
+    frame.depth_image(box).setTo(cv::Scalar(depth));
+    frame.rgb_image(box).setTo(
+        cv::Scalar(255.0f * depth / 1.8f, 40.0f * i, 255.0f - 30.0f * i));
+  }
+  return frame;
+}
+
+std::vector<Frame> loadFrames(const std::string& depth_dir,
+                              const std::string& rgb_dir) {
+  std::vector<cv::String> depth_files;
+  cv::glob(depth_dir, depth_files);
+  std::sort(depth_files.begin(), depth_files.end());
+  std::vector<cv::String> rgb_files;
+  if (!rgb_dir.empty()) {
+    cv::glob(rgb_dir, rgb_files);
+    std::sort(rgb_files.begin(), rgb_files.end());
+    CHECK_EQ(rgb_files.size(), depth_files.size())
+        << "Every depth image needs a matching rgb image.";
+  }
+
+  std::vector<Frame> frames;
+  frames.reserve(depth_files.size());
+  for (size_t i = 0u; i < depth_files.size(); ++i) {
+    Frame frame;
+    const cv::Mat depth_image =
+        cv::imread(depth_files[i], cv::IMREAD_ANYDEPTH);
+    CHECK(!depth_image.empty()) << "Failed to read " << depth_files[i];
+    if (depth_image.type() == CV_16UC1) {
+      cv::rgbd::rescaleDepth(depth_image, CV_32FC1, frame.depth_image);
+    } else {
+      CHECK_EQ(depth_image.type(), CV_32FC1)
+          << "Depth image " << depth_files[i] << " is of unknown type.";
+      frame.depth_image = depth_image;
+    }
+    if (rgb_files.empty()) {
+      frame.rgb_image = cv::Mat(frame.depth_image.size(), CV_8UC3,
+                                cv::Scalar(90, 90, 90));
+    } else {
+      frame.rgb_image = cv::imread(rgb_files[i], cv::IMREAD_COLOR);
+      CHECK_EQ(frame.rgb_image.size(), frame.depth_image.size());
+    }
+    frames.push_back(frame);
+  }
+  return frames;
+}
+
+// Runs all stages of the pipeline on one frame, in the same way as
+// segmentSingleFrame but reusing the segmenter across frames.
+void segmentFrame(const Frame& frame, DepthSegmenter* depth_segmenter,
+                  SegmentTable* segments) {
+  CHECK_NOTNULL(depth_segmenter);
+  CHECK_NOTNULL(segments);
+  ScopedStageTimer frame_timer(Stage::kFrame,
+                               depth_segmenter->getActiveStageTimer());
+  const cv::Size image_size = frame.depth_image.size();
+  cv::Mat depth_map;
+  cv::Mat normal_map;
+  cv::Mat edge_map;
+  depth_segmenter->computeGeometricMaps(frame.depth_image, frame.depth_image,
+                                        &depth_map, &normal_map, &edge_map);
+
+  cv::Mat remove_no_values = cv::Mat::zeros(image_size, CV_32FC1);
+  edge_map.copyTo(remove_no_values, frame.depth_image == frame.depth_image);
+  cv::Mat label_map;
+  std::vector<SegmentMask> segment_masks;
+  // cv::imread loads the rgb images in BGR order.
+  depth_segmenter->labelMap(frame.rgb_image, true, frame.depth_image,
+                            depth_map, remove_no_values, normal_map, &label_map,
+                            &segment_masks, segments);
+}
+
+// Label image of the frame, as published by the label image output mode.
+void computeLabelImage(const Frame& frame, DepthSegmenter* depth_segmenter,
+                       cv::Mat* label_image) {
+  CHECK_NOTNULL(depth_segmenter);
+  CHECK_NOTNULL(label_image);
+  cv::Mat depth_map;
+  cv::Mat normal_map;
+  cv::Mat edge_map;
+  depth_segmenter->computeGeometricMaps(frame.depth_image, frame.depth_image,
+                                        &depth_map, &normal_map, &edge_map);
+  cv::Mat remove_no_values = cv::Mat::zeros(edge_map.size(), CV_32FC1);
+  edge_map.copyTo(remove_no_values, frame.depth_image == frame.depth_image);
+  std::vector<SegmentDescriptor> descriptors;
+  depth_segmenter->labelImage(frame.depth_image, depth_map, remove_no_values,
+                              normal_map, label_image, &descriptors);
+}
+
+std::vector<int> parseThreadCounts(const std::string& threads) {
+  std::vector<int> thread_counts;
+  std::stringstream stream(threads);
+  std::string token;
+  while (std::getline(stream, token, ',')) {
+    const int thread_count = std::atoi(token.c_str());
+    CHECK_GT(thread_count, 0) << "Invalid thread count: " << token;
+    thread_counts.push_back(thread_count);
+  }
+  return thread_counts;
+}
+
+void printStatistics(const StageTimer& stage_timer) {
+  std::cout << std::setw(25) << "stage" << std::setw(10) << "fps"
+            << std::setw(10) << "mean" << std::setw(10) << "p50"
+            << std::setw(10) << "p95" << std::setw(10) << "p99"
+            << std::setw(10) << "max" << std::endl;
+  for (size_t i = 0u; i < kNumStages; ++i) {
+    const Stage stage = static_cast<Stage>(i);
+    const StageStatistics statistics = stage_timer.getStatistics(stage);
+    if (statistics.num_samples == 0u) {
+      continue;
+    }
+    std::cout << std::fixed << std::setprecision(2) << std::setw(25)
+              << getStageName(stage) << std::setw(10)
+              << 1000.0 / statistics.mean << std::setw(10) << statistics.mean
+              << std::setw(10) << statistics.p50 << std::setw(10)
+              << statistics.p95 << std::setw(10) << statistics.p99
+              << std::setw(10) << statistics.max << std::endl;
+  }
+}
+
+}  // namespace depth_segmentation
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK_GT(FLAGS_num_iterations, 0);
+
+  std::vector<depth_segmentation::Frame> frames;
+  if (FLAGS_depth_dir.empty()) {
+    CHECK_GT(FLAGS_num_synthetic_frames, 0);
+    std::mt19937 generator(42u);
+    for (int i = 0; i < FLAGS_num_synthetic_frames; ++i) {
+      frames.push_back(depth_segmentation::createSyntheticFrame(
+          FLAGS_width, FLAGS_height, &generator));
+    }
+  } else {
+    frames = depth_segmentation::loadFrames(FLAGS_depth_dir, FLAGS_rgb_dir);
+  }
+  CHECK(!frames.empty()) << "No frames to benchmark.";
+  const cv::Size image_size = frames.front().depth_image.size();
+
+  cv::Mat camera_matrix = cv::Mat::eye(3, 3, CV_32FC1);
+  camera_matrix.at<float>(0, 0) = FLAGS_fx;
+  camera_matrix.at<float>(0, 2) = FLAGS_cx;
+  camera_matrix.at<float>(1, 1) = FLAGS_fy;
+  camera_matrix.at<float>(1, 2) = FLAGS_cy;
+  depth_segmentation::DepthCamera depth_camera;
+  depth_camera.initialize(image_size.height, image_size.width, CV_32FC1,
+                          camera_matrix);
+  depth_segmentation::Params params;
+  params.label.display = false;
+  params.timing.enable = true;
+  params.concurrent_stages = FLAGS_concurrent_stages;
+  params.compact_maps = FLAGS_compact_maps;
+  params.incremental.enable = FLAGS_incremental;
+  CHECK_GE(FLAGS_pyramid_level, 0);
+  params.pyramid.level = FLAGS_pyramid_level;
+  depth_segmentation::DepthSegmenter depth_segmenter(depth_camera, params);
+  depth_segmenter.initialize();
+
+  std::cout << frames.size() << " frames of " << image_size.width << "x"
+            << image_size.height << ", " << FLAGS_num_iterations
+            << " iterations, times in [ms]." << std::endl;
+  depth_segmentation::SegmentTable segments;
+  for (const int num_threads :
+       depth_segmentation::parseThreadCounts(FLAGS_threads)) {
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#else
+    if (num_threads != 1) {
+      LOG(WARNING) << "Built without OpenMP, running single threaded.";
+    }
+#endif
+    // Warm up the workspace and the caches before measuring.
+    depth_segmentation::segmentFrame(frames.front(), &depth_segmenter,
+                                     &segments);
+    depth_segmenter.getMutableStageTimer()->reset();
+    for (int i = 0; i < FLAGS_num_iterations; ++i) {
+      for (const depth_segmentation::Frame& frame : frames) {
+        CHECK_EQ(frame.depth_image.size(), image_size);
+        depth_segmentation::segmentFrame(frame, &depth_segmenter, &segments);
+      }
+    }
+    std::cout << std::endl << "OpenMP threads: " << num_threads << std::endl;
+    depth_segmentation::printStatistics(depth_segmenter.getStageTimer());
+  }
+
+  if (FLAGS_pyramid_level > 0) {
+    depth_segmentation::Params reference_params = params;
+    reference_params.pyramid.level = 0u;
+    reference_params.timing.enable = false;
+    depth_segmentation::DepthSegmenter reference_segmenter(depth_camera,
+                                                           reference_params);
+    reference_segmenter.initialize();
+    params.timing.enable = false;
+    // Both segmenters are timed from the depth image to the label image, with
+    // the last thread count and after warming up their workspaces.
+    cv::Mat label_image;
+    cv::Mat reference_label_image;
+    depth_segmentation::computeLabelImage(frames.front(), &depth_segmenter,
+                                          &label_image);
+    depth_segmentation::computeLabelImage(frames.front(), &reference_segmenter,
+                                          &reference_label_image);
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+    Milliseconds pyramid_time(0.0);
+    Milliseconds reference_time(0.0);
+    double agreement_sum = 0.0;
+    for (const depth_segmentation::Frame& frame : frames) {
+      const auto start = std::chrono::steady_clock::now();
+      depth_segmentation::computeLabelImage(frame, &depth_segmenter,
+                                            &label_image);
+      const auto pyramid_end = std::chrono::steady_clock::now();
+      depth_segmentation::computeLabelImage(frame, &reference_segmenter,
+                                            &reference_label_image);
+      reference_time += std::chrono::steady_clock::now() - pyramid_end;
+      pyramid_time += pyramid_end - start;
+      agreement_sum += depth_segmentation::computeLabelAgreement(
+          label_image, reference_label_image);
+    }
+    std::cout << std::endl
+              << "Label agreement with the full resolution: "
+              << agreement_sum / frames.size() << std::endl
+              << "Label image time [ms], pyramid level "
+              << FLAGS_pyramid_level << ": "
+              << pyramid_time.count() / frames.size()
+              << ", full resolution: "
+              << reference_time.count() / frames.size()
+              << ", speedup: " << reference_time / pyramid_time << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,225 @@
+#ifndef DEPTH_SEGMENTATION_BOUNDED_QUEUE_H_
+#define DEPTH_SEGMENTATION_BOUNDED_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include <glog/logging.h>
+
+namespace depth_segmentation {
+
+// Lock-free bounded multi-producer multi-consumer queue after Dmitry Vyukov.
+// Every cell carries a sequence number that tells producers and consumers
+// whether it is free or filled for their current position. The number of
+// cells is a power of two, a separate counter bounds the number of values
+// to the exact capacity.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(const size_t capacity)
+      : capacity_(capacity),
+        num_cells_(roundUpToPowerOfTwo(capacity)),
+        mask_(num_cells_ - 1u),
+        cells_(new Cell[num_cells_]),
+        size_(0u),
+        enqueue_position_(0u),
+        dequeue_position_(0u) {
+    for (size_t i = 0u; i < num_cells_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Moves the value into the queue, returns false and leaves the value
+  // untouched if the queue is full.
+  bool tryPush(T* value) {
+    CHECK_NOTNULL(value);
+    // Reserve a place first, such that no more than capacity values are ever
+    // queued.
+    if (size_.fetch_add(1u, std::memory_order_acquire) >= capacity_) {
+      size_.fetch_sub(1u, std::memory_order_relaxed);
+      return false;
+    }
+    Cell* cell;
+    size_t position = enqueue_position_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[position & mask_];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const std::ptrdiff_t difference =
+          static_cast<std::ptrdiff_t>(sequence) -
+          static_cast<std::ptrdiff_t>(position);
+      if (difference == 0) {
+        if (enqueue_position_.compare_exchange_weak(
+                position, position + 1u, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        // The cell is still being read by a consumer.
+        size_.fetch_sub(1u, std::memory_order_relaxed);
+        return false;
+      } else {
+        position = enqueue_position_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(*value);
+    cell->sequence.store(position + 1u, std::memory_order_release);
+    return true;
+  }
+
+  // Moves the oldest value out of the queue, returns false if it is empty.
+  bool tryPop(T* value) {
+    CHECK_NOTNULL(value);
+    Cell* cell;
+    size_t position = dequeue_position_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[position & mask_];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const std::ptrdiff_t difference =
+          static_cast<std::ptrdiff_t>(sequence) -
+          static_cast<std::ptrdiff_t>(position + 1u);
+      if (difference == 0) {
+        if (dequeue_position_.compare_exchange_weak(
+                position, position + 1u, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = dequeue_position_.load(std::memory_order_relaxed);
+      }
+    }
+    *value = std::move(cell->value);
+    cell->sequence.store(position + mask_ + 1u, std::memory_order_release);
+    // Only released once the cell is free again.
+    size_.fetch_sub(1u, std::memory_order_release);
+    return true;
+  }
+
+  inline size_t capacity() const { return capacity_; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  static size_t roundUpToPowerOfTwo(const size_t capacity) {
+    CHECK_GT(capacity, 0u);
+    size_t num_cells = 1u;
+    while (num_cells < capacity) {
+      num_cells <<= 1u;
+    }
+    // A single cell can not tell a full from an empty queue.
+    return std::max<size_t>(num_cells, 2u);
+  }
+
+  static constexpr size_t kCacheLineSize = 64u;
+
+  const size_t capacity_;
+  const size_t num_cells_;
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  std::atomic<size_t> size_;
+  alignas(kCacheLineSize) std::atomic<size_t> enqueue_position_;
+  alignas(kCacheLineSize) std::atomic<size_t> dequeue_position_;
+};
+
+enum class QueueFullPolicy {
+  // Discard the oldest queued value to make room for the new one.
+  kDropOldest = 0,
+  // Block the producer until a consumer made room.
+  kBackpressure = 1,
+};
+
+// Waits a little longer on every call, to not burn a core while a queue stays
+// empty or full.
+class Backoff {
+ public:
+  Backoff() : num_waits_(0u) {}
+  void wait() {
+    constexpr size_t kNumYields = 16u;
+    constexpr int kMaxSleepMicroseconds = 1000;
+    if (num_waits_ < kNumYields) {
+      std::this_thread::yield();
+    } else {
+      const size_t exponent = std::min<size_t>(num_waits_ - kNumYields, 7u);
+      const int sleep_microseconds =
+          std::min(kMaxSleepMicroseconds, 10 << exponent);
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(sleep_microseconds));
+    }
+    ++num_waits_;
+  }
+  void reset() { num_waits_ = 0u; }
+
+ private:
+  size_t num_waits_;
+};
+
+// Pushes the value according to the policy and returns the number of values
+// that were dropped to make room. Gives up and drops the value itself if
+// running is cleared while waiting for room, which is then left in value.
+// The oldest values dropped to make room are moved to dropped_values if it
+// is given and has room, e.g. to reuse their buffers, and destroyed
+// otherwise.
+template <typename T>
+size_t pushWithPolicy(const QueueFullPolicy policy,
+                      const std::atomic<bool>& running, T* value,
+                      BoundedQueue<T>* queue, BoundedQueue<T>* dropped_values) {
+  CHECK_NOTNULL(value);
+  CHECK_NOTNULL(queue);
+  size_t num_dropped = 0u;
+  Backoff backoff;
+  while (!queue->tryPush(value)) {
+    if (policy == QueueFullPolicy::kDropOldest) {
+      T oldest_value;
+      if (queue->tryPop(&oldest_value)) {
+        ++num_dropped;
+        if (dropped_values != nullptr) {
+          dropped_values->tryPush(&oldest_value);
+        }
+      }
+    } else {
+      if (!running.load(std::memory_order_relaxed)) {
+        return num_dropped + 1u;
+      }
+      backoff.wait();
+    }
+  }
+  return num_dropped;
+}
+
+template <typename T>
+size_t pushWithPolicy(const QueueFullPolicy policy,
+                      const std::atomic<bool>& running, T* value,
+                      BoundedQueue<T>* queue) {
+  return pushWithPolicy(policy, running, value, queue,
+                        static_cast<BoundedQueue<T>*>(nullptr));
+}
+
+// Pops the oldest value, waiting while the queue is empty. Returns false once
+// running is cleared and the queue is empty.
+template <typename T>
+bool waitAndPop(const std::atomic<bool>& running, T* value,
+                BoundedQueue<T>* queue) {
+  CHECK_NOTNULL(value);
+  CHECK_NOTNULL(queue);
+  Backoff backoff;
+  while (!queue->tryPop(value)) {
+    if (!running.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    backoff.wait();
+  }
+  return true;
+}
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_BOUNDED_QUEUE_H_
@@ -5,6 +5,8 @@
 #include <omp.h>
 #endif
 
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -14,13 +16,139 @@
 #include <opencv2/viz/vizcore.hpp>
 
 namespace depth_segmentation {
-struct Segment {
+// Instance and semantic label of segments without an overlapping instance.
+constexpr size_t kUnassignedLabel = 0u;
+
+// All segments of a frame in structure-of-arrays layout. The points, normals
+// and colors of all segments share one contiguous buffer each, segment i
+// occupying the range [offsets[i], offsets[i] + sizes[i]).
+struct SegmentTable {
+  // Removes all segments while keeping the allocated memory.
+  void clear() {
+    points.clear();
+    normals.clear();
+    original_colors.clear();
+    offsets.clear();
+    sizes.clear();
+    labels.clear();
+    instance_labels.clear();
+    semantic_labels.clear();
+  }
+  // Appends a segment of the given number of points. The buffers are not
+  // resized, call resizeBuffers once all segments have been added.
+  void addSegment(const size_t size, const size_t label) {
+    offsets.push_back(offsets.empty() ? 0u : offsets.back() + sizes.back());
+    sizes.push_back(size);
+    labels.push_back(label);
+    instance_labels.push_back(kUnassignedLabel);
+    semantic_labels.push_back(kUnassignedLabel);
+  }
+  void resizeBuffers() {
+    const size_t num_points =
+        offsets.empty() ? 0u : offsets.back() + sizes.back();
+    points.resize(num_points);
+    normals.resize(num_points);
+    original_colors.resize(num_points);
+  }
+  inline size_t size() const { return offsets.size(); }
+  inline bool empty() const { return offsets.empty(); }
+
   std::vector<cv::Vec3f> points;
   std::vector<cv::Vec3f> normals;
   std::vector<cv::Vec3f> original_colors;
-  std::set<size_t> label;
-  std::set<size_t> instance_label;
-  std::set<size_t> semantic_label;
+  std::vector<size_t> offsets;
+  std::vector<size_t> sizes;
+  std::vector<size_t> labels;
+  std::vector<size_t> instance_labels;
+  std::vector<size_t> semantic_labels;
+};
+
+// Pixels of a segment as runs of consecutive pixels along the image rows, in
+// row-major order. Memory and the cost of the operations scale with the area
+// of the segment rather than with the size of the frame.
+struct SegmentMask {
+  // The pixels [x_begin, x_end) of row y.
+  struct Run {
+    int y;
+    int x_begin;
+    int x_end;
+  };
+
+  // Removes all pixels while keeping the allocated memory.
+  void clear() {
+    runs.clear();
+    num_pixels = 0u;
+  }
+  // Pixels have to be added in row-major order.
+  void addPixel(const int y, const int x) {
+    if (!runs.empty() && runs.back().y == y && runs.back().x_end == x) {
+      ++runs.back().x_end;
+    } else {
+      runs.push_back(Run{y, x, x + 1});
+    }
+    ++num_pixels;
+  }
+  inline size_t size() const { return num_pixels; }
+  inline bool empty() const { return num_pixels == 0u; }
+  cv::Rect boundingBox() const {
+    if (runs.empty()) {
+      return cv::Rect();
+    }
+    int x_min = runs.front().x_begin;
+    int x_max = runs.front().x_end;
+    for (const Run& run : runs) {
+      x_min = std::min(x_min, run.x_begin);
+      x_max = std::max(x_max, run.x_end);
+    }
+    return cv::Rect(x_min, runs.front().y, x_max - x_min,
+                    runs.back().y - runs.front().y + 1);
+  }
+  // Moves all pixels by the offset, e.g. from a cropped image to the frame.
+  void shift(const cv::Point& offset) {
+    for (Run& run : runs) {
+      run.y += offset.y;
+      run.x_begin += offset.x;
+      run.x_end += offset.x;
+    }
+  }
+  // Number of pixels of the segment that are non-zero in the CV_8UC1 image.
+  size_t countOverlap(const cv::Mat& image) const {
+    CHECK_EQ(image.type(), CV_8UC1);
+    size_t overlap = 0u;
+    for (const Run& run : runs) {
+      const uint8_t* row = image.ptr<uint8_t>(run.y);
+      for (int x = run.x_begin; x < run.x_end; ++x) {
+        overlap += row[x] > 0u;
+      }
+    }
+    return overlap;
+  }
+  // Renders the mask into a CV_8UC1 image of the given size, with the pixels
+  // of the segment set to 255.
+  void toMat(const cv::Size& size, cv::Mat* mask) const {
+    CHECK_NOTNULL(mask);
+    *mask = cv::Mat::zeros(size, CV_8UC1);
+    for (const Run& run : runs) {
+      mask->row(run.y).colRange(run.x_begin, run.x_end).setTo(cv::Scalar(255));
+    }
+  }
+
+  std::vector<Run> runs;
+  size_t num_pixels = 0u;
+};
+
+// Compact statistics of a segment of the label image, in place of its points.
+struct SegmentDescriptor {
+  // Label of the segment before the dense relabelling.
+  size_t label = 0u;
+  size_t num_pixels = 0u;
+  // Mean of the points with valid depth in the camera frame.
+  cv::Vec3f centroid = cv::Vec3f(0.0f, 0.0f, 0.0f);
+  // Normalized sum of the valid normals.
+  cv::Vec3f mean_normal = cv::Vec3f(0.0f, 0.0f, 0.0f);
+  cv::Rect bounding_box;
+  size_t instance_label = kUnassignedLabel;
+  size_t semantic_label = kUnassignedLabel;
 };
 
 const static std::string kDebugWindowName = "DebugImages";
@@ -31,13 +159,15 @@ enum class SurfaceNormalEstimationMethod {
   kLinemod = cv::rgbd::RgbdNormals::RGBD_NORMALS_METHOD_LINEMOD,
   kSri = cv::rgbd::RgbdNormals::RGBD_NORMALS_METHOD_SRI,
   kDepthWindowFilter = 3,
+  kIntegralImage = 4,
 };
 
 struct SurfaceNormalParams {
   SurfaceNormalParams() {
     CHECK_EQ(window_size % 2u, 1u);
     CHECK_GT(window_size, 1u);
-    if (method != SurfaceNormalEstimationMethod::kDepthWindowFilter) {
+    if (method != SurfaceNormalEstimationMethod::kDepthWindowFilter &&
+        method != SurfaceNormalEstimationMethod::kIntegralImage) {
       CHECK_LT(window_size, 8u);
     }
   }
@@ -46,11 +176,20 @@ struct SurfaceNormalParams {
       SurfaceNormalEstimationMethod::kDepthWindowFilter;
   bool display = false;
   double distance_factor_threshold = 0.05;
+  // Re-estimate the integral image normals with the depth window filter
+  // wherever a window point might be rejected by the distance threshold.
+  bool use_distance_refinement = true;
+};
+
+enum class MaxDistanceMapMethod {
+  kFilter = 0,
+  kFused = 1,
 };
 
 struct MaxDistanceMapParams {
   MaxDistanceMapParams() { CHECK_EQ(window_size % 2u, 1u); }
   bool use_max_distance = true;
+  MaxDistanceMapMethod method = MaxDistanceMapMethod::kFused;
   size_t window_size = 1u;
   bool display = false;
   bool exclude_nan_as_max_distance = false;
@@ -65,17 +204,29 @@ struct MaxDistanceMapParams {
   double sensor_min_distance = 0.02;
 };
 
+enum class DepthDiscontinuityMapMethod {
+  kMorphology = 0,
+  kFused = 1,
+};
+
 struct DepthDiscontinuityMapParams {
   DepthDiscontinuityMapParams() { CHECK_EQ(kernel_size % 2u, 1u); }
   bool use_discontinuity = true;
+  DepthDiscontinuityMapMethod method = DepthDiscontinuityMapMethod::kFused;
   size_t kernel_size = 3u;
   double discontinuity_ratio = 0.01;
   bool display = false;
 };
 
+enum class MinConvexityMapMethod {
+  kFilter = 0,
+  kFused = 1,
+};
+
 struct MinConvexityMapParams {
   MinConvexityMapParams() { CHECK_EQ(window_size % 2u, 1u); }
   bool use_min_convexity = true;
+  MinConvexityMapMethod method = MinConvexityMapMethod::kFused;
   size_t morphological_opening_size = 1u;
   size_t window_size = 5u;
   size_t step_size = 1u;
@@ -97,10 +248,18 @@ struct FinalEdgeMapParams {
 enum class LabelMapMethod {
   kFloodFill = 0,
   kContour = 1,
+  kConnectedComponents = 2,
+};
+
+enum class EdgeReassignmentMethod {
+  kWindowSearch = 0,
+  kJumpFlooding = 1,
 };
 
 struct LabelMapParams {
   LabelMapMethod method = LabelMapMethod::kContour;
+  EdgeReassignmentMethod edge_reassignment_method =
+      EdgeReassignmentMethod::kWindowSearch;
   size_t min_size = 500u;
   bool use_inpaint = false;
   size_t inpaint_method = 0u;
@@ -112,6 +271,58 @@ struct SemanticInstanceSegmentationParams {
   float overlap_threshold = 0.8f;
 };
 
+struct TimingParams {
+  // Collect the wall time of every stage.
+  bool enable = false;
+  // Publish the collected statistics on the diagnostics topic.
+  bool publish_diagnostics = false;
+  // Rate of the diagnostics in Hz.
+  double diagnostics_rate = 1.0;
+};
+
+struct IncrementalParams {
+  // Only recompute the edge map for the tiles whose depth changed since they
+  // were last computed, and reuse the cached maps elsewhere. Requires the
+  // depth window filter or integral image normals.
+  bool enable = false;
+  size_t tile_size = 64u;
+  // A tile changed if the depth of one of its pixels moved by more than this
+  // many times the axial noise of the max distance noise model.
+  double noise_thresholding_factor = 3.0;
+  // Recompute the whole frame after this many incremental frames, 0 to never
+  // do so.
+  size_t full_update_interval = 30u;
+};
+
+struct PyramidParams {
+  // Number of times the depth image is halved before the normals, max
+  // distance and min convexity maps are computed, 0 for full resolution.
+  // Requires the depth window filter or integral image normals. The window,
+  // kernel and morphology sizes of the stages are not scaled, they apply to
+  // the pixels of the level and cover 2^level times the full resolution
+  // extent. The labels are computed on the level as well, only the pixels
+  // along their boundaries are reassigned at full resolution. Above level 1,
+  // the middle of wide edges may lie beyond the reassignment window and stay
+  // unlabeled.
+  size_t level = 0u;
+};
+
+struct RoiParams {
+  // Only segment the pixels within the rectangle whose depth lies within
+  // [min_depth, max_depth]. All stages run on the cropped images, the outputs
+  // keep the full frame coordinates. Takes precedence over the incremental
+  // and pyramid modes.
+  bool enable = false;
+  int x = 0;
+  int y = 0;
+  // Zero extends the rectangle to the image border.
+  int width = 0;
+  int height = 0;
+  double min_depth = 0.0;
+  // Zero for no upper bound.
+  double max_depth = 0.0;
+};
+
 struct IsNan {
   template <class T>
   bool operator()(T const& p) const {
@@ -129,6 +340,12 @@ struct IsNotNan {
 struct Params {
   bool dilate_depth_image = false;
   size_t dilation_size = 1u;
+  // Run the edge map stages that do not depend on each other concurrently.
+  bool concurrent_stages = false;
+  // Store the binary discontinuity, distance, convexity and edge maps as
+  // CV_8UC1 instead of CV_32FC1. Requires the fused max distance and min
+  // convexity maps with their thresholds enabled.
+  bool compact_maps = false;
   FinalEdgeMapParams final_edge;
   LabelMapParams label;
   DepthDiscontinuityMapParams depth_discontinuity;
@@ -136,10 +353,19 @@ struct Params {
   MinConvexityMapParams min_convexity;
   SurfaceNormalParams normals;
   SemanticInstanceSegmentationParams semantic_instance_segmentation;
+  TimingParams timing;
+  IncrementalParams incremental;
+  PyramidParams pyramid;
+  RoiParams roi;
   bool visualize_segmented_scene = false;
+  // Publish all segments of a frame in one message instead of one each.
+  bool batch_segments = false;
+  // Publish the label image and segment descriptors instead of point clouds.
+  bool output_label_image = false;
 };
 
-void visualizeDepthMap(const cv::Mat& depth_map, cv::viz::Viz3d* viz_3d) {
+inline void visualizeDepthMap(const cv::Mat& depth_map,
+                              cv::viz::Viz3d* viz_3d) {
   CHECK(!depth_map.empty());
   CHECK_EQ(depth_map.type(), CV_32FC3);
   CHECK_NOTNULL(viz_3d);
@@ -150,9 +376,9 @@ void visualizeDepthMap(const cv::Mat& depth_map, cv::viz::Viz3d* viz_3d) {
   viz_3d->spinOnce(0, true);
 }
 
-void visualizeDepthMapWithNormals(const cv::Mat& depth_map,
-                                  const cv::Mat& normals,
-                                  cv::viz::Viz3d* viz_3d) {
+inline void visualizeDepthMapWithNormals(const cv::Mat& depth_map,
+                                         const cv::Mat& normals,
+                                         cv::viz::Viz3d* viz_3d) {
   CHECK(!depth_map.empty());
   CHECK_EQ(depth_map.type(), CV_32FC3);
   CHECK(!normals.empty());
@@ -169,8 +395,10 @@ void visualizeDepthMapWithNormals(const cv::Mat& depth_map,
   viz_3d->spinOnce(0, true);
 }
 
-void computeCovariance(const cv::Mat& neighborhood, const cv::Vec3f& mean,
-                       const size_t neighborhood_size, cv::Mat* covariance) {
+inline void computeCovariance(const cv::Mat& neighborhood,
+                              const cv::Vec3f& mean,
+                              const size_t neighborhood_size,
+                              cv::Mat* covariance) {
   CHECK(!neighborhood.empty());
   CHECK_EQ(neighborhood.rows, 3u);
   CHECK_GT(neighborhood_size, 0u);
@@ -198,10 +426,11 @@ void computeCovariance(const cv::Mat& neighborhood, const cv::Vec3f& mean,
   covariance->at<float>(2, 1) = covariance->at<float>(1, 2);
 }
 
-size_t findNeighborhood(const cv::Mat& depth_map, const size_t window_size,
-                        const float max_distance, const size_t x,
-                        const size_t y, cv::Mat* neighborhood,
-                        cv::Vec3f* mean) {
+inline size_t findNeighborhood(const cv::Mat& depth_map,
+                               const size_t window_size,
+                               const float max_distance, const size_t x,
+                               const size_t y, cv::Mat* neighborhood,
+                               cv::Vec3f* mean) {
   CHECK(!depth_map.empty());
   CHECK_GT(window_size, 0u);
   CHECK_EQ(window_size % 2u, 1u);
@@ -254,34 +483,278 @@ size_t findNeighborhood(const cv::Mat& depth_map, const size_t window_size,
   return neighborhood_size;
 }
 
+// \brief Compute a unit vector orthogonal to the unit vector w.
+inline cv::Vec3d computeOrthogonalVector(const cv::Vec3d& w) {
+  if (std::abs(w[0]) > std::abs(w[1])) {
+    const double inverse_length = 1.0 / std::sqrt(w[0] * w[0] + w[2] * w[2]);
+    return cv::Vec3d(-w[2] * inverse_length, 0.0, w[0] * inverse_length);
+  }
+  const double inverse_length = 1.0 / std::sqrt(w[1] * w[1] + w[2] * w[2]);
+  return cv::Vec3d(0.0, w[2] * inverse_length, -w[1] * inverse_length);
+}
+
+// \brief Compute the eigenvector of a symmetric 3x3 matrix for an eigenvalue
+// of multiplicity one.
+inline cv::Vec3d computeSingleEigenvector(const cv::Matx33d& matrix,
+                                          const double eigenvalue) {
+  const cv::Vec3d row_0(matrix(0, 0) - eigenvalue, matrix(0, 1), matrix(0, 2));
+  const cv::Vec3d row_1(matrix(0, 1), matrix(1, 1) - eigenvalue, matrix(1, 2));
+  const cv::Vec3d row_2(matrix(0, 2), matrix(1, 2), matrix(2, 2) - eigenvalue);
+  // The eigenvector is orthogonal to all rows, take the most stable cross
+  // product.
+  const cv::Vec3d cross_products[3] = {row_0.cross(row_1), row_0.cross(row_2),
+                                       row_1.cross(row_2)};
+  size_t max_index = 0u;
+  double max_norm_squared = cross_products[0].dot(cross_products[0]);
+  for (size_t i = 1u; i < 3u; ++i) {
+    const double norm_squared = cross_products[i].dot(cross_products[i]);
+    if (norm_squared > max_norm_squared) {
+      max_norm_squared = norm_squared;
+      max_index = i;
+    }
+  }
+  if (max_norm_squared == 0.0) {
+    return cv::Vec3d(1.0, 0.0, 0.0);
+  }
+  return cross_products[max_index] / std::sqrt(max_norm_squared);
+}
+
+// \brief Compute the eigenvector of a symmetric 3x3 matrix for eigenvalue,
+// orthogonal to the unit eigenvector other_eigenvector.
+inline cv::Vec3d computeOrthogonalEigenvector(
+    const cv::Matx33d& matrix, const cv::Vec3d& other_eigenvector,
+    const double eigenvalue) {
+  // Solve the 2x2 eigen problem in the orthogonal complement of
+  // other_eigenvector.
+  const cv::Vec3d u = computeOrthogonalVector(other_eigenvector);
+  const cv::Vec3d v = other_eigenvector.cross(u);
+  const cv::Vec3d matrix_u = matrix * u;
+  const cv::Vec3d matrix_v = matrix * v;
+  double m_00 = u.dot(matrix_u) - eigenvalue;
+  double m_01 = u.dot(matrix_v);
+  double m_11 = v.dot(matrix_v) - eigenvalue;
+  const double abs_m_00 = std::abs(m_00);
+  const double abs_m_01 = std::abs(m_01);
+  const double abs_m_11 = std::abs(m_11);
+  if (abs_m_00 >= abs_m_11) {
+    if (std::max(abs_m_00, abs_m_01) == 0.0) {
+      return u;
+    }
+    if (abs_m_00 >= abs_m_01) {
+      m_01 /= m_00;
+      m_00 = 1.0 / std::sqrt(1.0 + m_01 * m_01);
+      m_01 *= m_00;
+    } else {
+      m_00 /= m_01;
+      m_01 = 1.0 / std::sqrt(1.0 + m_00 * m_00);
+      m_00 *= m_01;
+    }
+    return m_01 * u - m_00 * v;
+  }
+  if (std::max(abs_m_11, abs_m_01) == 0.0) {
+    return u;
+  }
+  if (abs_m_11 >= abs_m_01) {
+    m_01 /= m_11;
+    m_11 = 1.0 / std::sqrt(1.0 + m_01 * m_01);
+    m_01 *= m_11;
+  } else {
+    m_11 /= m_01;
+    m_01 = 1.0 / std::sqrt(1.0 + m_11 * m_11);
+    m_11 *= m_01;
+  }
+  return m_11 * u - m_01 * v;
+}
+
+// \brief Compute the eigenvalues and eigenvectors of a symmetric 3x3 matrix.
+//
+// Closed-form replacement for cv::eigen that works on fixed-size types only,
+// following D. Eberly, "A Robust Eigensolver for 3 x 3 Symmetric Matrices".
+// As with cv::eigen, the eigenvalues are sorted in descending order and the
+// rows of eigenvectors hold the corresponding unit eigenvectors.
+//
+inline void computeSymmetricEigen3x3(const cv::Matx33d& matrix,
+                                     cv::Vec3d* eigenvalues,
+                                     cv::Matx33d* eigenvectors) {
+  CHECK_NOTNULL(eigenvalues);
+  CHECK_NOTNULL(eigenvectors);
+
+  // Scale the matrix to avoid floating point overflow and underflow.
+  double max_abs_element = 0.0;
+  for (size_t i = 0u; i < 9u; ++i) {
+    max_abs_element = std::max(max_abs_element, std::abs(matrix.val[i]));
+  }
+  if (max_abs_element == 0.0) {
+    *eigenvalues = cv::Vec3d(0.0, 0.0, 0.0);
+    *eigenvectors = cv::Matx33d::eye();
+    return;
+  }
+  const cv::Matx33d scaled = matrix * (1.0 / max_abs_element);
+
+  cv::Vec3d values;
+  cv::Vec3d vectors[3];
+  const double off_diagonal_norm_squared = scaled(0, 1) * scaled(0, 1) +
+                                           scaled(0, 2) * scaled(0, 2) +
+                                           scaled(1, 2) * scaled(1, 2);
+  if (off_diagonal_norm_squared == 0.0) {
+    // The matrix is diagonal.
+    for (size_t i = 0u; i < 3u; ++i) {
+      values[i] = scaled(i, i);
+      vectors[i] = cv::Vec3d(0.0, 0.0, 0.0);
+      vectors[i][i] = 1.0;
+    }
+  } else {
+    const double q = cv::trace(scaled) / 3.0;
+    const double b_00 = scaled(0, 0) - q;
+    const double b_11 = scaled(1, 1) - q;
+    const double b_22 = scaled(2, 2) - q;
+    const double p = std::sqrt((b_00 * b_00 + b_11 * b_11 + b_22 * b_22 +
+                                2.0 * off_diagonal_norm_squared) /
+                               6.0);
+    const double determinant =
+        cv::determinant(scaled - q * cv::Matx33d::eye()) / (p * p * p);
+    const double half_determinant =
+        std::max(-1.0, std::min(1.0, 0.5 * determinant));
+    const double angle = std::acos(half_determinant) / 3.0;
+    constexpr double kTwoThirdsPi = 2.0 * CV_PI / 3.0;
+    // Ascending eigenvalues.
+    values[0] = q + 2.0 * p * std::cos(angle + kTwoThirdsPi);
+    values[2] = q + 2.0 * p * std::cos(angle);
+    values[1] = 3.0 * q - values[0] - values[2];
+    // Start with the eigenvalue that is guaranteed to be well separated.
+    if (half_determinant >= 0.0) {
+      vectors[2] = computeSingleEigenvector(scaled, values[2]);
+      vectors[1] = computeOrthogonalEigenvector(scaled, vectors[2], values[1]);
+      vectors[0] = vectors[1].cross(vectors[2]);
+    } else {
+      vectors[0] = computeSingleEigenvector(scaled, values[0]);
+      vectors[1] = computeOrthogonalEigenvector(scaled, vectors[0], values[1]);
+      vectors[2] = vectors[0].cross(vectors[1]);
+    }
+  }
+
+  // Sort in descending order and undo the scaling.
+  size_t order[3] = {0u, 1u, 2u};
+  std::sort(order, order + 3, [&values](const size_t lhs, const size_t rhs) {
+    return values[lhs] > values[rhs];
+  });
+  for (size_t i = 0u; i < 3u; ++i) {
+    (*eigenvalues)[i] = values[order[i]] * max_abs_element;
+    for (size_t coordinate = 0u; coordinate < 3u; ++coordinate) {
+      (*eigenvectors)(i, coordinate) = vectors[order[i]][coordinate];
+    }
+  }
+}
+
+// \brief Compute the covariance of the neighborhood of a point.
+//
+// Equivalent to findNeighborhood followed by computeCovariance, but the window
+// is traversed twice instead of storing the neighborhood, such that no memory
+// is allocated. Returns the neighborhood size.
+//
+inline size_t computeNeighborhoodCovariance(const cv::Mat& depth_map,
+                                            const size_t window_size,
+                                            const float max_distance,
+                                            const size_t x, const size_t y,
+                                            cv::Matx33f* covariance) {
+  CHECK_NOTNULL(covariance);
+  const int half_window = window_size / 2u;
+  const int y_min = std::max(static_cast<int>(y) - half_window, 0);
+  const int y_max =
+      std::min(static_cast<int>(y) + half_window + 1, depth_map.rows);
+  const int x_min = std::max(static_cast<int>(x) - half_window, 0);
+  const int x_max =
+      std::min(static_cast<int>(x) + half_window + 1, depth_map.cols);
+  const cv::Vec3f mid_point = depth_map.at<cv::Vec3f>(y, x);
+
+  size_t neighborhood_size = 0u;
+  cv::Vec3f mean(0.0f, 0.0f, 0.0f);
+  for (int y_idx = y_min; y_idx < y_max; ++y_idx) {
+    const cv::Vec3f* row = depth_map.ptr<cv::Vec3f>(y_idx);
+    for (int x_idx = x_min; x_idx < x_max; ++x_idx) {
+      const cv::Vec3f difference = mid_point - row[x_idx];
+      if (cv::sqrt(difference.dot(difference)) < max_distance) {
+        mean += row[x_idx];
+        ++neighborhood_size;
+      }
+    }
+  }
+  if (neighborhood_size == 0u) {
+    return 0u;
+  }
+  mean /= static_cast<float>(neighborhood_size);
+
+  *covariance = cv::Matx33f::zeros();
+  for (int y_idx = y_min; y_idx < y_max; ++y_idx) {
+    const cv::Vec3f* row = depth_map.ptr<cv::Vec3f>(y_idx);
+    for (int x_idx = x_min; x_idx < x_max; ++x_idx) {
+      const cv::Vec3f difference = mid_point - row[x_idx];
+      if (cv::sqrt(difference.dot(difference)) < max_distance) {
+        const cv::Vec3f point = row[x_idx] - mean;
+        (*covariance)(0, 0) += point[0] * point[0];
+        (*covariance)(0, 1) += point[0] * point[1];
+        (*covariance)(0, 2) += point[0] * point[2];
+        (*covariance)(1, 1) += point[1] * point[1];
+        (*covariance)(1, 2) += point[1] * point[2];
+        (*covariance)(2, 2) += point[2] * point[2];
+      }
+    }
+  }
+  // Assign the symmetric elements of the covariance matrix.
+  (*covariance)(1, 0) = (*covariance)(0, 1);
+  (*covariance)(2, 0) = (*covariance)(0, 2);
+  (*covariance)(2, 1) = (*covariance)(1, 2);
+  return neighborhood_size;
+}
+
+// \brief Compute the normal of a single point from its neighborhood.
+//
+// Returns false if less than two points are within max_distance of the point.
+//
+inline bool computeNeighborhoodNormal(const cv::Mat& depth_map,
+                                      const size_t window_size,
+                                      const float max_distance, const size_t x,
+                                      const size_t y, cv::Vec3f* normal) {
+  CHECK_NOTNULL(normal);
+  cv::Matx33f covariance;
+  if (computeNeighborhoodCovariance(depth_map, window_size, max_distance, x, y,
+                                    &covariance) <= 1u) {
+    return false;
+  }
+  cv::Vec3d eigenvalues;
+  cv::Matx33d eigenvectors;
+  computeSymmetricEigen3x3(static_cast<cv::Matx33d>(covariance), &eigenvalues,
+                           &eigenvectors);
+  // Get the Eigenvector corresponding to the smallest Eigenvalue.
+  constexpr size_t n_th_eigenvector = 2u;
+  for (size_t coordinate = 0u; coordinate < 3u; ++coordinate) {
+    (*normal)[coordinate] = eigenvectors(n_th_eigenvector, coordinate);
+  }
+  // Re-Orient normals to point towards camera.
+  if ((*normal)[2] > 0.0f) {
+    *normal = -*normal;
+  }
+  return true;
+}
+
 // \brief Compute point normals of a depth image.
 //
 // Compute the point normals by looking at a neighborhood around each pixel.
 // We're taking a standard squared kernel, where we discard points that are too
 // far away from the center point (by evaluating the Euclidean distance).
 //
-void computeOwnNormals(const SurfaceNormalParams& params,
-                       const cv::Mat& depth_map, cv::Mat* normals) {
+inline void computeOwnNormals(const SurfaceNormalParams& params,
+                              const cv::Mat& depth_map, cv::Mat* normals) {
   CHECK(!depth_map.empty());
   CHECK_EQ(depth_map.type(), CV_32FC3);
   CHECK_NOTNULL(normals);
   CHECK_EQ(depth_map.size(), normals->size());
 
-  cv::Mat neighborhood =
-      cv::Mat::zeros(3, params.window_size * params.window_size, CV_32FC1);
-  cv::Mat eigenvalues;
-  cv::Mat eigenvectors;
-  cv::Mat covariance(3, 3, CV_32FC1);
-  covariance = cv::Mat::zeros(3, 3, CV_32FC1);
-  cv::Vec3f mean;
-  cv::Vec3f mid_point;
-
   constexpr float float_nan = std::numeric_limits<float>::quiet_NaN();
-#pragma omp parallel for private(neighborhood, eigenvalues, eigenvectors, \
-                                 covariance, mean, mid_point)
+#pragma omp parallel for
   for (size_t y = 0u; y < depth_map.rows; ++y) {
     for (size_t x = 0u; x < depth_map.cols; ++x) {
-      mid_point = depth_map.at<cv::Vec3f>(y, x);
+      const cv::Vec3f& mid_point = depth_map.at<cv::Vec3f>(y, x);
       // Skip point if z value is nan.
       if (cvIsNaN(mid_point[0]) || cvIsNaN(mid_point[1]) ||
           cvIsNaN(mid_point[2]) || (mid_point[2] == 0.0)) {
@@ -291,32 +764,218 @@ void computeOwnNormals(const SurfaceNormalParams& params,
       }
       const float max_distance =
           params.distance_factor_threshold * mid_point[2];
-      mean = cv::Vec3f(0.0f, 0.0f, 0.0f);
-
-      const size_t neighborhood_size =
-          findNeighborhood(depth_map, params.window_size, max_distance, x, y,
-                           &neighborhood, &mean);
-      if (neighborhood_size > 1u) {
-        computeCovariance(neighborhood, mean, neighborhood_size, &covariance);
-        // Compute Eigen vectors.
-        cv::eigen(covariance, eigenvalues, eigenvectors);
-        // Get the Eigenvector corresponding to the smallest Eigenvalue.
-        constexpr size_t n_th_eigenvector = 2u;
+
+      if (!computeNeighborhoodNormal(depth_map, params.window_size,
+                                     max_distance, x, y,
+                                     &normals->at<cv::Vec3f>(y, x))) {
+        normals->at<cv::Vec3f>(y, x) =
+            cv::Vec3f(float_nan, float_nan, float_nan);
+      }
+    }
+  }
+}
+
+// Buffers of computeIntegralImageNormals, kept between calls such that the
+// summed-area table of a frame is not reallocated.
+struct IntegralImageNormalsBuffers {
+  cv::Mat integral;
+  cv::Mat max_input;
+  cv::Mat min_input;
+  cv::Mat window_max;
+  cv::Mat window_min;
+  cv::Mat window_element;
+};
+
+// \brief Compute point normals of a depth image using integral images.
+//
+// The point sums and outer products are accumulated in summed-area tables, such
+// that the covariance of any window is available in constant time, independent
+// of the window size. Unlike computeOwnNormals no points are rejected based on
+// their distance to the center point, unless use_distance_refinement is set. In
+// that case, all points whose window might contain a point beyond the distance
+// threshold are re-estimated with computeOwnNormals' neighborhood.
+//
+inline void computeIntegralImageNormals(const SurfaceNormalParams& params,
+                                        const cv::Mat& depth_map,
+                                        IntegralImageNormalsBuffers* buffers,
+                                        cv::Mat* normals) {
+  CHECK(!depth_map.empty());
+  CHECK_EQ(depth_map.type(), CV_32FC3);
+  CHECK_NOTNULL(buffers);
+  CHECK_NOTNULL(normals);
+  CHECK_EQ(depth_map.size(), normals->size());
+
+  // Channels: Point count, x, y, z, xx, xy, xz, yy, yz, zz.
+  constexpr size_t kNumChannels = 10u;
+  cv::Mat& integral = buffers->integral;
+  integral.create(depth_map.rows + 1, depth_map.cols + 1,
+                  CV_64FC(kNumChannels));
+  // Only the first row and column need to be zero, the others are written.
+  integral.row(0).setTo(cv::Scalar::all(0.0));
+  for (size_t y = 0u; y < depth_map.rows; ++y) {
+    const cv::Vec3f* point_row = depth_map.ptr<cv::Vec3f>(y);
+    const double* integral_above = integral.ptr<double>(y);
+    double* integral_row = integral.ptr<double>(y + 1u);
+    std::fill(integral_row, integral_row + kNumChannels, 0.0);
+    double row_sum[kNumChannels] = {0.0};
+    for (size_t x = 0u; x < depth_map.cols; ++x) {
+      const cv::Vec3f& point = point_row[x];
+      if (!cvIsNaN(point[0]) && !cvIsNaN(point[1]) && !cvIsNaN(point[2]) &&
+          point[2] != 0.0f) {
+        const double px = point[0];
+        const double py = point[1];
+        const double pz = point[2];
+        row_sum[0] += 1.0;
+        row_sum[1] += px;
+        row_sum[2] += py;
+        row_sum[3] += pz;
+        row_sum[4] += px * px;
+        row_sum[5] += px * py;
+        row_sum[6] += px * pz;
+        row_sum[7] += py * py;
+        row_sum[8] += py * pz;
+        row_sum[9] += pz * pz;
+      }
+      const size_t offset = (x + 1u) * kNumChannels;
+      for (size_t channel = 0u; channel < kNumChannels; ++channel) {
+        integral_row[offset + channel] =
+            integral_above[offset + channel] + row_sum[channel];
+      }
+    }
+  }
+
+  // Per channel bounds of the points within each window, used to find the
+  // points whose neighborhood could be affected by the distance threshold.
+  const cv::Mat& window_max = buffers->window_max;
+  const cv::Mat& window_min = buffers->window_min;
+  if (params.use_distance_refinement) {
+    constexpr float float_max = std::numeric_limits<float>::max();
+    cv::Mat& max_input = buffers->max_input;
+    cv::Mat& min_input = buffers->min_input;
+    max_input.create(depth_map.size(), CV_32FC3);
+    min_input.create(depth_map.size(), CV_32FC3);
+    for (size_t y = 0u; y < depth_map.rows; ++y) {
+      for (size_t x = 0u; x < depth_map.cols; ++x) {
+        const cv::Vec3f& point = depth_map.at<cv::Vec3f>(y, x);
+        if (cvIsNaN(point[0]) || cvIsNaN(point[1]) || cvIsNaN(point[2]) ||
+            point[2] == 0.0f) {
+          max_input.at<cv::Vec3f>(y, x) =
+              cv::Vec3f(-float_max, -float_max, -float_max);
+          min_input.at<cv::Vec3f>(y, x) =
+              cv::Vec3f(float_max, float_max, float_max);
+        } else {
+          max_input.at<cv::Vec3f>(y, x) = point;
+          min_input.at<cv::Vec3f>(y, x) = point;
+        }
+      }
+    }
+    const cv::Size window_size(params.window_size, params.window_size);
+    if (buffers->window_element.size() != window_size) {
+      buffers->window_element =
+          cv::getStructuringElement(cv::MORPH_RECT, window_size);
+    }
+    cv::dilate(max_input, buffers->window_max, buffers->window_element);
+    cv::erode(min_input, buffers->window_min, buffers->window_element);
+  }
+
+  cv::Matx33d window_covariance;
+  cv::Vec3d window_eigenvalues;
+  cv::Matx33d window_eigenvectors;
+
+  const int half_window = params.window_size / 2u;
+  constexpr float float_nan = std::numeric_limits<float>::quiet_NaN();
+#pragma omp parallel for private(window_covariance, window_eigenvalues, \
+                                 window_eigenvectors)
+  for (size_t y = 0u; y < depth_map.rows; ++y) {
+    const int y_min = std::max(static_cast<int>(y) - half_window, 0);
+    const int y_max =
+        std::min(static_cast<int>(y) + half_window + 1, depth_map.rows);
+    for (size_t x = 0u; x < depth_map.cols; ++x) {
+      const cv::Vec3f& mid_point = depth_map.at<cv::Vec3f>(y, x);
+      cv::Vec3f& normal = normals->at<cv::Vec3f>(y, x);
+      // Skip point if z value is nan.
+      if (cvIsNaN(mid_point[0]) || cvIsNaN(mid_point[1]) ||
+          cvIsNaN(mid_point[2]) || (mid_point[2] == 0.0)) {
+        normal = cv::Vec3f(float_nan, float_nan, float_nan);
+        continue;
+      }
+
+      if (params.use_distance_refinement) {
+        const float max_distance =
+            params.distance_factor_threshold * mid_point[2];
+        const cv::Vec3f& max_point = window_max.at<cv::Vec3f>(y, x);
+        const cv::Vec3f& min_point = window_min.at<cv::Vec3f>(y, x);
+        cv::Vec3f max_difference;
         for (size_t coordinate = 0u; coordinate < 3u; ++coordinate) {
-          normals->at<cv::Vec3f>(y, x)[coordinate] =
-              eigenvectors.at<float>(n_th_eigenvector, coordinate);
+          max_difference[coordinate] =
+              std::max(max_point[coordinate] - mid_point[coordinate],
+                       mid_point[coordinate] - min_point[coordinate]);
         }
-        // Re-Orient normals to point towards camera.
-        if (normals->at<cv::Vec3f>(y, x)[2] > 0.0f) {
-          normals->at<cv::Vec3f>(y, x) = -normals->at<cv::Vec3f>(y, x);
+        if (cv::sqrt(max_difference.dot(max_difference)) >= max_distance) {
+          if (!computeNeighborhoodNormal(depth_map, params.window_size,
+                                         max_distance, x, y, &normal)) {
+            normal = cv::Vec3f(float_nan, float_nan, float_nan);
+          }
+          continue;
         }
-      } else {
-        normals->at<cv::Vec3f>(y, x) =
-            cv::Vec3f(float_nan, float_nan, float_nan);
+      }
+
+      const int x_min = std::max(static_cast<int>(x) - half_window, 0);
+      const int x_max =
+          std::min(static_cast<int>(x) + half_window + 1, depth_map.cols);
+      const double* bottom_right =
+          integral.ptr<double>(y_max) + x_max * kNumChannels;
+      const double* bottom_left =
+          integral.ptr<double>(y_max) + x_min * kNumChannels;
+      const double* top_right =
+          integral.ptr<double>(y_min) + x_max * kNumChannels;
+      const double* top_left =
+          integral.ptr<double>(y_min) + x_min * kNumChannels;
+      double sums[kNumChannels];
+      for (size_t channel = 0u; channel < kNumChannels; ++channel) {
+        sums[channel] = bottom_right[channel] - bottom_left[channel] -
+                        top_right[channel] + top_left[channel];
+      }
+      const double neighborhood_size = sums[0];
+      if (neighborhood_size <= 1.0) {
+        normal = cv::Vec3f(float_nan, float_nan, float_nan);
+        continue;
+      }
+      window_covariance(0, 0) = sums[4] - sums[1] * sums[1] / neighborhood_size;
+      window_covariance(0, 1) = sums[5] - sums[1] * sums[2] / neighborhood_size;
+      window_covariance(0, 2) = sums[6] - sums[1] * sums[3] / neighborhood_size;
+      window_covariance(1, 1) = sums[7] - sums[2] * sums[2] / neighborhood_size;
+      window_covariance(1, 2) = sums[8] - sums[2] * sums[3] / neighborhood_size;
+      window_covariance(2, 2) = sums[9] - sums[3] * sums[3] / neighborhood_size;
+      // Assign the symmetric elements of the covariance matrix.
+      window_covariance(1, 0) = window_covariance(0, 1);
+      window_covariance(2, 0) = window_covariance(0, 2);
+      window_covariance(2, 1) = window_covariance(1, 2);
+
+      computeSymmetricEigen3x3(window_covariance, &window_eigenvalues,
+                               &window_eigenvectors);
+      // Get the Eigenvector corresponding to the smallest Eigenvalue.
+      constexpr size_t n_th_eigenvector = 2u;
+      for (size_t coordinate = 0u; coordinate < 3u; ++coordinate) {
+        normal[coordinate] =
+            window_eigenvectors(n_th_eigenvector, coordinate);
+      }
+      // Re-Orient normals to point towards camera.
+      if (normal[2] > 0.0f) {
+        normal = -normal;
       }
     }
   }
 }
+
+// Computes the integral image normals with buffers that only live for the
+// call, prefer passing buffers to compute the normals of every frame.
+inline void computeIntegralImageNormals(const SurfaceNormalParams& params,
+                                        const cv::Mat& depth_map,
+                                        cv::Mat* normals) {
+  IntegralImageNormalsBuffers buffers;
+  computeIntegralImageNormals(params, depth_map, &buffers, normals);
+}
 }  // namespace depth_segmentation
 
 #endif  // DEPTH_SEGMENTATION_COMMON_H_
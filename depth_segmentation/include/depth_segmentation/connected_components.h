@@ -0,0 +1,41 @@
+#ifndef DEPTH_SEGMENTATION_CONNECTED_COMPONENTS_H_
+#define DEPTH_SEGMENTATION_CONNECTED_COMPONENTS_H_
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace depth_segmentation {
+
+// Parent of the components that are not enclosed by any other component.
+constexpr int kNoParentComponent = -1;
+
+// Connected components of a binary image, both of the foreground (8-connected)
+// and of the background (4-connected). The pixels on the image border count as
+// background, so component 0 is always the background surrounding everything.
+struct ConnectedComponents {
+  // Component id of every pixel, ids are assigned in raster order of the first
+  // pixel of a component.
+  cv::Mat labels;
+  // Number of pixels of each component.
+  std::vector<size_t> sizes;
+  // The component directly enclosing each component, i.e. the surrounding
+  // background of a foreground component or the foreground component
+  // containing a hole.
+  std::vector<int> parents;
+  std::vector<bool> is_foreground;
+
+  inline size_t size() const { return sizes.size(); }
+};
+
+// Labels the connected components of the non-zero pixels of a CV_8UC1 image
+// with a union-find over pixel indices. The image is split into strips that
+// are labeled in parallel, the strip boundaries are merged afterwards and a
+// final raster pass assigns the dense ids, counts the pixels and finds the
+// enclosing component from the pixel above the first pixel of each component.
+void labelConnectedComponents(const cv::Mat& binary_image,
+                              ConnectedComponents* components);
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_CONNECTED_COMPONENTS_H_
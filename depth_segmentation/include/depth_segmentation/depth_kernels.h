@@ -0,0 +1,63 @@
+#ifndef DEPTH_SEGMENTATION_DEPTH_KERNELS_H_
+#define DEPTH_SEGMENTATION_DEPTH_KERNELS_H_
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace depth_segmentation {
+
+// Instruction sets of the vectorized kernels. AVX2 is detected at runtime,
+// NEON is available on every ARM target that is compiled with it.
+enum class SimdLevel {
+  kScalar = 0,
+  kAvx2 = 1,
+  kNeon = 2,
+};
+
+// The best instruction set supported by the CPU, detected once.
+SimdLevel getSimdLevel();
+const char* getSimdLevelName(const SimdLevel level);
+
+// Per-column and per-row rays of a pinhole camera, such that the pixel (x, y)
+// with depth z back-projects to (x_rays[x] * z, y_rays[y] * z, z), the same
+// way cv::rgbd::depthTo3d back-projects it.
+struct RayTable {
+  void compute(const cv::Mat& camera_matrix, const cv::Size& image_size);
+  inline cv::Size size() const {
+    return cv::Size(x_rays.size(), y_rays.size());
+  }
+  // Back-projects a single pixel, e.g. only the pixels of interest rather
+  // than the whole image.
+  inline cv::Vec3f backProject(const int x, const int y,
+                               const float depth) const {
+    return cv::Vec3f(x_rays[x] * depth, y_rays[y] * depth, depth);
+  }
+
+  std::vector<float> x_rays;
+  std::vector<float> y_rays;
+};
+
+// Back-projects the CV_32FC1 depth image to the CV_32FC3 depth map with the
+// rays of the table. The depth image may be cropped from the image of the
+// table at the offset.
+void backProjectDepth(const cv::Mat& depth_image, const RayTable& rays,
+                      const cv::Point& offset, cv::Mat* depth_map,
+                      const SimdLevel level = getSimdLevel());
+
+// Computes the depth discontinuity map in a single sweep: a pixel is a
+// discontinuity (1) if the largest depth difference to the pixels of the
+// kernel_size x kernel_size window around it, relative to its depth, exceeds
+// the ratio. Invalid depths count as zero and are never discontinuities, as
+// in the dilate, erode, max, divide and threshold chain of the morphology
+// method, which the result equals. The map is CV_8UC1 if it is already
+// allocated as such and CV_32FC1 otherwise.
+void computeDepthDiscontinuityMapFused(const cv::Mat& depth_image,
+                                       const int kernel_size,
+                                       const float discontinuity_ratio,
+                                       cv::Mat* depth_discontinuity_map,
+                                       const SimdLevel level = getSimdLevel());
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_DEPTH_KERNELS_H_
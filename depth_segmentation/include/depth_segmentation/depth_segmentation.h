@@ -1,12 +1,19 @@
 #ifndef DEPTH_SEGMENTATION_DEPTH_SEGMENTATION_H_
 #define DEPTH_SEGMENTATION_DEPTH_SEGMENTATION_H_
 
+#include <atomic>
+#include <mutex>
+
 #include <glog/logging.h>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/rgbd.hpp>
 
 #include "depth_segmentation/DepthSegmenterConfig.h"
 #include "depth_segmentation/common.h"
+#include "depth_segmentation/connected_components.h"
+#include "depth_segmentation/depth_kernels.h"
+#include "depth_segmentation/instance_overlap.h"
+#include "depth_segmentation/timing.h"
 
 namespace depth_segmentation {
 
@@ -20,15 +27,18 @@ class Camera {
         height_(height),
         width_(width),
         camera_matrix_(camera_matrix) {}
-  inline void initialize(const size_t height, const size_t width,
-                         const int type, const cv::Mat& camera_matrix) {
+  virtual ~Camera() {}
+  // Virtual such that the derived cameras can update what depends on the
+  // intrinsics, also if they are set through a Camera.
+  virtual void initialize(const size_t height, const size_t width,
+                          const int type, const cv::Mat& camera_matrix) {
     type_ = type;
     height_ = height;
     width_ = width;
     camera_matrix_ = camera_matrix;
     initialized_ = true;
   }
-  inline void setCameraMatrix(const cv::Mat& camera_matrix) {
+  virtual void setCameraMatrix(const cv::Mat& camera_matrix) {
     CHECK(!camera_matrix.empty());
     camera_matrix_ = camera_matrix;
   }
@@ -61,11 +71,26 @@ class Camera {
 class DepthCamera : public Camera {
  public:
   DepthCamera() {}
+  // Also computes the rays of the pixels, which are shared by everything that
+  // back-projects depth images of the camera.
+  void initialize(const size_t height, const size_t width, const int type,
+                  const cv::Mat& camera_matrix) {
+    Camera::initialize(height, width, type, camera_matrix);
+    rays_.compute(camera_matrix, cv::Size(width, height));
+  }
+  void setCameraMatrix(const cv::Mat& camera_matrix) {
+    Camera::setCameraMatrix(camera_matrix);
+    rays_.compute(camera_matrix, cv::Size(getWidth(), getHeight()));
+  }
   void setImage(const cv::Mat& image) {
     CHECK(!image.empty());
     CHECK(image.type() == CV_32FC1);
     image_ = image;
   }
+  inline const RayTable& getRayTable() const { return rays_; }
+
+ private:
+  RayTable rays_;
 };
 
 class RgbCamera : public Camera {
@@ -133,6 +158,99 @@ struct SemanticInstanceSegmentation {
   std::vector<int> labels;
 };
 
+// Full-frame buffers reused by the DepthSegmenter stages across frames, such
+// that no images need to be allocated per frame once the workspace is sized.
+struct DepthSegmenterWorkspace {
+  void allocate(const cv::Size& image_size);
+
+  // Depth discontinuity map.
+  cv::Mat depth_without_nans;
+  cv::Mat dilate_image;
+  cv::Mat erode_image;
+  cv::Mat ratio_image;
+  cv::Mat invalid_depth_mask;
+  cv::Mat depth_discontinuity_element;
+
+  // Max distance map.
+  std::vector<cv::Point> max_distance_offsets;
+  cv::Mat max_distance_kernel;
+  cv::Mat max_distance_difference_map;
+  std::vector<cv::Mat> max_distance_channels;
+  cv::Mat distance_map;
+  cv::Mat nan_mask;
+
+  // Normal map.
+  IntegralImageNormalsBuffers integral_image_normals;
+
+  // Min convexity map.
+  std::vector<cv::Point> min_convexity_offsets;
+  cv::Mat difference_kernel;
+  cv::Mat difference_map;
+  std::vector<cv::Mat> channels;
+  cv::Mat normal_kernel;
+  cv::Mat difference_times_normal;
+  cv::Mat filtered_normal_map;
+  cv::Mat normal_times_filtered_normal;
+  cv::Mat normal_nan_mask;
+  cv::Mat vector_projection;
+  cv::Mat normal_vector_projection;
+  cv::Mat convexity_mask;
+  cv::Mat concavity_mask;
+  cv::Mat convexity_map;
+  cv::Mat min_convexity_opening_element;
+
+  // Final edge map.
+  cv::Mat distance_discontinuity_map;
+  cv::Mat binary_distance_discontinuity_map;
+  cv::Mat final_edge_opening_element;
+  cv::Mat final_edge_closing_element;
+
+  // Outputs of the stages, combined into the edge map.
+  cv::Mat stage_discontinuity_map;
+  cv::Mat stage_distance_map;
+  cv::Mat stage_convexity_map;
+
+  // Label map.
+  cv::Mat label_edge_map_8u;
+  cv::Mat label_edge_mask;
+  cv::Mat output_labels;
+  cv::Mat roi_depth_image;
+  cv::Mat roi_labeled_map;
+  cv::Mat label_image_colors;
+  cv::Mat roi_label_image;
+  ConnectedComponents connected_components;
+  cv::Mat jump_flooding_seeds;
+  cv::Mat jump_flooding_next_seeds;
+
+  // Semantic instance segmentation.
+  InstanceIdImage instance_ids;
+  InstanceOverlap instance_overlap;
+
+  // Incremental mode, the cached maps and the depth image they were computed
+  // from. An empty reference depth forces a full update.
+  cv::Mat reference_depth;
+  cv::Mat cached_normal_map;
+  cv::Mat cached_edge_map;
+  cv::Mat changed_tiles;
+  cv::Mat recomputed_tiles;
+  cv::Mat region_depth;
+  cv::Mat region_depth_map;
+  cv::Mat region_normal_map;
+  cv::Mat region_edge_map;
+  size_t num_incremental_frames = 0u;
+
+  // Pyramid mode, the maps of the level and the buffers of its labels.
+  cv::Mat pyramid_depth;
+  RayTable pyramid_rays;
+  cv::Mat pyramid_depth_map;
+  cv::Mat pyramid_normal_map;
+  cv::Mat pyramid_edge_map;
+  cv::Mat pyramid_label_edge_map;
+  cv::Mat pyramid_label_edge_map_8u;
+  cv::Mat pyramid_label_colors;
+  cv::Mat pyramid_labels;
+};
+
 class DepthSegmenter {
  public:
   DepthSegmenter(const DepthCamera& depth_camera, Params& params)
@@ -141,6 +259,8 @@ class DepthSegmenter {
     CHECK_EQ(params_.max_distance.window_size % 2u, 1u);
   };
   void initialize();
+  // Updates the params, which the stages read without locking. Must not run
+  // concurrently with them.
   void dynamicReconfigureCallback(
       depth_segmentation::DepthSegmenterConfig& config, uint32_t level);
   void computeDepthMap(const cv::Mat& depth_image, cv::Mat* depth_map);
@@ -154,43 +274,266 @@ class DepthSegmenter {
   void computeFinalEdgeMap(const cv::Mat& convexity_map,
                            const cv::Mat& distance_map,
                            const cv::Mat& discontinuity_map, cv::Mat* edge_map);
+  // Runs all stages from the depth image to the final edge map. The raw depth
+  // image is only used for the Linemod normals.
+  void computeGeometricMaps(const cv::Mat& depth_image,
+                            const cv::Mat& raw_depth_image, cv::Mat* depth_map,
+                            cv::Mat* normal_map, cv::Mat* edge_map);
   void edgeMap(const cv::Mat& image, cv::Mat* edge_map);
-  void labelMap(const cv::Mat& rgb_image, const cv::Mat& depth_image,
-                const cv::Mat& depth_map, const cv::Mat& edge_map,
-                const cv::Mat& normal_map, cv::Mat* labeled_map,
-                std::vector<cv::Mat>* segment_masks,
-                std::vector<Segment>* segments);
+  // The rgb image is in BGR order if bgr_input is set, the segment colors are
+  // stored in RGB order either way.
+  void labelMap(const cv::Mat& rgb_image, const bool bgr_input,
+                const cv::Mat& depth_image, const cv::Mat& depth_map,
+                const cv::Mat& edge_map, const cv::Mat& normal_map,
+                cv::Mat* labeled_map, std::vector<SegmentMask>* segment_masks,
+                SegmentTable* segments);
   void labelMap(
-      const cv::Mat& rgb_image, const cv::Mat& depth_image,
+      const cv::Mat& rgb_image, const bool bgr_input,
+      const cv::Mat& depth_image,
       const SemanticInstanceSegmentation& semantic_instance_segmentation,
       const cv::Mat& depth_map, const cv::Mat& edge_map,
       const cv::Mat& normal_map, cv::Mat* labeled_map,
-      std::vector<cv::Mat>* segment_masks, std::vector<Segment>* segments);
+      std::vector<SegmentMask>* segment_masks, SegmentTable* segments);
+  // Labels the edge map like labelMap, but only returns the CV_32SC1 label
+  // image and a descriptor per segment, without building masks or points.
+  // Segment i is labeled i + 1 in the label image, edges and segments below
+  // the minimal size 0.
+  void labelImage(const cv::Mat& depth_image, const cv::Mat& depth_map,
+                  const cv::Mat& edge_map, const cv::Mat& normal_map,
+                  cv::Mat* label_image,
+                  std::vector<SegmentDescriptor>* descriptors);
+  void labelImage(
+      const cv::Mat& depth_image,
+      const SemanticInstanceSegmentation& semantic_instance_segmentation,
+      const cv::Mat& depth_map, const cv::Mat& edge_map,
+      const cv::Mat& normal_map, cv::Mat* label_image,
+      std::vector<SegmentDescriptor>* descriptors);
   void inpaintImage(const cv::Mat& depth_image, const cv::Mat& edge_map,
                     const cv::Mat& label_map, cv::Mat* inpainted);
   void findBlobs(const cv::Mat& binary,
                  std::vector<std::vector<cv::Point2i>>* labels);
   inline DepthCamera getDepthCamera() const { return depth_camera_; }
+  // Wall times of the stages, only collected if timing is enabled.
+  inline const StageTimer& getStageTimer() const { return stage_timer_; }
+  inline StageTimer* getMutableStageTimer() { return &stage_timer_; }
+  inline StageTimer* getActiveStageTimer() {
+    return params_.timing.enable ? &stage_timer_ : nullptr;
+  }
+  // Number of tiles whose maps were recomputed for the last frame in the
+  // incremental mode, all tiles for a full update.
+  inline size_t getNumRecomputedTiles() const { return num_recomputed_tiles_; }
 
  private:
+  // Computes the depth discontinuity map with a chain of full image
+  // morphological and arithmetic operations.
+  void computeDepthDiscontinuityMapMorphology(const cv::Mat& depth_image,
+                                              cv::Mat* depth_discontinuity_map);
+  // Standard deviation of the axial depth noise at depth z after the Nguyen
+  // et al. (2012) noise model, which thresholds the max distance map.
+  float computeAxialNoise(const float z) const;
+  // Computes the max distance map in a single pass over the image, taking the
+  // square root and applying the noise model threshold on the fly. A nan
+  // coordinate is skipped with ignore_nan_coordinates, otherwise a nan
+  // distance is skipped with exclude_nan_as_max_distance and makes the
+  // maximum nan if not.
+  void computeMaxDistanceMapFused(const cv::Mat& depth_map,
+                                  cv::Mat* max_distance_map);
+  // Computes the min convexity map in a single pass over the image, reading
+  // the neighbor points and normals directly instead of filtering the whole
+  // image once per neighbor offset.
+  void computeMinConvexityMapFused(const cv::Mat& depth_map,
+                                   const cv::Mat& normal_map,
+                                   cv::Mat* min_convexity_map);
+  // Updates the maps of the tiles whose depth changed and their neighbors,
+  // copying the cached maps elsewhere. Returns false if the cache can not be
+  // used and all maps need to be computed.
+  bool updateGeometricMapsIncrementally(const cv::Mat& depth_image,
+                                        cv::Mat* depth_map,
+                                        cv::Mat* normal_map,
+                                        cv::Mat* edge_map);
+  // Whether the edge map stages run on the pyramid level, which requires the
+  // depth window filter or integral image normals and is superseded by the
+  // region of interest.
+  bool usesPyramid() const;
+  // Computes the edge map stages on the pyramid level of the depth image and
+  // upsamples their results to full resolution with the nearest neighbor.
+  // Only the depth map is computed at full resolution.
+  void computeGeometricMapsPyramid(const cv::Mat& depth_image,
+                                   cv::Mat* depth_map, cv::Mat* normal_map,
+                                   cv::Mat* edge_map);
+  // Runs the stages after the depth map one after the other on a region.
+  void computeRegionMaps(const cv::Mat& depth_image, const cv::Mat& depth_map,
+                         cv::Mat* normal_map, cv::Mat* edge_map);
+  // Pixels around a region that influence the maps within it.
+  int getStageHalo() const;
+  // The type of the discontinuity, distance, convexity and edge maps:
+  // CV_8UC1 in the compact maps mode if all of them are binary, CV_32FC1
+  // otherwise.
+  int getEdgeMapType() const;
+  // The region of interest clipped to the image, the whole image if the
+  // region of interest is disabled.
+  cv::Rect getRoi(const cv::Size& image_size) const;
+  // Copies the region of the depth image, setting the depth of the pixels
+  // outside the depth range of the region of interest to zero.
+  void cropDepthImage(const cv::Mat& depth_image, const cv::Rect& region,
+                      cv::Mat* cropped_depth_image) const;
+  // Computes the maps of the region of interest and its halo only, the maps
+  // are invalid outside of the region of interest.
+  void computeGeometricMapsRoi(const cv::Mat& depth_image, cv::Mat* depth_map,
+                               cv::Mat* normal_map, cv::Mat* edge_map);
+  // Implementation of labelMap on an image cropped at the offset, the
+  // outputs are in the coordinates of the crop.
+  void labelMapRegion(const cv::Mat& rgb_image, const bool bgr_input,
+                      const cv::Mat& depth_image, const cv::Mat& depth_map,
+                      const cv::Mat& edge_map, const cv::Mat& normal_map,
+                      const cv::Point& offset, cv::Mat* labeled_map,
+                      std::vector<SegmentMask>* segment_masks,
+                      SegmentTable* segments);
+  // Implementation of labelImage on an image cropped at the offset. The
+  // label image is in the coordinates of the crop, the descriptors in those
+  // of the frame.
+  void labelImageRegion(const cv::Mat& depth_image, const cv::Mat& depth_map,
+                        const cv::Mat& edge_map, const cv::Mat& normal_map,
+                        const cv::Point& offset, cv::Mat* label_image,
+                        std::vector<SegmentDescriptor>* descriptors);
+  // Assigns every edge point the label of the closest labeled non-edge point
+  // in its neighborhood, or -1 if there is none.
+  void reassignEdgePoints(const cv::Mat& depth_image, const cv::Mat& depth_map,
+                          const cv::Mat& edge_map_8u, cv::Mat* output_labels);
+  // Exhaustive search over the window around every edge point.
+  void reassignEdgePointsWindowSearch(const cv::Mat& depth_image,
+                                      const cv::Mat& depth_map,
+                                      const cv::Mat& edge_map_8u,
+                                      cv::Mat* output_labels);
+  // Propagates the closest seed point with jump flooding steps, which
+  // approximates the window search with a constant number of reads per
+  // point.
+  void reassignEdgePointsJumpFlooding(const cv::Mat& depth_image,
+                                      const cv::Mat& depth_map,
+                                      const cv::Mat& edge_map_8u,
+                                      cv::Mat* output_labels);
+  // Labels the regions enclosed by edges from the contour hierarchy of the
+  // edge map. Regions smaller than min_size pixels are removed or merged.
+  void labelContours(const cv::Mat& edge_map, const size_t min_size,
+                     cv::Mat* edge_map_8u, cv::Mat* output,
+                     cv::Mat* output_labels, std::vector<cv::Scalar>* colors,
+                     std::vector<int>* labels);
+  // Labels the regions enclosed by edges from the connected components of the
+  // edge map, with the same minimal size and parent hole rules as the
+  // contours.
+  void labelComponents(const cv::Mat& edge_map, const size_t min_size,
+                       cv::Mat* edge_map_8u, cv::Mat* output,
+                       cv::Mat* output_labels,
+                       std::vector<cv::Scalar>* colors,
+                       std::vector<int>* labels);
+  // Labels the edge map with the contour or connected components method.
+  void labelEdgeMap(const cv::Mat& edge_map, const size_t min_size,
+                    cv::Mat* edge_map_8u, cv::Mat* output,
+                    cv::Mat* output_labels, std::vector<cv::Scalar>* colors,
+                    std::vector<int>* labels);
+  // Labels the edge map upsampled from the pyramid level on the level and
+  // upsamples the labels. The pixels at the boundaries between the labels of
+  // the level become edge points, which are reassigned at full resolution.
+  void labelPyramidRegions(const cv::Mat& edge_map, cv::Mat* edge_map_8u,
+                           cv::Mat* output, cv::Mat* output_labels,
+                           std::vector<cv::Scalar>* colors,
+                           std::vector<int>* labels);
+  // Labels the edge map with the contour or connected components method,
+  // maps the labels to dense segment indices in order of appearance and
+  // reassigns the edge points.
+  void labelRegions(const cv::Mat& depth_image, const cv::Mat& depth_map,
+                    const cv::Mat& edge_map, cv::Mat* edge_map_8u,
+                    cv::Mat* output, cv::Mat* output_labels,
+                    std::vector<cv::Scalar>* colors,
+                    std::vector<size_t>* segment_indices,
+                    std::vector<int>* segment_labels);
   void generateRandomColorsAndLabels(size_t contours_size,
                                      std::vector<cv::Scalar>* colors,
                                      std::vector<int>* labels);
   const DepthCamera& depth_camera_;
   Params& params_;
 
+  DepthSegmenterWorkspace workspace_;
+  StageTimer stage_timer_;
   cv::rgbd::RgbdNormals rgbd_normals_;
   std::vector<cv::Scalar> colors_;
   std::vector<int> labels_;
+  size_t num_recomputed_tiles_ = 0u;
+  // Set by the dynamic reconfigure callback, which may run concurrently with
+  // the stages, and consumed by the next incremental update.
+  std::atomic<bool> invalidate_cache_{false};
+};
+
+// Segments independent frames with a persistent segmenter. The normals engine,
+// the workspace and the color and label tables are kept between calls and
+// only rebuilt if the resolution or the intrinsics change. Calls are
+// serialized, use one instance per thread to segment frames in parallel.
+class FrameSegmenter {
+ public:
+  explicit FrameSegmenter(const Params& params);
+  FrameSegmenter(const FrameSegmenter&) = delete;
+  FrameSegmenter& operator=(const FrameSegmenter&) = delete;
+
+  // The rgb image is in BGR order if bgr_input is set, as for labelMap.
+  void segment(const cv::Mat& rgb_image, const bool bgr_input,
+               const cv::Mat& depth_image, const cv::Mat& depth_intrinsics,
+               cv::Mat* label_map, cv::Mat* normal_map,
+               std::vector<SegmentMask>* segment_masks,
+               SegmentTable* segments);
+  // Replaces the params, the segmenter is rebuilt on the next call.
+  void setParams(const Params& params);
+  inline size_t getNumInitializations() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_initializations_;
+  }
+
+ private:
+  void initializeIfNeeded(const cv::Size& image_size,
+                          const cv::Mat& depth_intrinsics);
+
+  mutable std::mutex mutex_;
+  Params params_;
+  DepthCamera depth_camera_;
+  DepthSegmenter depth_segmenter_;
+  bool needs_initialization_;
+  size_t num_initializations_;
+  // Buffers of segment, kept between frames.
+  cv::Mat rescaled_depth_;
+  cv::Mat depth_map_;
+  cv::Mat edge_map_;
+  cv::Mat invalid_depth_mask_;
 };
 
-// TODO(ntonci): Make a unit test.
-void segmentSingleFrame(const cv::Mat& rgb_image, const cv::Mat& depth_image,
+// Segments a single frame with a new segmenter, prefer a FrameSegmenter to
+// segment sequences of frames.
+void segmentSingleFrame(const cv::Mat& rgb_image, const bool bgr_input,
+                        const cv::Mat& depth_image,
                         const cv::Mat& depth_intrinsics,
                         depth_segmentation::Params& params, cv::Mat* label_map,
                         cv::Mat* normal_map,
-                        std::vector<cv::Mat>* segment_masks,
-                        std::vector<Segment>* segments);
+                        std::vector<SegmentMask>* segment_masks,
+                        SegmentTable* segments);
+
+// Downsamples a CV_32FC1 depth image by an integer factor. Every pixel takes
+// the median of the valid depths of its block, or zero if there are none.
+void downsampleDepthImage(const cv::Mat& depth_image, const int factor,
+                          cv::Mat* downsampled_depth);
+
+// Repeats every pixel of an image downsampled by the factor over its block of
+// the full resolution image of the given size.
+void upsampleNearest(const cv::Mat& image, const int factor,
+                     const cv::Size& size, cv::Mat* upsampled);
+
+// Fraction of the pixels labeled in either CV_32SC1 label image on which the
+// two agree, after matching every segment to the reference segment it
+// overlaps most. Labels of 0 and below are unlabeled.
+double computeLabelAgreement(const cv::Mat& labels,
+                             const cv::Mat& reference_labels);
+
+// Converts a depth image of 16 bit millimeters or 32 bit float meters to
+// 32 bit float meters in a single pass. Invalid values, i.e. zeros and NaNs,
+// are set to zero.
+void rescaleDepthImage(const cv::Mat& depth_image, cv::Mat* rescaled_depth);
 
 }  // namespace depth_segmentation
 
@@ -0,0 +1,77 @@
+#ifndef DEPTH_SEGMENTATION_INSTANCE_OVERLAP_H_
+#define DEPTH_SEGMENTATION_INSTANCE_OVERLAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace depth_segmentation {
+
+// Instance id of the pixels covered by several instance masks.
+constexpr uint16_t kSharedInstanceId = std::numeric_limits<uint16_t>::max();
+
+// Instance ids of the pixels of an image, id j + 1 for instance mask j and 0
+// for pixels without an instance. Pixels covered by several masks hold
+// kSharedInstanceId, the ids of all their masks are listed separately.
+struct InstanceIdImage {
+  struct SharedPixel {
+    int index;
+    uint16_t instance_id;
+  };
+
+  // Paints the CV_8UC1 instance masks, keeping the allocated memory.
+  void compute(const std::vector<cv::Mat>& masks, const cv::Size& image_size);
+
+  // CV_16UC1.
+  cv::Mat ids;
+  // The instance ids of the shared pixels, sorted by the row-major pixel
+  // index and the id.
+  std::vector<SharedPixel> shared_pixels;
+};
+
+// Number of pixels shared by every segment and every instance, counted in a
+// single pass over the segment pixels. Instance id 0 stands for pixels
+// without an instance, id j + 1 for instance mask j.
+struct InstanceOverlap {
+  // Zeroes the counts of the given number of segments and instance masks,
+  // keeping the allocated memory.
+  void reset(const size_t num_segments, const size_t num_instances);
+  inline void add(const size_t segment, const uint16_t instance_id) {
+    ++counts[segment * num_instance_ids + instance_id];
+  }
+  // Adds the pixel to the overlap of the segment with every instance mask
+  // that covers it.
+  inline void add(const size_t segment, const InstanceIdImage& instance_ids,
+                  const int y, const int x) {
+    const uint16_t instance_id = instance_ids.ids.at<uint16_t>(y, x);
+    if (instance_id != kSharedInstanceId) {
+      add(segment, instance_id);
+    } else {
+      addSharedPixel(segment, instance_ids, y * instance_ids.ids.cols + x);
+    }
+  }
+  inline size_t count(const size_t segment, const size_t instance_id) const {
+    return counts[segment * num_instance_ids + instance_id];
+  }
+  // Returns the id of the instance with the largest overlap with the segment
+  // if it covers more than overlap_threshold of the segment, ties going to
+  // the lower id, or kUnassignedLabel.
+  size_t assignInstance(const size_t segment, const size_t segment_size,
+                        const float overlap_threshold) const;
+
+  size_t num_segments = 0u;
+  size_t num_instance_ids = 0u;
+  // Row-major segments x instance ids.
+  std::vector<size_t> counts;
+
+ private:
+  void addSharedPixel(const size_t segment,
+                      const InstanceIdImage& instance_ids, const int index);
+};
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_INSTANCE_OVERLAP_H_
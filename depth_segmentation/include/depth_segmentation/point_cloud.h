@@ -0,0 +1,36 @@
+#ifndef DEPTH_SEGMENTATION_POINT_CLOUD_H_
+#define DEPTH_SEGMENTATION_POINT_CLOUD_H_
+
+#include <cstddef>
+
+#include <sensor_msgs/PointCloud2.h>
+
+#include "depth_segmentation/common.h"
+
+namespace depth_segmentation {
+
+// Every point is written as x, y, z, normal_x, normal_y, normal_z (float32),
+// followed by the packed color (uint32 rgba, or float32 rgb with labels),
+// optionally the uint8 instance_label and semantic_label and the uint16
+// segment_id, 32 bytes in total.
+constexpr size_t kPointCloud2PointStep = 32u;
+
+// Writes the points of all segments into one cloud in the order of the table,
+// straight from the segment buffers without going through pcl::PointCloud.
+// The segment id of a point is the index of its segment in the table. The
+// data buffer of the cloud is reused if it is large enough.
+void segmentsToPointCloud2(const SegmentTable& segments,
+                           const bool with_labels,
+                           const bool with_segment_ids,
+                           sensor_msgs::PointCloud2* cloud);
+
+// Copies the points of a single segment out of a cloud written by
+// segmentsToPointCloud2, which stores each segment contiguously.
+void extractSegmentPointCloud2(const SegmentTable& segments,
+                               const size_t segment_index,
+                               const sensor_msgs::PointCloud2& scene_cloud,
+                               sensor_msgs::PointCloud2* segment_cloud);
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_POINT_CLOUD_H_
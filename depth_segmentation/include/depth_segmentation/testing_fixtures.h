@@ -0,0 +1,32 @@
+#ifndef DEPTH_SEGMENTATION_TESTING_FIXTURES_H_
+#define DEPTH_SEGMENTATION_TESTING_FIXTURES_H_
+
+#include <opencv2/core.hpp>
+
+namespace depth_segmentation {
+
+// Intrinsics of the 640 x 480 depth camera of the tests.
+inline cv::Mat makeTestCameraMatrix() {
+  cv::Mat camera_matrix = cv::Mat::zeros(3, 3, CV_32FC1);
+  camera_matrix.at<float>(0, 0) = 574.0527954101562f;
+  camera_matrix.at<float>(0, 2) = 319.5f;
+  camera_matrix.at<float>(1, 1) = 574.0527954101562f;
+  camera_matrix.at<float>(1, 2) = 239.5f;
+  camera_matrix.at<float>(2, 2) = 1.0f;
+  return camera_matrix;
+}
+
+// A plane at 2 m with a box at 1 m in front of it, which covers the center
+// of the image. The box is at (200, 150) with a size of 240 x 180 in a
+// 640 x 480 image.
+inline cv::Mat makePlaneWithBoxDepthImage(const cv::Size& image_size) {
+  cv::Mat depth_image(image_size, CV_32FC1, cv::Scalar(2.0f));
+  depth_image(cv::Rect(image_size.width * 5 / 16, image_size.height * 5 / 16,
+                       image_size.width * 3 / 8, image_size.height * 3 / 8))
+      .setTo(cv::Scalar(1.0f));
+  return depth_image;
+}
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_TESTING_FIXTURES_H_
@@ -0,0 +1,101 @@
+#ifndef DEPTH_SEGMENTATION_TIMING_H_
+#define DEPTH_SEGMENTATION_TIMING_H_
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace depth_segmentation {
+
+enum class Stage {
+  kDepthMap = 0,
+  kNormalMap,
+  kDepthDiscontinuityMap,
+  kMaxDistanceMap,
+  kMinConvexityMap,
+  kFinalEdgeMap,
+  kLabelMap,
+  kPublish,
+  kFrame,
+  kNumStages,
+};
+
+constexpr size_t kNumStages = static_cast<size_t>(Stage::kNumStages);
+
+std::string getStageName(const Stage stage);
+
+struct StageStatistics {
+  // Number of samples in the rolling window.
+  size_t num_samples = 0u;
+  // Wall times in milliseconds.
+  double last = 0.0;
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p95 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+};
+
+// Collects the wall time of every stage over a rolling window of frames, as
+// well as the number of processed and dropped frames. Thread safe.
+class StageTimer {
+ public:
+  explicit StageTimer(const size_t window_size = 1000u);
+
+  void addSample(const Stage stage, const double milliseconds);
+  void addProcessedFrame();
+  void addDroppedFrame();
+  void addDroppedFrames(const size_t num_frames);
+  void reset();
+
+  StageStatistics getStatistics(const Stage stage) const;
+  size_t getNumProcessedFrames() const;
+  size_t getNumDroppedFrames() const;
+  // One line per stage with samples.
+  std::string print() const;
+
+ private:
+  struct RollingWindow {
+    std::vector<double> samples;
+    size_t next = 0u;
+    double last = 0.0;
+  };
+
+  const size_t window_size_;
+  mutable std::mutex mutex_;
+  std::array<RollingWindow, kNumStages> windows_;
+  size_t num_processed_frames_;
+  size_t num_dropped_frames_;
+};
+
+// Adds the wall time between its construction and destruction to the timer.
+// Does nothing, not even reading the clock, if the timer is null.
+class ScopedStageTimer {
+ public:
+  ScopedStageTimer(const Stage stage, StageTimer* timer)
+      : stage_(stage), timer_(timer) {
+    if (timer_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedStageTimer() {
+    if (timer_ != nullptr) {
+      const std::chrono::duration<double, std::milli> duration =
+          std::chrono::steady_clock::now() - start_;
+      timer_->addSample(stage_, duration.count());
+    }
+  }
+  ScopedStageTimer(const ScopedStageTimer&) = delete;
+  ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+
+ private:
+  const Stage stage_;
+  StageTimer* timer_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace depth_segmentation
+
+#endif  // DEPTH_SEGMENTATION_TIMING_H_
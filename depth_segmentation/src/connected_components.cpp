@@ -0,0 +1,134 @@
+#include "depth_segmentation/connected_components.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace depth_segmentation {
+
+namespace {
+
+// Number of rows labeled by one task before the strips are merged.
+constexpr int kStripHeight = 32;
+
+inline bool isForeground(const cv::Mat& binary_image, const int y,
+                         const int x) {
+  return y > 0 && y < binary_image.rows - 1 && x > 0 &&
+         x < binary_image.cols - 1 && binary_image.at<uint8_t>(y, x) != 0u;
+}
+
+inline int32_t findRoot(int32_t* parents, int32_t index) {
+  while (parents[index] != index) {
+    parents[index] = parents[parents[index]];
+    index = parents[index];
+  }
+  return index;
+}
+
+// The smaller pixel index becomes the root, such that the root of every
+// component is its first pixel in raster order.
+inline void unite(int32_t* parents, int32_t a, int32_t b) {
+  a = findRoot(parents, a);
+  b = findRoot(parents, b);
+  if (a < b) {
+    parents[b] = a;
+  } else if (b < a) {
+    parents[a] = b;
+  }
+}
+
+inline void uniteWithLeft(const cv::Mat& binary_image, const int y,
+                          const int x, int32_t* parents) {
+  if (x > 0 && isForeground(binary_image, y, x - 1) ==
+                   isForeground(binary_image, y, x)) {
+    const int32_t index = y * binary_image.cols + x;
+    unite(parents, index, index - 1);
+  }
+}
+
+// Foreground pixels are 8-connected, background pixels are 4-connected.
+inline void uniteWithAbove(const cv::Mat& binary_image, const int y,
+                           const int x, int32_t* parents) {
+  const int cols = binary_image.cols;
+  const int32_t index = y * cols + x;
+  const bool is_foreground = isForeground(binary_image, y, x);
+  if (isForeground(binary_image, y - 1, x) == is_foreground) {
+    unite(parents, index, index - cols);
+  }
+  if (is_foreground) {
+    if (x > 0 && isForeground(binary_image, y - 1, x - 1)) {
+      unite(parents, index, index - cols - 1);
+    }
+    if (x + 1 < cols && isForeground(binary_image, y - 1, x + 1)) {
+      unite(parents, index, index - cols + 1);
+    }
+  }
+}
+
+}  // namespace
+
+void labelConnectedComponents(const cv::Mat& binary_image,
+                              ConnectedComponents* components) {
+  CHECK(!binary_image.empty());
+  CHECK_EQ(binary_image.type(), CV_8UC1);
+  CHECK_NOTNULL(components);
+  const int rows = binary_image.rows;
+  const int cols = binary_image.cols;
+
+  // The label image holds the union-find parents until it is flattened.
+  components->labels.create(binary_image.size(), CV_32SC1);
+  CHECK(components->labels.isContinuous());
+  int32_t* parents = components->labels.ptr<int32_t>();
+
+  const int num_strips = (rows + kStripHeight - 1) / kStripHeight;
+#pragma omp parallel for
+  for (int strip = 0; strip < num_strips; ++strip) {
+    const int first_row = strip * kStripHeight;
+    const int last_row = std::min(first_row + kStripHeight, rows);
+    for (int y = first_row; y < last_row; ++y) {
+      for (int x = 0; x < cols; ++x) {
+        const int32_t index = y * cols + x;
+        parents[index] = index;
+        uniteWithLeft(binary_image, y, x, parents);
+        if (y > first_row) {
+          uniteWithAbove(binary_image, y, x, parents);
+        }
+      }
+    }
+  }
+
+  // Merge the strips along their first rows.
+  for (int strip = 1; strip < num_strips; ++strip) {
+    const int y = strip * kStripHeight;
+    for (int x = 0; x < cols; ++x) {
+      uniteWithAbove(binary_image, y, x, parents);
+    }
+  }
+
+  // Flatten the trees in place. Every parent precedes its child in raster
+  // order, hence it already holds the final component id when it is read.
+  components->sizes.clear();
+  components->parents.clear();
+  components->is_foreground.clear();
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      const int32_t index = y * cols + x;
+      const int32_t parent = parents[index];
+      if (parent == index) {
+        parents[index] = components->sizes.size();
+        components->sizes.push_back(1u);
+        components->is_foreground.push_back(
+            isForeground(binary_image, y, x));
+        // The pixel above the first pixel of a component belongs to the
+        // component enclosing it.
+        components->parents.push_back(y > 0 ? parents[index - cols]
+                                            : kNoParentComponent);
+      } else {
+        parents[index] = parents[parent];
+        ++components->sizes[parents[index]];
+      }
+    }
+  }
+}
+
+}  // namespace depth_segmentation
@@ -0,0 +1,417 @@
+#include "depth_segmentation/depth_kernels.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#include <glog/logging.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define DEPTH_SEGMENTATION_AVX2_KERNELS
+#include <immintrin.h>
+// Compiles a function for AVX2 only, it is called after the runtime check.
+#define DEPTH_SEGMENTATION_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define DEPTH_SEGMENTATION_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+namespace depth_segmentation {
+
+namespace {
+
+SimdLevel detectSimdLevel() {
+#if defined(DEPTH_SEGMENTATION_AVX2_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdLevel::kAvx2;
+  }
+#elif defined(DEPTH_SEGMENTATION_NEON_KERNELS)
+  return SimdLevel::kNeon;
+#endif
+  return SimdLevel::kScalar;
+}
+
+inline bool isSupported(const SimdLevel level) {
+  return level == SimdLevel::kScalar || level == getSimdLevel();
+}
+
+// Invalid depths, i.e. NaN, zero or negative, count as zero.
+inline float sanitizeDepth(const float depth) {
+  return depth > 0.0f ? depth : 0.0f;
+}
+
+void backProjectRowScalar(const float* depth, const float* x_rays,
+                          const float y_ray, const int begin, const int end,
+                          float* points) {
+  for (int x = begin; x < end; ++x) {
+    const float z = depth[x];
+    points[3 * x] = x_rays[x] * z;
+    points[3 * x + 1] = y_ray * z;
+    points[3 * x + 2] = z;
+  }
+}
+
+// Min and max of the depths of the rows [row_begin, row_end) for each column.
+void columnMinMaxScalar(const cv::Mat& depth_image, const int row_begin,
+                        const int row_end, const int begin, const int end,
+                        float* column_min, float* column_max) {
+  const float* row = depth_image.ptr<float>(row_begin);
+  for (int x = begin; x < end; ++x) {
+    column_min[x] = column_max[x] = sanitizeDepth(row[x]);
+  }
+  for (int y = row_begin + 1; y < row_end; ++y) {
+    row = depth_image.ptr<float>(y);
+    for (int x = begin; x < end; ++x) {
+      const float depth = sanitizeDepth(row[x]);
+      column_min[x] = std::min(column_min[x], depth);
+      column_max[x] = std::max(column_max[x], depth);
+    }
+  }
+}
+
+// The window of pixel x spans [x, x + window_size) of the column buffers,
+// which are padded with the neutral values on both sides.
+void discontinuityRowScalar(const float* depth, const float* column_min,
+                            const float* column_max, const int window_size,
+                            const float discontinuity_ratio, const int begin,
+                            const int end, float* discontinuity) {
+  for (int x = begin; x < end; ++x) {
+    float window_min = column_min[x];
+    float window_max = column_max[x];
+    for (int i = 1; i < window_size; ++i) {
+      window_min = std::min(window_min, column_min[x + i]);
+      window_max = std::max(window_max, column_max[x + i]);
+    }
+    const float center = sanitizeDepth(depth[x]);
+    const float difference =
+        std::max(window_max - center, center - window_min);
+    discontinuity[x] =
+        center > 0.0f && difference / center > discontinuity_ratio ? 1.0f
+                                                                   : 0.0f;
+  }
+}
+
+#if defined(DEPTH_SEGMENTATION_AVX2_KERNELS)
+
+// Interleaves four x, y and z coordinates to twelve floats.
+DEPTH_SEGMENTATION_TARGET_AVX2 inline void storeInterleaved(const __m128 x,
+                                                            const __m128 y,
+                                                            const __m128 z,
+                                                            float* points) {
+  const __m128 x0_y0_x1_y1 = _mm_unpacklo_ps(x, y);
+  const __m128 x2_y2_x3_y3 = _mm_unpackhi_ps(x, y);
+  const __m128 z0_z0_x1_x1 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0));
+  const __m128 y1_y1_z1_z1 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1));
+  const __m128 z2_z2_x3_x3 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2));
+  const __m128 y3_y3_z3_z3 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3));
+  _mm_storeu_ps(points, _mm_shuffle_ps(x0_y0_x1_y1, z0_z0_x1_x1,
+                                       _MM_SHUFFLE(2, 0, 1, 0)));
+  _mm_storeu_ps(points + 4, _mm_shuffle_ps(y1_y1_z1_z1, x2_y2_x3_y3,
+                                           _MM_SHUFFLE(1, 0, 2, 0)));
+  _mm_storeu_ps(points + 8, _mm_shuffle_ps(z2_z2_x3_x3, y3_y3_z3_z3,
+                                           _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+// Returns the number of pixels processed, the rest is left to the scalar
+// kernel.
+DEPTH_SEGMENTATION_TARGET_AVX2 int backProjectRowAvx2(const float* depth,
+                                                      const float* x_rays,
+                                                      const float y_ray,
+                                                      const int cols,
+                                                      float* points) {
+  const __m256 y_ray_8 = _mm256_set1_ps(y_ray);
+  int x = 0;
+  for (; x + 8 <= cols; x += 8) {
+    const __m256 z = _mm256_loadu_ps(depth + x);
+    const __m256 point_x = _mm256_mul_ps(_mm256_loadu_ps(x_rays + x), z);
+    const __m256 point_y = _mm256_mul_ps(y_ray_8, z);
+    storeInterleaved(_mm256_castps256_ps128(point_x),
+                     _mm256_castps256_ps128(point_y),
+                     _mm256_castps256_ps128(z), points + 3 * x);
+    storeInterleaved(_mm256_extractf128_ps(point_x, 1),
+                     _mm256_extractf128_ps(point_y, 1),
+                     _mm256_extractf128_ps(z, 1), points + 3 * x + 12);
+  }
+  return x;
+}
+
+// MAXPS returns the second operand if the first is NaN.
+DEPTH_SEGMENTATION_TARGET_AVX2 inline __m256 sanitizeDepthAvx2(
+    const __m256 depth) {
+  return _mm256_max_ps(depth, _mm256_setzero_ps());
+}
+
+DEPTH_SEGMENTATION_TARGET_AVX2 int columnMinMaxAvx2(
+    const cv::Mat& depth_image, const int row_begin, const int row_end,
+    const int cols, float* column_min, float* column_max) {
+  int x = 0;
+  for (; x + 8 <= cols; x += 8) {
+    __m256 min_8 = sanitizeDepthAvx2(
+        _mm256_loadu_ps(depth_image.ptr<float>(row_begin) + x));
+    __m256 max_8 = min_8;
+    for (int y = row_begin + 1; y < row_end; ++y) {
+      const __m256 depth_8 =
+          sanitizeDepthAvx2(_mm256_loadu_ps(depth_image.ptr<float>(y) + x));
+      min_8 = _mm256_min_ps(min_8, depth_8);
+      max_8 = _mm256_max_ps(max_8, depth_8);
+    }
+    _mm256_storeu_ps(column_min + x, min_8);
+    _mm256_storeu_ps(column_max + x, max_8);
+  }
+  return x;
+}
+
+DEPTH_SEGMENTATION_TARGET_AVX2 int discontinuityRowAvx2(
+    const float* depth, const float* column_min, const float* column_max,
+    const int window_size, const float discontinuity_ratio, const int cols,
+    float* discontinuity) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 ratio_8 = _mm256_set1_ps(discontinuity_ratio);
+  int x = 0;
+  for (; x + 8 <= cols; x += 8) {
+    __m256 window_min = _mm256_loadu_ps(column_min + x);
+    __m256 window_max = _mm256_loadu_ps(column_max + x);
+    for (int i = 1; i < window_size; ++i) {
+      window_min =
+          _mm256_min_ps(window_min, _mm256_loadu_ps(column_min + x + i));
+      window_max =
+          _mm256_max_ps(window_max, _mm256_loadu_ps(column_max + x + i));
+    }
+    const __m256 center = sanitizeDepthAvx2(_mm256_loadu_ps(depth + x));
+    const __m256 difference =
+        _mm256_max_ps(_mm256_sub_ps(window_max, center),
+                      _mm256_sub_ps(center, window_min));
+    // The ratio of invalid depths is masked out below.
+    const __m256 ratio = _mm256_div_ps(difference, center);
+    const __m256 is_discontinuity =
+        _mm256_and_ps(_mm256_cmp_ps(center, zero, _CMP_GT_OQ),
+                      _mm256_cmp_ps(ratio, ratio_8, _CMP_GT_OQ));
+    _mm256_storeu_ps(discontinuity + x, _mm256_and_ps(is_discontinuity, one));
+  }
+  return x;
+}
+
+#elif defined(DEPTH_SEGMENTATION_NEON_KERNELS)
+
+int backProjectRowNeon(const float* depth, const float* x_rays,
+                       const float y_ray, const int cols, float* points) {
+  int x = 0;
+  for (; x + 4 <= cols; x += 4) {
+    float32x4x3_t point;
+    point.val[2] = vld1q_f32(depth + x);
+    point.val[0] = vmulq_f32(vld1q_f32(x_rays + x), point.val[2]);
+    point.val[1] = vmulq_n_f32(point.val[2], y_ray);
+    vst3q_f32(points + 3 * x, point);
+  }
+  return x;
+}
+
+// Unlike MAXPS, FMAX propagates NaN, hence the explicit mask.
+inline float32x4_t sanitizeDepthNeon(const float32x4_t depth) {
+  return vreinterpretq_f32_u32(
+      vandq_u32(vcgtq_f32(depth, vdupq_n_f32(0.0f)),
+                vreinterpretq_u32_f32(depth)));
+}
+
+int columnMinMaxNeon(const cv::Mat& depth_image, const int row_begin,
+                     const int row_end, const int cols, float* column_min,
+                     float* column_max) {
+  int x = 0;
+  for (; x + 4 <= cols; x += 4) {
+    float32x4_t min_4 =
+        sanitizeDepthNeon(vld1q_f32(depth_image.ptr<float>(row_begin) + x));
+    float32x4_t max_4 = min_4;
+    for (int y = row_begin + 1; y < row_end; ++y) {
+      const float32x4_t depth_4 =
+          sanitizeDepthNeon(vld1q_f32(depth_image.ptr<float>(y) + x));
+      min_4 = vminq_f32(min_4, depth_4);
+      max_4 = vmaxq_f32(max_4, depth_4);
+    }
+    vst1q_f32(column_min + x, min_4);
+    vst1q_f32(column_max + x, max_4);
+  }
+  return x;
+}
+
+int discontinuityRowNeon(const float* depth, const float* column_min,
+                         const float* column_max, const int window_size,
+                         const float discontinuity_ratio, const int cols,
+                         float* discontinuity) {
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  const uint32x4_t one = vreinterpretq_u32_f32(vdupq_n_f32(1.0f));
+  const float32x4_t ratio_4 = vdupq_n_f32(discontinuity_ratio);
+  int x = 0;
+  for (; x + 4 <= cols; x += 4) {
+    float32x4_t window_min = vld1q_f32(column_min + x);
+    float32x4_t window_max = vld1q_f32(column_max + x);
+    for (int i = 1; i < window_size; ++i) {
+      window_min = vminq_f32(window_min, vld1q_f32(column_min + x + i));
+      window_max = vmaxq_f32(window_max, vld1q_f32(column_max + x + i));
+    }
+    const float32x4_t center = sanitizeDepthNeon(vld1q_f32(depth + x));
+    const float32x4_t difference = vmaxq_f32(vsubq_f32(window_max, center),
+                                             vsubq_f32(center, window_min));
+    // The ratio of invalid depths is masked out below.
+    const float32x4_t ratio = vdivq_f32(difference, center);
+    const uint32x4_t is_discontinuity =
+        vandq_u32(vcgtq_f32(center, zero), vcgtq_f32(ratio, ratio_4));
+    vst1q_f32(discontinuity + x,
+              vreinterpretq_f32_u32(vandq_u32(is_discontinuity, one)));
+  }
+  return x;
+}
+
+#endif
+
+}  // namespace
+
+SimdLevel getSimdLevel() {
+  static const SimdLevel kSimdLevel = detectSimdLevel();
+  return kSimdLevel;
+}
+
+const char* getSimdLevelName(const SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kAvx2:
+      return "AVX2";
+    case SimdLevel::kNeon:
+      return "NEON";
+    default:
+      return "scalar";
+  }
+}
+
+void RayTable::compute(const cv::Mat& camera_matrix,
+                       const cv::Size& image_size) {
+  CHECK(!camera_matrix.empty());
+  cv::Mat_<float> intrinsics;
+  camera_matrix.convertTo(intrinsics, CV_32F);
+  const float inv_fx = 1.0f / intrinsics(0, 0);
+  const float inv_fy = 1.0f / intrinsics(1, 1);
+  const float cx = intrinsics(0, 2);
+  const float cy = intrinsics(1, 2);
+  x_rays.resize(image_size.width);
+  for (int x = 0; x < image_size.width; ++x) {
+    x_rays[x] = (x - cx) * inv_fx;
+  }
+  y_rays.resize(image_size.height);
+  for (int y = 0; y < image_size.height; ++y) {
+    y_rays[y] = (y - cy) * inv_fy;
+  }
+}
+
+void backProjectDepth(const cv::Mat& depth_image, const RayTable& rays,
+                      const cv::Point& offset, cv::Mat* depth_map,
+                      const SimdLevel level) {
+  CHECK(!depth_image.empty());
+  CHECK_EQ(depth_image.type(), CV_32FC1);
+  CHECK_NOTNULL(depth_map);
+  CHECK(isSupported(level));
+  CHECK((cv::Rect(offset, depth_image.size()) &
+         cv::Rect(cv::Point(0, 0), rays.size())) ==
+        cv::Rect(offset, depth_image.size()))
+      << "The depth image exceeds the ray table.";
+  depth_map->create(depth_image.size(), CV_32FC3);
+  const int cols = depth_image.cols;
+  const float* x_rays = rays.x_rays.data() + offset.x;
+#pragma omp parallel for
+  for (int y = 0; y < depth_image.rows; ++y) {
+    const float* depth = depth_image.ptr<float>(y);
+    const float y_ray = rays.y_rays[y + offset.y];
+    float* points = depth_map->ptr<float>(y);
+    int x = 0;
+#if defined(DEPTH_SEGMENTATION_AVX2_KERNELS)
+    if (level == SimdLevel::kAvx2) {
+      x = backProjectRowAvx2(depth, x_rays, y_ray, cols, points);
+    }
+#elif defined(DEPTH_SEGMENTATION_NEON_KERNELS)
+    if (level == SimdLevel::kNeon) {
+      x = backProjectRowNeon(depth, x_rays, y_ray, cols, points);
+    }
+#endif
+    backProjectRowScalar(depth, x_rays, y_ray, x, cols, points);
+  }
+}
+
+void computeDepthDiscontinuityMapFused(const cv::Mat& depth_image,
+                                       const int kernel_size,
+                                       const float discontinuity_ratio,
+                                       cv::Mat* depth_discontinuity_map,
+                                       const SimdLevel level) {
+  CHECK(!depth_image.empty());
+  CHECK_EQ(depth_image.type(), CV_32FC1);
+  CHECK_NOTNULL(depth_discontinuity_map);
+  CHECK_EQ(kernel_size % 2, 1);
+  CHECK(isSupported(level));
+  const bool is_binary_map = depth_discontinuity_map->type() == CV_8UC1 &&
+                             !depth_discontinuity_map->empty();
+  depth_discontinuity_map->create(depth_image.size(),
+                                  is_binary_map ? CV_8UC1 : CV_32FC1);
+  const int rows = depth_image.rows;
+  const int cols = depth_image.cols;
+  const int radius = kernel_size / 2;
+#pragma omp parallel
+  {
+    // The column extrema of a row, padded by the radius with values that
+    // never win, like the default border of cv::dilate and cv::erode.
+    std::vector<float> padded_column_min(
+        cols + 2 * radius, std::numeric_limits<float>::infinity());
+    std::vector<float> padded_column_max(
+        cols + 2 * radius, -std::numeric_limits<float>::infinity());
+    float* column_min = padded_column_min.data() + radius;
+    float* column_max = padded_column_max.data() + radius;
+    // A binary map is computed row by row in floats and then narrowed.
+    std::vector<float> float_row(is_binary_map ? cols : 0);
+#pragma omp for
+    for (int y = 0; y < rows; ++y) {
+      const int row_begin = std::max(y - radius, 0);
+      const int row_end = std::min(y + radius + 1, rows);
+      const float* depth = depth_image.ptr<float>(y);
+      float* discontinuity = is_binary_map
+                                 ? float_row.data()
+                                 : depth_discontinuity_map->ptr<float>(y);
+      int column_x = 0;
+      int x = 0;
+#if defined(DEPTH_SEGMENTATION_AVX2_KERNELS)
+      if (level == SimdLevel::kAvx2) {
+        column_x = columnMinMaxAvx2(depth_image, row_begin, row_end, cols,
+                                    column_min, column_max);
+      }
+#elif defined(DEPTH_SEGMENTATION_NEON_KERNELS)
+      if (level == SimdLevel::kNeon) {
+        column_x = columnMinMaxNeon(depth_image, row_begin, row_end, cols,
+                                    column_min, column_max);
+      }
+#endif
+      columnMinMaxScalar(depth_image, row_begin, row_end, column_x, cols,
+                         column_min, column_max);
+#if defined(DEPTH_SEGMENTATION_AVX2_KERNELS)
+      if (level == SimdLevel::kAvx2) {
+        x = discontinuityRowAvx2(depth, padded_column_min.data(),
+                                 padded_column_max.data(), kernel_size,
+                                 discontinuity_ratio, cols, discontinuity);
+      }
+#elif defined(DEPTH_SEGMENTATION_NEON_KERNELS)
+      if (level == SimdLevel::kNeon) {
+        x = discontinuityRowNeon(depth, padded_column_min.data(),
+                                 padded_column_max.data(), kernel_size,
+                                 discontinuity_ratio, cols, discontinuity);
+      }
+#endif
+      discontinuityRowScalar(depth, padded_column_min.data(),
+                             padded_column_max.data(), kernel_size,
+                             discontinuity_ratio, x, cols, discontinuity);
+      if (is_binary_map) {
+        uint8_t* binary = depth_discontinuity_map->ptr<uint8_t>(y);
+        for (int i = 0; i < cols; ++i) {
+          binary[i] = discontinuity[i] > 0.0f ? 1u : 0u;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace depth_segmentation
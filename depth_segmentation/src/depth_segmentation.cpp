@@ -1,7 +1,9 @@
 #include "depth_segmentation/depth_segmentation.h"
 
 #include <algorithm>
+#include <cstring>
 #include <limits>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui.hpp>
@@ -152,22 +154,95 @@ void CameraTracker::dilateFrame(cv::Mat& image, cv::Mat& depth) {
   }
 }
 
+void DepthSegmenterWorkspace::allocate(const cv::Size& image_size) {
+  depth_without_nans.create(image_size, CV_32FC1);
+  dilate_image.create(image_size, CV_32FC1);
+  erode_image.create(image_size, CV_32FC1);
+  ratio_image.create(image_size, CV_32FC1);
+  invalid_depth_mask.create(image_size, CV_8UC1);
+
+  max_distance_difference_map.create(image_size, CV_32FC3);
+  max_distance_channels.resize(3u);
+  for (cv::Mat& channel : max_distance_channels) {
+    channel.create(image_size, CV_32FC1);
+  }
+  distance_map.create(image_size, CV_32FC1);
+  nan_mask.create(image_size, CV_8UC1);
+
+  difference_map.create(image_size, CV_32FC3);
+  channels.resize(3u);
+  for (cv::Mat& channel : channels) {
+    channel.create(image_size, CV_32FC1);
+  }
+  difference_times_normal.create(image_size, CV_32FC3);
+  filtered_normal_map.create(image_size, CV_32FC3);
+  normal_times_filtered_normal.create(image_size, CV_32FC3);
+  normal_nan_mask.create(image_size, CV_8UC3);
+  vector_projection.create(image_size, CV_32FC1);
+  normal_vector_projection.create(image_size, CV_32FC1);
+  convexity_mask.create(image_size, CV_32FC1);
+  concavity_mask.create(image_size, CV_32FC1);
+  convexity_map.create(image_size, CV_32FC1);
+
+  distance_discontinuity_map.create(image_size, CV_32FC1);
+
+  // Forces a full update on the next frame of the incremental mode.
+  reference_depth.release();
+}
+
+// Shows a map, scaling the binary CV_8UC1 maps to the full intensity range.
+static void showMap(const std::string& window_name, const cv::Mat& map) {
+  cv::namedWindow(window_name, cv::WINDOW_AUTOSIZE);
+  if (map.type() == CV_8UC1) {
+    cv::imshow(window_name, map * 255);
+  } else {
+    cv::imshow(window_name, map);
+  }
+  cv::waitKey(1);
+}
+
+// Zeros the map, which is only reallocated if its size or type changed.
+static void createZeros(const cv::Size& size, const int type, cv::Mat* map) {
+  CHECK_NOTNULL(map);
+  map->create(size, type);
+  map->setTo(cv::Scalar::all(0));
+}
+
+// Only regenerates the rectangular structuring element if its size changed.
+static void updateRectStructuringElement(const cv::Size& size,
+                                         cv::Mat* element) {
+  CHECK_NOTNULL(element);
+  if (element->size() != size) {
+    *element = cv::getStructuringElement(cv::MORPH_RECT, size);
+  }
+}
+
 void DepthSegmenter::initialize() {
   CHECK(depth_camera_.initialized());
   CHECK_EQ(params_.normals.window_size % 2, 1u);
   CHECK_GT(params_.normals.window_size, 1u);
   if (params_.normals.method !=
-      SurfaceNormalEstimationMethod::kDepthWindowFilter) {
+          SurfaceNormalEstimationMethod::kDepthWindowFilter &&
+      params_.normals.method != SurfaceNormalEstimationMethod::kIntegralImage) {
     CHECK_LT(params_.normals.window_size, 8u);
   }
   CHECK_EQ(params_.max_distance.window_size % 2u, 1u);
   CHECK_EQ(params_.min_convexity.window_size % 2u, 1u);
 
   rgbd_normals_ = cv::rgbd::RgbdNormals(
-      depth_camera_.getWidth(), depth_camera_.getHeight(), CV_32F,
+      depth_camera_.getHeight(), depth_camera_.getWidth(), CV_32F,
       depth_camera_.getCameraMatrix(), params_.normals.window_size,
       static_cast<int>(params_.normals.method));
-  LOG(INFO) << "DepthSegmenter initialized";
+  workspace_.allocate(
+      cv::Size(depth_camera_.getWidth(), depth_camera_.getHeight()));
+#ifdef _OPENMP
+  // The concurrent stages parallelize their loops within the team of the
+  // stages, which needs nested teams. The setting is shared by all threads,
+  // hence it is only raised here and not toggled per frame.
+  omp_set_max_active_levels(std::max(omp_get_max_active_levels(), 2));
+#endif
+  LOG(INFO) << "DepthSegmenter initialized with "
+            << getSimdLevelName(getSimdLevel()) << " kernels";
 }
 
 void DepthSegmenter::dynamicReconfigureCallback(
@@ -175,6 +250,8 @@ void DepthSegmenter::dynamicReconfigureCallback(
   // General params.
   params_.dilate_depth_image = config.dilate_depth_image;
   params_.dilation_size = config.dilation_size;
+  params_.concurrent_stages = config.concurrent_stages;
+  params_.compact_maps = config.compact_maps;
 
   // Surface normal params.
   if (config.normals_window_size % 2u != 1u) {
@@ -191,11 +268,13 @@ void DepthSegmenter::dynamicReconfigureCallback(
   }
   if (config.normals_method !=
           static_cast<int>(SurfaceNormalEstimationMethod::kDepthWindowFilter) &&
+      config.normals_method !=
+          static_cast<int>(SurfaceNormalEstimationMethod::kIntegralImage) &&
       config.normals_window_size >= 8u) {
     // Resetting the config value to its previous value.
     config.normals_window_size = params_.normals.window_size;
-    LOG(ERROR) << "Only normal method Own supports normal window sizes larger "
-                  "than 7.";
+    LOG(ERROR) << "Only normal methods Own and IntegralImage support normal "
+                  "window sizes larger than 7.";
     return;
   }
   params_.normals.method =
@@ -204,6 +283,8 @@ void DepthSegmenter::dynamicReconfigureCallback(
       config.normals_distance_factor_threshold;
   params_.normals.window_size = config.normals_window_size;
   params_.normals.display = config.normals_display;
+  params_.normals.use_distance_refinement =
+      config.normals_use_distance_refinement;
 
   // Depth discontinuity map params.
   if (config.depth_discontinuity_kernel_size % 2u != 1u) {
@@ -215,6 +296,9 @@ void DepthSegmenter::dynamicReconfigureCallback(
   }
   params_.depth_discontinuity.use_discontinuity =
       config.depth_discontinuity_use_depth_discontinuity;
+  params_.depth_discontinuity.method =
+      static_cast<DepthDiscontinuityMapMethod>(
+          config.depth_discontinuity_method);
   params_.depth_discontinuity.kernel_size =
       config.depth_discontinuity_kernel_size;
   params_.depth_discontinuity.discontinuity_ratio =
@@ -229,6 +313,8 @@ void DepthSegmenter::dynamicReconfigureCallback(
     return;
   }
   params_.max_distance.use_max_distance = config.max_distance_use_max_distance;
+  params_.max_distance.method =
+      static_cast<MaxDistanceMapMethod>(config.max_distance_method);
   params_.max_distance.display = config.max_distance_display;
   params_.max_distance.exclude_nan_as_max_distance =
       config.max_distance_exclude_nan_as_max_distance;
@@ -256,6 +342,8 @@ void DepthSegmenter::dynamicReconfigureCallback(
   }
   params_.min_convexity.use_min_convexity =
       config.min_convexity_use_min_convexity;
+  params_.min_convexity.method =
+      static_cast<MinConvexityMapMethod>(config.min_convexity_method);
   params_.min_convexity.morphological_opening_size =
       config.min_convexity_morphological_opening_size;
   params_.min_convexity.step_size = config.min_convexity_step_size;
@@ -281,16 +369,46 @@ void DepthSegmenter::dynamicReconfigureCallback(
 
   // Label map params.
   params_.label.method = static_cast<LabelMapMethod>(config.label_method);
+  params_.label.edge_reassignment_method =
+      static_cast<EdgeReassignmentMethod>(
+          config.label_edge_reassignment_method);
   params_.label.min_size = config.label_min_size;
   params_.label.use_inpaint = config.label_use_inpaint;
   params_.label.inpaint_method = config.label_inpaint_method;
   params_.label.display = config.label_display;
 
+  // Timing params.
+  params_.timing.enable = config.timing_enable;
+
+  // Incremental params.
+  params_.incremental.enable = config.incremental_enable;
+  params_.incremental.tile_size = config.incremental_tile_size;
+  params_.incremental.noise_thresholding_factor =
+      config.incremental_noise_thresholding_factor;
+  params_.incremental.full_update_interval =
+      config.incremental_full_update_interval;
+  // The cached maps were computed with the previous params. The cache is
+  // owned by the thread computing the maps, which drops it on the next frame.
+  invalidate_cache_ = true;
+
+  // Pyramid params.
+  params_.pyramid.level = config.pyramid_level;
+
+  // Region of interest params.
+  params_.roi.enable = config.roi_enable;
+  params_.roi.x = config.roi_x;
+  params_.roi.y = config.roi_y;
+  params_.roi.width = config.roi_width;
+  params_.roi.height = config.roi_height;
+  params_.roi.min_depth = config.roi_min_depth;
+  params_.roi.max_depth = config.roi_max_depth;
+
   LOG(INFO) << "Dynamic Reconfigure Request.";
 }
 
 void DepthSegmenter::computeDepthMap(const cv::Mat& depth_image,
                                      cv::Mat* depth_map) {
+  ScopedStageTimer stage_timer(Stage::kDepthMap, getActiveStageTimer());
   CHECK(!depth_image.empty());
   CHECK_EQ(depth_image.type(), CV_32FC1);
   CHECK_NOTNULL(depth_map);
@@ -298,165 +416,317 @@ void DepthSegmenter::computeDepthMap(const cv::Mat& depth_image,
   CHECK_EQ(depth_map->type(), CV_32FC3);
   CHECK(!depth_camera_.getCameraMatrix().empty());
 
-  cv::rgbd::depthTo3d(depth_image, depth_camera_.getCameraMatrix(), *depth_map);
+  backProjectDepth(depth_image, depth_camera_.getRayTable(), cv::Point(0, 0),
+                   depth_map);
 }
 
 void DepthSegmenter::computeDepthDiscontinuityMap(
     const cv::Mat& depth_image, cv::Mat* depth_discontinuity_map) {
+  ScopedStageTimer stage_timer(Stage::kDepthDiscontinuityMap,
+                               getActiveStageTimer());
   CHECK(!depth_image.empty());
   CHECK_EQ(depth_image.type(), CV_32FC1);
   CHECK_NOTNULL(depth_discontinuity_map);
-  CHECK_EQ(depth_discontinuity_map->type(), CV_32FC1);
+  CHECK(depth_discontinuity_map->type() == CV_32FC1 ||
+        depth_discontinuity_map->type() == CV_8UC1);
+
+  if (params_.depth_discontinuity.method ==
+      DepthDiscontinuityMapMethod::kFused) {
+    computeDepthDiscontinuityMapFused(
+        depth_image, params_.depth_discontinuity.kernel_size,
+        params_.depth_discontinuity.discontinuity_ratio,
+        depth_discontinuity_map);
+  } else {
+    computeDepthDiscontinuityMapMorphology(depth_image,
+                                           depth_discontinuity_map);
+  }
 
+  if (params_.depth_discontinuity.display) {
+    static const std::string kWindowName = "DepthDiscontinuityMap";
+    showMap(kWindowName, *depth_discontinuity_map);
+  }
+}
+
+void DepthSegmenter::computeDepthDiscontinuityMapMorphology(
+    const cv::Mat& depth_image, cv::Mat* depth_discontinuity_map) {
   constexpr size_t kMaxValue = 1u;
   constexpr double kNanThreshold = 0.0;
 
-  cv::Size image_size(depth_image.cols, depth_image.rows);
-  cv::Mat element = cv::getStructuringElement(
-      cv::MORPH_RECT, cv::Size(params_.depth_discontinuity.kernel_size,
-                               params_.depth_discontinuity.kernel_size));
+  updateRectStructuringElement(
+      cv::Size(params_.depth_discontinuity.kernel_size,
+               params_.depth_discontinuity.kernel_size),
+      &workspace_.depth_discontinuity_element);
+  const cv::Mat& element = workspace_.depth_discontinuity_element;
 
-  cv::Mat depth_without_nans(image_size, CV_32FC1);
+  cv::Mat& depth_without_nans = workspace_.depth_without_nans;
   cv::threshold(depth_image, depth_without_nans, kNanThreshold, kMaxValue,
                 cv::THRESH_TOZERO);
 
-  cv::Mat dilate_image(image_size, CV_32FC1);
+  cv::Mat& dilate_image = workspace_.dilate_image;
   cv::dilate(depth_without_nans, dilate_image, element);
   dilate_image -= depth_without_nans;
 
-  cv::Mat erode_image(image_size, CV_32FC1);
+  cv::Mat& erode_image = workspace_.erode_image;
   cv::erode(depth_without_nans, erode_image, element);
-  erode_image = depth_without_nans - erode_image;
+  cv::subtract(depth_without_nans, erode_image, erode_image);
 
-  cv::Mat max_image(image_size, CV_32FC1);
+  // The dilated image is not needed anymore and holds the maximum.
+  cv::Mat& max_image = workspace_.dilate_image;
   cv::max(dilate_image, erode_image, max_image);
 
-  cv::Mat ratio_image(image_size, CV_32FC1);
+  cv::Mat& ratio_image = workspace_.ratio_image;
   cv::divide(max_image, depth_without_nans, ratio_image);
-
-  cv::threshold(ratio_image, *depth_discontinuity_map,
-                params_.depth_discontinuity.discontinuity_ratio, kMaxValue,
-                cv::THRESH_BINARY);
-
-  if (params_.depth_discontinuity.display) {
-    static const std::string kWindowName = "DepthDiscontinuityMap";
-    cv::namedWindow(kWindowName, cv::WINDOW_AUTOSIZE);
-    cv::imshow(kWindowName, *depth_discontinuity_map);
-    cv::waitKey(1);
+  // cv::divide returns zero for a zero denominator in OpenCV 3 only. Newer
+  // versions return inf, which would mark the invalid depths next to valid
+  // ones as discontinuities.
+  cv::Mat& invalid_depth_mask = workspace_.invalid_depth_mask;
+  cv::compare(depth_without_nans, 0.0, invalid_depth_mask, cv::CMP_EQ);
+  ratio_image.setTo(0.0f, invalid_depth_mask);
+
+  if (depth_discontinuity_map->type() == CV_8UC1) {
+    cv::threshold(ratio_image, ratio_image,
+                  params_.depth_discontinuity.discontinuity_ratio, kMaxValue,
+                  cv::THRESH_BINARY);
+    ratio_image.convertTo(*depth_discontinuity_map, CV_8UC1);
+  } else {
+    cv::threshold(ratio_image, *depth_discontinuity_map,
+                  params_.depth_discontinuity.discontinuity_ratio, kMaxValue,
+                  cv::THRESH_BINARY);
   }
 }
 
+float DepthSegmenter::computeAxialNoise(const float z) const {
+  // TODO(ff): Theta should be the angle between the normal and the camera
+  // direction. (Here, a mean value is used, as suggested by Tateno et al.
+  // (2016))
+  static constexpr float theta = 30.f * CV_PI / 180.f;
+  return params_.max_distance.sensor_noise_param_1st_order +
+         params_.max_distance.sensor_noise_param_2nd_order *
+             (z - params_.max_distance.sensor_min_distance) *
+             (z - params_.max_distance.sensor_min_distance) +
+         params_.max_distance.sensor_noise_param_3rd_order / cv::sqrt(z) *
+             theta * theta / (CV_PI / 2.0f - theta) * (CV_PI / 2.0f - theta);
+}
+
 void DepthSegmenter::computeMaxDistanceMap(const cv::Mat& depth_map,
                                            cv::Mat* max_distance_map) {
+  ScopedStageTimer stage_timer(Stage::kMaxDistanceMap, getActiveStageTimer());
   CHECK(!depth_map.empty());
   CHECK_EQ(depth_map.type(), CV_32FC3);
   CHECK_NOTNULL(max_distance_map);
-  CHECK_EQ(max_distance_map->type(), CV_32FC1);
+  CHECK(max_distance_map->type() == CV_32FC1 ||
+        max_distance_map->type() == CV_8UC1);
+  if (max_distance_map->type() == CV_8UC1) {
+    CHECK(params_.max_distance.method == MaxDistanceMapMethod::kFused &&
+          params_.max_distance.use_threshold)
+        << "A binary max distance map requires the fused, thresholded map.";
+  }
   // Check if window_size is odd.
   CHECK_EQ(params_.max_distance.window_size % 2, 1u);
 
-  max_distance_map->setTo(cv::Scalar(0.0f));
-
-  const size_t kernel_size = params_.max_distance.window_size;
-  const size_t n_kernels = kernel_size * kernel_size - 1u;
+  if (params_.max_distance.method == MaxDistanceMapMethod::kFused) {
+    computeMaxDistanceMapFused(depth_map, max_distance_map);
+  } else {
+    max_distance_map->setTo(cv::Scalar(0.0f));
+
+    const size_t kernel_size = params_.max_distance.window_size;
+    const size_t n_kernels = kernel_size * kernel_size - 1u;
+
+    cv::Mat& kernel = workspace_.max_distance_kernel;
+    cv::Mat& filtered_image = workspace_.max_distance_difference_map;
+    std::vector<cv::Mat>& channels = workspace_.max_distance_channels;
+    cv::Mat& distance_map = workspace_.distance_map;
+    cv::Mat& nan_mask = workspace_.nan_mask;
+    // Define the n kernels and compute the filtered images.
+    for (size_t i = 0u; i < n_kernels + 1u; ++i) {
+      if (i == n_kernels / 2u) {
+        continue;
+      }
+      kernel.create(kernel_size, kernel_size, CV_32FC1);
+      kernel.setTo(cv::Scalar(0.0f));
+      kernel.at<float>(i) = -1.0f;
+      kernel.at<float>(n_kernels / 2u) = 1.0f;
+
+      // Compute the filtered images.
+      cv::filter2D(depth_map, filtered_image, CV_32FC3, kernel);
+
+      // Calculate the norm over the three channels.
+      cv::split(filtered_image, channels);
+      if (params_.max_distance.ignore_nan_coordinates) {
+        // Ignore nan values for the distance calculation.
+        for (cv::Mat& channel : channels) {
+          cv::compare(channel, channel, nan_mask, cv::CMP_NE);
+          cv::multiply(channel, channel, channel);
+          channel.setTo(cv::Scalar(0.0f), nan_mask);
+        }
+      } else {
+        // If at least one of the coordinates is nan the distance will be nan.
+        for (cv::Mat& channel : channels) {
+          cv::multiply(channel, channel, channel);
+        }
+      }
+      cv::add(channels[0], channels[1], distance_map);
+      cv::add(distance_map, channels[2], distance_map);
+
+      // cv::max does not propagate nan, hence a nan distance is either
+      // excluded or marked as infinite and turned into nan afterwards.
+      cv::compare(distance_map, distance_map, nan_mask, cv::CMP_NE);
+      distance_map.setTo(
+          cv::Scalar(params_.max_distance.exclude_nan_as_max_distance
+                         ? 0.0f
+                         : std::numeric_limits<float>::infinity()),
+          nan_mask);
+      // Individually set the maximum pixel value of the two matrices.
+      cv::max(*max_distance_map, distance_map, *max_distance_map);
+    }
 
-  // Define the n kernels and compute the filtered images.
-  for (size_t i = 0u; i < n_kernels + 1u; ++i) {
-    if (i == n_kernels / 2u) {
-      continue;
+    cv::sqrt(*max_distance_map, *max_distance_map);
+    cv::compare(*max_distance_map, std::numeric_limits<float>::infinity(),
+                nan_mask, cv::CMP_EQ);
+    max_distance_map->setTo(
+        cv::Scalar(std::numeric_limits<float>::quiet_NaN()), nan_mask);
+    cv::split(depth_map, channels);
+
+    // Threshold the max_distance_map to get an edge map.
+    if (params_.max_distance.use_threshold) {
+      for (size_t i = 0u; i < depth_map.cols * depth_map.rows; ++i) {
+        // Threshold the distance map based on Nguyen et al. (2012) noise
+        // model.
+        const float sigma_axial_noise =
+            computeAxialNoise((channels[2]).at<float>(i));
+        if (max_distance_map->at<float>(i) >
+            sigma_axial_noise *
+                params_.max_distance.noise_thresholding_factor) {
+          max_distance_map->at<float>(i) = 1.0f;
+        } else {
+          max_distance_map->at<float>(i) = 0.0f;
+        }
+      }
     }
-    cv::Mat kernel = cv::Mat::zeros(kernel_size, kernel_size, CV_32FC1);
-    kernel.at<float>(i) = -1.0f;
-    kernel.at<float>(n_kernels / 2u) = 1.0f;
-
-    // Compute the filtered images.
-    cv::Mat filtered_image(depth_map.size(), CV_32FC3);
-    cv::filter2D(depth_map, filtered_image, CV_32FC3, kernel);
-
-    // Calculate the norm over the three channels.
-    std::vector<cv::Mat> channels(3);
-    cv::split(filtered_image, channels);
-    cv::Mat distance_map(depth_map.size(), CV_32FC1);
-    if (params_.max_distance.ignore_nan_coordinates) {
-      // Ignore nan values for the distance calculation.
-      cv::Mat mask_0 = cv::Mat(channels[0] == channels[0]);
-      cv::Mat mask_1 = cv::Mat(channels[1] == channels[1]);
-      cv::Mat mask_2 = cv::Mat(channels[2] == channels[2]);
-      mask_0.convertTo(mask_0, CV_32FC1);
-      mask_1.convertTo(mask_1, CV_32FC1);
-      mask_2.convertTo(mask_2, CV_32FC1);
-      distance_map = mask_0.mul(channels[0].mul(channels[0])) +
-                     mask_1.mul(channels[1].mul(channels[1])) +
-                     mask_2.mul(channels[2].mul(channels[2]));
-    } else {
-      // If at least one of the coordinates is nan the distance will be nan.
-      distance_map = channels[0].mul(channels[0]) +
-                     channels[1].mul(channels[1]) +
-                     channels[2].mul(channels[2]);
+  }
+
+  if (params_.max_distance.display) {
+    static const std::string kWindowName = "MaxDistanceMap";
+    showMap(kWindowName, *max_distance_map);
+  }
+}
+
+void DepthSegmenter::computeMaxDistanceMapFused(const cv::Mat& depth_map,
+                                                cv::Mat* max_distance_map) {
+  CHECK_NOTNULL(max_distance_map);
+  CHECK_EQ(depth_map.size(), max_distance_map->size());
+  const int anchor = params_.max_distance.window_size / 2u;
+  std::vector<cv::Point>& neighbor_offsets = workspace_.max_distance_offsets;
+  neighbor_offsets.clear();
+  for (int y = -anchor; y <= anchor; ++y) {
+    for (int x = -anchor; x <= anchor; ++x) {
+      if (x != 0 || y != 0) {
+        neighbor_offsets.emplace_back(x, y);
+      }
     }
+  }
 
-    if (params_.max_distance.exclude_nan_as_max_distance) {
-      cv::Mat mask = cv::Mat(distance_map == distance_map);
-      mask.convertTo(mask, CV_32FC1);
-      distance_map = mask.mul(distance_map);
+  const int rows = depth_map.rows;
+  const int cols = depth_map.cols;
+  // Mirror out of bounds coordinates the same way cv::filter2D does.
+  auto border_interpolate = [](const int coordinate, const int length) {
+    if (static_cast<unsigned>(coordinate) < static_cast<unsigned>(length)) {
+      return coordinate;
     }
-    // Individually set the maximum pixel value of the two matrices.
-    cv::max(*max_distance_map, distance_map, *max_distance_map);
-  }
-
-  cv::sqrt(*max_distance_map, *max_distance_map);
-  std::vector<cv::Mat> channels(3);
-  cv::split(depth_map, channels);
-
-  // Threshold the max_distance_map to get an edge map.
-  if (params_.max_distance.use_threshold) {
-    for (size_t i = 0u; i < depth_map.cols * depth_map.rows; ++i) {
-      // Threshold the distance map based on Nguyen et al. (2012) noise model.
-      // TODO(ff): Theta should be the angle between the normal and the camera
-      // direction. (Here, a mean value is used, as suggested by Tateno et al.
-      // (2016))
-      static constexpr float theta = 30.f * CV_PI / 180.f;
-      float z = (channels[2]).at<float>(i);
-      float sigma_axial_noise =
-          params_.max_distance.sensor_noise_param_1st_order +
-          params_.max_distance.sensor_noise_param_2nd_order *
-              (z - params_.max_distance.sensor_min_distance) *
-              (z - params_.max_distance.sensor_min_distance) +
-          params_.max_distance.sensor_noise_param_3rd_order / cv::sqrt(z) *
-              theta * theta / (CV_PI / 2.0f - theta) * (CV_PI / 2.0f - theta);
-      if (max_distance_map->at<float>(i) >
-          sigma_axial_noise * params_.max_distance.noise_thresholding_factor) {
-        max_distance_map->at<float>(i) = 1.0f;
+    return cv::borderInterpolate(coordinate, length, cv::BORDER_REFLECT_101);
+  };
+
+  const bool ignore_nan_coordinates =
+      params_.max_distance.ignore_nan_coordinates;
+  const bool exclude_nan_as_max_distance =
+      params_.max_distance.exclude_nan_as_max_distance;
+  const bool use_threshold = params_.max_distance.use_threshold;
+  const double noise_thresholding_factor =
+      params_.max_distance.noise_thresholding_factor;
+  constexpr float kFloatNan = std::numeric_limits<float>::quiet_NaN();
+  const bool is_binary_map = max_distance_map->type() == CV_8UC1;
+
+#pragma omp parallel for
+  for (int y = 0; y < rows; ++y) {
+    const cv::Vec3f* depth_row = depth_map.ptr<cv::Vec3f>(y);
+    float* max_distance_row = max_distance_map->ptr<float>(y);
+    uint8_t* binary_max_distance_row = max_distance_map->ptr<uint8_t>(y);
+    for (int x = 0; x < cols; ++x) {
+      const cv::Vec3f& point = depth_row[x];
+      float max_squared_distance = 0.0f;
+      for (const cv::Point& offset : neighbor_offsets) {
+        const int neighbor_y = border_interpolate(y + offset.y, rows);
+        const int neighbor_x = border_interpolate(x + offset.x, cols);
+        const cv::Vec3f difference =
+            point - depth_map.at<cv::Vec3f>(neighbor_y, neighbor_x);
+        float squared_distance;
+        if (ignore_nan_coordinates) {
+          // Ignore nan values for the distance calculation.
+          squared_distance = 0.0f;
+          for (size_t coordinate = 0u; coordinate < 3u; ++coordinate) {
+            if (!cvIsNaN(difference[coordinate])) {
+              squared_distance +=
+                  difference[coordinate] * difference[coordinate];
+            }
+          }
+        } else {
+          // If at least one of the coordinates is nan the distance will be nan.
+          squared_distance = difference[0] * difference[0] +
+                             difference[1] * difference[1] +
+                             difference[2] * difference[2];
+        }
+        if (cvIsNaN(squared_distance)) {
+          if (exclude_nan_as_max_distance) {
+            continue;
+          }
+          // A nan distance renders the maximum distance of this pixel nan.
+          max_squared_distance = kFloatNan;
+          break;
+        }
+        max_squared_distance = std::max(max_squared_distance, squared_distance);
+      }
+
+      const float max_distance = std::sqrt(max_squared_distance);
+      if (!use_threshold) {
+        max_distance_row[x] = max_distance;
+        continue;
+      }
+      const float sigma_axial_noise = computeAxialNoise(point[2]);
+      const bool is_edge =
+          max_distance > sigma_axial_noise * noise_thresholding_factor;
+      if (is_binary_map) {
+        binary_max_distance_row[x] = is_edge ? 1u : 0u;
       } else {
-        max_distance_map->at<float>(i) = 0.0f;
+        max_distance_row[x] = is_edge ? 1.0f : 0.0f;
       }
     }
   }
-  if (params_.max_distance.display) {
-    static const std::string kWindowName = "MaxDistanceMap";
-    cv::namedWindow(kWindowName, cv::WINDOW_AUTOSIZE);
-    cv::imshow(kWindowName, *max_distance_map);
-    cv::waitKey(1);
-  }
 }
 
 void DepthSegmenter::computeNormalMap(const cv::Mat& depth_map,
                                       cv::Mat* normal_map) {
+  ScopedStageTimer stage_timer(Stage::kNormalMap, getActiveStageTimer());
   CHECK(!depth_map.empty());
   CHECK(depth_map.type() == CV_32FC3 &&
             (params_.normals.method == SurfaceNormalEstimationMethod::kFals ||
              params_.normals.method == SurfaceNormalEstimationMethod::kSri ||
              params_.normals.method ==
-                 SurfaceNormalEstimationMethod::kDepthWindowFilter) ||
+                 SurfaceNormalEstimationMethod::kDepthWindowFilter ||
+             params_.normals.method ==
+                 SurfaceNormalEstimationMethod::kIntegralImage) ||
         (depth_map.type() == CV_32FC1 || depth_map.type() == CV_16UC1 ||
          depth_map.type() == CV_32FC3) &&
             params_.normals.method == SurfaceNormalEstimationMethod::kLinemod);
   CHECK_NOTNULL(normal_map);
-  if (params_.normals.method !=
+  if (params_.normals.method ==
       SurfaceNormalEstimationMethod::kDepthWindowFilter) {
-    rgbd_normals_(depth_map, *normal_map);
-  } else {
     computeOwnNormals(params_.normals, depth_map, normal_map);
+  } else if (params_.normals.method ==
+             SurfaceNormalEstimationMethod::kIntegralImage) {
+    computeIntegralImageNormals(params_.normals, depth_map,
+                                &workspace_.integral_image_normals, normal_map);
+  } else {
+    rgbd_normals_(depth_map, *normal_map);
   }
   if (params_.normals.display) {
     static const std::string kWindowName = "NormalMap";
@@ -468,107 +738,132 @@ void DepthSegmenter::computeNormalMap(const cv::Mat& depth_map,
   }
 }
 
+// Initial value of the min convexity, above any convexity of a pixel.
+constexpr float kMaxConvexity = 10.0f;
+
 void DepthSegmenter::computeMinConvexityMap(const cv::Mat& depth_map,
                                             const cv::Mat& normal_map,
                                             cv::Mat* min_convexity_map) {
+  ScopedStageTimer stage_timer(Stage::kMinConvexityMap, getActiveStageTimer());
   CHECK(!depth_map.empty());
   CHECK(!normal_map.empty());
   CHECK_EQ(depth_map.type(), CV_32FC3);
   CHECK_EQ(normal_map.type(), CV_32FC3);
   CHECK_EQ(depth_map.size(), normal_map.size());
   CHECK_NOTNULL(min_convexity_map);
-  CHECK_EQ(min_convexity_map->type(), CV_32FC1);
+  const bool is_binary_map = min_convexity_map->type() == CV_8UC1;
+  CHECK(is_binary_map || min_convexity_map->type() == CV_32FC1);
   CHECK_EQ(depth_map.size(), min_convexity_map->size());
   // Check if window_size is odd.
   CHECK_EQ(params_.min_convexity.window_size % 2, 1u);
-  min_convexity_map->setTo(cv::Scalar(10.0f));
-
-  const size_t kernel_size = params_.min_convexity.window_size +
-                             (params_.min_convexity.step_size - 1u) *
-                                 (params_.min_convexity.window_size - 1u);
-  const size_t n_kernels =
-      params_.min_convexity.window_size * params_.min_convexity.window_size -
-      1u;
-  // Define the n point-wise distance kernels and compute the filtered images.
-  // The kernels for i look as follows (e.g. window_size = 5, i = 6):
-  //     0  0  0  0  0
-  //     0  1  0  0  0
-  //     0  0 -1  0  0
-  //     0  0  0  0  0
-  //     0  0  0  0  0
-  for (size_t i = 0u; i < n_kernels + 1u;
-       i += static_cast<size_t>(i % kernel_size == kernel_size) * kernel_size +
-            params_.min_convexity.step_size) {
-    if (i == n_kernels / 2u) {
-      continue;
+  if (is_binary_map) {
+    CHECK(params_.min_convexity.method == MinConvexityMapMethod::kFused &&
+          params_.min_convexity.use_threshold)
+        << "A binary min convexity map requires the fused, thresholded map.";
+  }
+
+  if (params_.min_convexity.method == MinConvexityMapMethod::kFused) {
+    computeMinConvexityMapFused(depth_map, normal_map, min_convexity_map);
+  } else {
+    min_convexity_map->setTo(cv::Scalar(kMaxConvexity));
+    const size_t kernel_size = params_.min_convexity.window_size +
+                               (params_.min_convexity.step_size - 1u) *
+                                   (params_.min_convexity.window_size - 1u);
+    const size_t n_kernels =
+        params_.min_convexity.window_size * params_.min_convexity.window_size -
+        1u;
+    // Define the n point-wise distance kernels and compute the filtered images.
+    // The kernels for i look as follows (e.g. window_size = 5, i = 6):
+    //     0  0  0  0  0
+    //     0  1  0  0  0
+    //     0  0 -1  0  0
+    //     0  0  0  0  0
+    //     0  0  0  0  0
+    cv::Mat& difference_kernel = workspace_.difference_kernel;
+    cv::Mat& normal_kernel = workspace_.normal_kernel;
+    cv::Mat& difference_map = workspace_.difference_map;
+    cv::Mat& difference_times_normal = workspace_.difference_times_normal;
+    std::vector<cv::Mat>& channels = workspace_.channels;
+    cv::Mat& vector_projection = workspace_.vector_projection;
+    cv::Mat& concavity_mask = workspace_.concavity_mask;
+    cv::Mat& convexity_mask = workspace_.convexity_mask;
+    cv::Mat& filtered_normal_image = workspace_.filtered_normal_map;
+    cv::Mat& normal_times_filtered_normal =
+        workspace_.normal_times_filtered_normal;
+    cv::Mat& nan_mask = workspace_.normal_nan_mask;
+    cv::Mat& normal_vector_projection = workspace_.normal_vector_projection;
+    cv::Mat& convexity_map = workspace_.convexity_map;
+    for (size_t i = 0u; i < n_kernels + 1u;
+         i += static_cast<size_t>(i % kernel_size == kernel_size) *
+                  kernel_size +
+              params_.min_convexity.step_size) {
+      if (i == n_kernels / 2u) {
+        continue;
+      }
+      difference_kernel.create(kernel_size, kernel_size, CV_32FC1);
+      difference_kernel.setTo(cv::Scalar(0.0f));
+      difference_kernel.at<float>(i) = 1.0f;
+      difference_kernel.at<float>(n_kernels / 2u) = -1.0f;
+
+      // Compute the filtered images.
+      cv::filter2D(depth_map, difference_map, CV_32FC3, difference_kernel);
+
+      // Calculate the dot product over the three channels of difference_map
+      // and the inverted normal_map.
+      constexpr double kInvertScale = -1.0;
+      cv::multiply(difference_map, normal_map, difference_times_normal,
+                   kInvertScale);
+      cv::split(difference_times_normal, channels);
+      cv::add(channels[0], channels[1], vector_projection);
+      cv::add(vector_projection, channels[2], vector_projection);
+
+      // TODO(ff): Check if params_.min_convexity.mask_threshold should be
+      // mid-point distance dependent.
+      // maybe do something like:
+      // std::vector<cv::Mat> depth_map_channels(3);
+      // cv::split(depth_map, depth_map_channels);
+      // vector_projection = vector_projection.mul(depth_map_channels[2]);
+
+      // Split the projected vector images into convex and concave
+      // regions/masks.
+      constexpr float kMaxBinaryValue = 1.0f;
+      cv::threshold(vector_projection, convexity_mask,
+                    params_.min_convexity.mask_threshold, kMaxBinaryValue,
+                    cv::THRESH_BINARY);
+      cv::threshold(vector_projection, concavity_mask,
+                    params_.min_convexity.mask_threshold, kMaxBinaryValue,
+                    cv::THRESH_BINARY_INV);
+
+      normal_kernel.create(kernel_size, kernel_size, CV_32FC1);
+      normal_kernel.setTo(cv::Scalar(0.0f));
+      normal_kernel.at<float>(i) = 1.0f;
+
+      cv::filter2D(normal_map, filtered_normal_image, CV_32FC3, normal_kernel);
+      cv::compare(filtered_normal_image, filtered_normal_image, nan_mask,
+                  cv::CMP_NE);
+      normal_map.copyTo(filtered_normal_image, nan_mask);
+
+      // TODO(ff): Create a function for this mulitplication and projections.
+      cv::multiply(normal_map, filtered_normal_image,
+                   normal_times_filtered_normal);
+      cv::compare(normal_times_filtered_normal, normal_times_filtered_normal,
+                  nan_mask, cv::CMP_NE);
+      filtered_normal_image.copyTo(normal_times_filtered_normal, nan_mask);
+      cv::split(normal_times_filtered_normal, channels);
+      cv::add(channels[0], channels[1], normal_vector_projection);
+      cv::add(normal_vector_projection, channels[2], normal_vector_projection);
+      cv::multiply(concavity_mask, normal_vector_projection,
+                   normal_vector_projection);
+
+      cv::add(convexity_mask, normal_vector_projection, convexity_map);
+
+      // Individually set the minimum pixel value of the two matrices.
+      cv::min(*min_convexity_map, convexity_map, *min_convexity_map);
     }
-    cv::Mat difference_kernel =
-        cv::Mat::zeros(kernel_size, kernel_size, CV_32FC1);
-    difference_kernel.at<float>(i) = 1.0f;
-    difference_kernel.at<float>(n_kernels / 2u) = -1.0f;
-
-    // Compute the filtered images.
-    cv::Mat difference_map(depth_map.size(), CV_32FC3);
-    cv::filter2D(depth_map, difference_map, CV_32FC3, difference_kernel);
-
-    // Calculate the dot product over the three channels of difference_map and
-    // normal_map.
-    cv::Mat difference_times_normal(depth_map.size(), CV_32FC3);
-    difference_times_normal = difference_map.mul(-normal_map);
-    std::vector<cv::Mat> channels(3);
-    cv::split(difference_times_normal, channels);
-    cv::Mat vector_projection(depth_map.size(), CV_32FC1);
-    vector_projection = channels[0] + channels[1] + channels[2];
-
-    // TODO(ff): Check if params_.min_convexity.mask_threshold should be
-    // mid-point distance dependent.
-    // maybe do something like:
-    // std::vector<cv::Mat> depth_map_channels(3);
-    // cv::split(depth_map, depth_map_channels);
-    // vector_projection = vector_projection.mul(depth_map_channels[2]);
-
-    cv::Mat concavity_mask(depth_map.size(), CV_32FC1);
-    cv::Mat convexity_mask(depth_map.size(), CV_32FC1);
-
-    // Split the projected vector images into convex and concave
-    // regions/masks.
-    constexpr float kMaxBinaryValue = 1.0f;
-    cv::threshold(vector_projection, convexity_mask,
-                  params_.min_convexity.mask_threshold, kMaxBinaryValue,
-                  cv::THRESH_BINARY);
-    cv::threshold(vector_projection, concavity_mask,
-                  params_.min_convexity.mask_threshold, kMaxBinaryValue,
-                  cv::THRESH_BINARY_INV);
-
-    cv::Mat normal_kernel = cv::Mat::zeros(kernel_size, kernel_size, CV_32FC1);
-    normal_kernel.at<float>(i) = 1.0f;
-
-    cv::Mat filtered_normal_image = cv::Mat::zeros(normal_map.size(), CV_32FC3);
-    cv::filter2D(normal_map, filtered_normal_image, CV_32FC3, normal_kernel);
-    normal_map.copyTo(filtered_normal_image,
-                      filtered_normal_image != filtered_normal_image);
-
-    // TODO(ff): Create a function for this mulitplication and projections.
-    cv::Mat normal_times_filtered_normal(depth_map.size(), CV_32FC3);
-    normal_times_filtered_normal = normal_map.mul(filtered_normal_image);
-    filtered_normal_image.copyTo(
-        normal_times_filtered_normal,
-        normal_times_filtered_normal != normal_times_filtered_normal);
-    std::vector<cv::Mat> normal_channels(3);
-    cv::split(normal_times_filtered_normal, normal_channels);
-    cv::Mat normal_vector_projection(depth_map.size(), CV_32FC1);
-    normal_vector_projection =
-        normal_channels[0] + normal_channels[1] + normal_channels[2];
-    normal_vector_projection = concavity_mask.mul(normal_vector_projection);
-
-    cv::Mat convexity_map = cv::Mat::ones(depth_map.size(), CV_32FC1);
-    convexity_map = convexity_mask + normal_vector_projection;
-
-    // Individually set the minimum pixel value of the two matrices.
-    cv::min(*min_convexity_map, convexity_map, *min_convexity_map);
-  }
-
-  if (params_.min_convexity.use_threshold) {
+  }
+
+  // The fused binary map is thresholded already.
+  if (params_.min_convexity.use_threshold && !is_binary_map) {
     constexpr float kMaxBinaryValue = 1.0f;
     cv::threshold(*min_convexity_map, *min_convexity_map,
                   params_.min_convexity.threshold, kMaxBinaryValue,
@@ -576,21 +871,116 @@ void DepthSegmenter::computeMinConvexityMap(const cv::Mat& depth_map,
   }
 
   if (params_.min_convexity.use_morphological_opening) {
-    cv::Mat element = cv::getStructuringElement(
-        cv::MORPH_RECT,
+    updateRectStructuringElement(
         cv::Size(2u * params_.min_convexity.morphological_opening_size + 1u,
                  2u * params_.min_convexity.morphological_opening_size + 1u),
-        cv::Point(params_.min_convexity.morphological_opening_size,
-                  params_.min_convexity.morphological_opening_size));
+        &workspace_.min_convexity_opening_element);
     cv::morphologyEx(*min_convexity_map, *min_convexity_map, cv::MORPH_OPEN,
-                     element);
+                     workspace_.min_convexity_opening_element);
   }
 
   if (params_.min_convexity.display) {
     static const std::string kWindowName = "MinConcavityMap";
-    cv::namedWindow(kWindowName, cv::WINDOW_AUTOSIZE);
-    cv::imshow(kWindowName, *min_convexity_map);
-    cv::waitKey(1);
+    showMap(kWindowName, *min_convexity_map);
+  }
+}
+
+void DepthSegmenter::computeMinConvexityMapFused(const cv::Mat& depth_map,
+                                                 const cv::Mat& normal_map,
+                                                 cv::Mat* min_convexity_map) {
+  CHECK_NOTNULL(min_convexity_map);
+  const int window_size = params_.min_convexity.window_size;
+  const int step_size = params_.min_convexity.step_size;
+  const int kernel_size = window_size + (step_size - 1) * (window_size - 1);
+  const int n_kernels = window_size * window_size - 1;
+  const int anchor = kernel_size / 2;
+
+  // Use the same neighbor offsets as the kernels of the filter based
+  // implementation, such that both methods produce identical results.
+  const int center_index = n_kernels / 2;
+  const cv::Point center_offset(center_index % kernel_size - anchor,
+                                center_index / kernel_size - anchor);
+  std::vector<cv::Point>& neighbor_offsets = workspace_.min_convexity_offsets;
+  neighbor_offsets.clear();
+  for (int i = 0; i < n_kernels + 1; i += step_size) {
+    if (i == center_index) {
+      continue;
+    }
+    neighbor_offsets.emplace_back(i % kernel_size - anchor,
+                                  i / kernel_size - anchor);
+  }
+
+  const int rows = depth_map.rows;
+  const int cols = depth_map.cols;
+  // Mirror out of bounds coordinates the same way cv::filter2D does.
+  auto border_interpolate = [](const int coordinate, const int length) {
+    if (static_cast<unsigned>(coordinate) < static_cast<unsigned>(length)) {
+      return coordinate;
+    }
+    return cv::borderInterpolate(coordinate, length, cv::BORDER_REFLECT_101);
+  };
+  const float mask_threshold =
+      static_cast<float>(params_.min_convexity.mask_threshold);
+  // A binary map is thresholded here, the same way cv::threshold compares.
+  const bool is_binary_map = min_convexity_map->type() == CV_8UC1;
+  const float threshold = static_cast<float>(params_.min_convexity.threshold);
+
+#pragma omp parallel for
+  for (int y = 0; y < rows; ++y) {
+    const cv::Vec3f* normal_row = normal_map.ptr<cv::Vec3f>(y);
+    float* min_convexity_row = min_convexity_map->ptr<float>(y);
+    uint8_t* binary_min_convexity_row = min_convexity_map->ptr<uint8_t>(y);
+    const int center_y = border_interpolate(y + center_offset.y, rows);
+    for (int x = 0; x < cols; ++x) {
+      const cv::Vec3f& normal = normal_row[x];
+      const cv::Vec3f& center_point = depth_map.at<cv::Vec3f>(
+          center_y, border_interpolate(x + center_offset.x, cols));
+      float min_convexity = kMaxConvexity;
+      for (const cv::Point& offset : neighbor_offsets) {
+        const int neighbor_y = border_interpolate(y + offset.y, rows);
+        const int neighbor_x = border_interpolate(x + offset.x, cols);
+        const cv::Vec3f& neighbor_point =
+            depth_map.at<cv::Vec3f>(neighbor_y, neighbor_x);
+        const cv::Vec3f& neighbor_normal =
+            normal_map.at<cv::Vec3f>(neighbor_y, neighbor_x);
+
+        // Project the difference vector onto the inverted normal.
+        const float vector_projection =
+            (neighbor_point[0] - center_point[0]) * -normal[0] +
+            (neighbor_point[1] - center_point[1]) * -normal[1] +
+            (neighbor_point[2] - center_point[2]) * -normal[2];
+        const float convexity_mask =
+            vector_projection > mask_threshold ? 1.0f : 0.0f;
+        const float concavity_mask = 1.0f - convexity_mask;
+
+        // Project the neighbor normal onto the normal, falling back to the
+        // available values where either of them is nan.
+        cv::Vec3f normal_times_neighbor_normal;
+        for (size_t coordinate = 0u; coordinate < 3u; ++coordinate) {
+          float filtered_normal = neighbor_normal[coordinate];
+          if (cvIsNaN(filtered_normal)) {
+            filtered_normal = normal[coordinate];
+          }
+          normal_times_neighbor_normal[coordinate] =
+              normal[coordinate] * filtered_normal;
+          if (cvIsNaN(normal_times_neighbor_normal[coordinate])) {
+            normal_times_neighbor_normal[coordinate] = filtered_normal;
+          }
+        }
+        const float normal_vector_projection =
+            normal_times_neighbor_normal[0] + normal_times_neighbor_normal[1] +
+            normal_times_neighbor_normal[2];
+
+        const float convexity =
+            convexity_mask + concavity_mask * normal_vector_projection;
+        min_convexity = std::min(min_convexity, convexity);
+      }
+      if (is_binary_map) {
+        binary_min_convexity_row[x] = min_convexity > threshold ? 1u : 0u;
+      } else {
+        min_convexity_row[x] = min_convexity;
+      }
+    }
   }
 }
 
@@ -598,32 +988,31 @@ void DepthSegmenter::computeFinalEdgeMap(const cv::Mat& convexity_map,
                                          const cv::Mat& distance_map,
                                          const cv::Mat& discontinuity_map,
                                          cv::Mat* edge_map) {
+  ScopedStageTimer stage_timer(Stage::kFinalEdgeMap, getActiveStageTimer());
   CHECK(!convexity_map.empty());
   CHECK(!distance_map.empty());
   CHECK(!discontinuity_map.empty());
-  CHECK_EQ(convexity_map.type(), CV_32FC1);
-  CHECK_EQ(distance_map.type(), CV_32FC1);
-  CHECK_EQ(discontinuity_map.type(), CV_32FC1);
+  CHECK(convexity_map.type() == CV_32FC1 || convexity_map.type() == CV_8UC1);
+  CHECK_EQ(distance_map.type(), convexity_map.type());
+  CHECK_EQ(discontinuity_map.type(), convexity_map.type());
   CHECK_EQ(convexity_map.size(), distance_map.size());
   CHECK_EQ(convexity_map.size(), discontinuity_map.size());
   CHECK_NOTNULL(edge_map);
   if (params_.final_edge.use_morphological_opening) {
-    cv::Mat element = cv::getStructuringElement(
-        cv::MORPH_RECT,
+    updateRectStructuringElement(
         cv::Size(2u * params_.final_edge.morphological_opening_size + 1u,
                  2u * params_.final_edge.morphological_opening_size + 1u),
-        cv::Point(params_.final_edge.morphological_opening_size,
-                  params_.final_edge.morphological_opening_size));
+        &workspace_.final_edge_opening_element);
 
-    cv::morphologyEx(convexity_map, convexity_map, cv::MORPH_OPEN, element);
+    cv::morphologyEx(convexity_map, convexity_map, cv::MORPH_OPEN,
+                     workspace_.final_edge_opening_element);
   }
   if (params_.final_edge.use_morphological_closing) {
-    cv::Mat element = cv::getStructuringElement(
-        cv::MORPH_RECT,
+    updateRectStructuringElement(
         cv::Size(2u * params_.final_edge.morphological_closing_size + 1u,
                  2u * params_.final_edge.morphological_closing_size + 1u),
-        cv::Point(params_.final_edge.morphological_closing_size,
-                  params_.final_edge.morphological_closing_size));
+        &workspace_.final_edge_closing_element);
+    const cv::Mat& element = workspace_.final_edge_closing_element;
     cv::morphologyEx(distance_map, distance_map, cv::MORPH_CLOSE, element);
 
     // TODO(ntonci): Consider making a separate parameter for discontinuity_map.
@@ -631,18 +1020,471 @@ void DepthSegmenter::computeFinalEdgeMap(const cv::Mat& convexity_map,
                      element);
   }
 
-  cv::Mat distance_discontinuity_map(
-      cv::Size(distance_map.cols, distance_map.rows), CV_32FC1);
-  cv::threshold(distance_map + discontinuity_map, distance_discontinuity_map,
-                1.0, 1.0, cv::THRESH_TRUNC);
-  *edge_map = convexity_map - distance_discontinuity_map;
+  if (convexity_map.type() == CV_8UC1) {
+    // The maximum of the binary maps equals their truncated sum and the
+    // saturated subtraction clamps the negative edges, which the labeling
+    // discards anyway.
+    cv::Mat& distance_discontinuity_map =
+        workspace_.binary_distance_discontinuity_map;
+    cv::max(distance_map, discontinuity_map, distance_discontinuity_map);
+    cv::subtract(convexity_map, distance_discontinuity_map, *edge_map);
+  } else {
+    cv::Mat& distance_discontinuity_map =
+        workspace_.distance_discontinuity_map;
+    cv::add(distance_map, discontinuity_map, distance_discontinuity_map);
+    cv::threshold(distance_discontinuity_map, distance_discontinuity_map, 1.0,
+                  1.0, cv::THRESH_TRUNC);
+    cv::subtract(convexity_map, distance_discontinuity_map, *edge_map);
+  }
 
   // TODO(ff): Perform morphological operations (also) on edge_map.
   if (params_.final_edge.display) {
     static const std::string kWindowName = "FinalEdgeMap";
-    cv::namedWindow(kWindowName, cv::WINDOW_AUTOSIZE);
-    imshow(kWindowName, *edge_map);
-    cv::waitKey(1);
+    showMap(kWindowName, *edge_map);
+  }
+}
+
+void DepthSegmenter::computeGeometricMaps(const cv::Mat& depth_image,
+                                          const cv::Mat& raw_depth_image,
+                                          cv::Mat* depth_map,
+                                          cv::Mat* normal_map,
+                                          cv::Mat* edge_map) {
+  CHECK(!depth_image.empty());
+  CHECK_EQ(depth_image.type(), CV_32FC1);
+  CHECK_NOTNULL(depth_map);
+  CHECK_NOTNULL(normal_map);
+  CHECK_NOTNULL(edge_map);
+  // The other normal engines are bound to the full image size.
+  const bool has_resolution_independent_normals =
+      params_.normals.method ==
+          SurfaceNormalEstimationMethod::kDepthWindowFilter ||
+      params_.normals.method == SurfaceNormalEstimationMethod::kIntegralImage;
+  if ((params_.incremental.enable || params_.pyramid.level > 0u ||
+       params_.roi.enable) &&
+      !has_resolution_independent_normals) {
+    LOG_FIRST_N(WARNING, 1) << "The incremental, pyramid and region of "
+                               "interest modes require the depth window "
+                               "filter or integral image normals, computing "
+                               "all maps for the full frame.";
+  }
+  if (params_.roi.enable && has_resolution_independent_normals) {
+    computeGeometricMapsRoi(depth_image, depth_map, normal_map, edge_map);
+    return;
+  }
+  if (usesPyramid()) {
+    computeGeometricMapsPyramid(depth_image, depth_map, normal_map, edge_map);
+    return;
+  }
+  const bool is_incremental =
+      params_.incremental.enable && has_resolution_independent_normals;
+  if (is_incremental && updateGeometricMapsIncrementally(
+                            depth_image, depth_map, normal_map, edge_map)) {
+    return;
+  }
+  const cv::Size image_size = depth_image.size();
+  createZeros(image_size, CV_32FC3, depth_map);
+  createZeros(image_size, CV_32FC3, normal_map);
+  const int edge_map_type = getEdgeMapType();
+  cv::Mat& discontinuity_map = workspace_.stage_discontinuity_map;
+  cv::Mat& distance_map = workspace_.stage_distance_map;
+  cv::Mat& convexity_map = workspace_.stage_convexity_map;
+  createZeros(image_size, edge_map_type, &discontinuity_map);
+  createZeros(image_size, edge_map_type, &distance_map);
+  createZeros(image_size, edge_map_type, &convexity_map);
+  edge_map->create(image_size, edge_map_type);
+
+  auto compute_depth_discontinuity_map = [&]() {
+    if (params_.depth_discontinuity.use_discontinuity) {
+      computeDepthDiscontinuityMap(depth_image, &discontinuity_map);
+    }
+  };
+  auto compute_max_distance_map = [&]() {
+    if (params_.max_distance.use_max_distance) {
+      computeMaxDistanceMap(*depth_map, &distance_map);
+    }
+  };
+  auto compute_normal_map = [&]() {
+    if (params_.normals.method == SurfaceNormalEstimationMethod::kLinemod) {
+      computeNormalMap(raw_depth_image, normal_map);
+    } else {
+      computeNormalMap(*depth_map, normal_map);
+    }
+  };
+  auto compute_min_convexity_map = [&]() {
+    if (params_.min_convexity.use_min_convexity) {
+      computeMinConvexityMap(*depth_map, *normal_map, &convexity_map);
+    }
+  };
+
+  // The stages form the graph depth image -> {depth map, discontinuity},
+  // depth map -> {normals, max distance} and normals -> convexity. Each
+  // stage is a task, the dependencies are expressed on these tokens. Without
+  // concurrency the single thread runs the tasks in the order given here.
+  char depth_map_token, normal_map_token;
+  constexpr int kMaxConcurrentStages = 3;
+  // The concurrent stages split the threads among them instead of each
+  // starting a team of all threads. The number of threads is a setting of
+  // the task, which only affects the loops of its stage.
+#ifdef _OPENMP
+  const int num_stage_threads =
+      std::max(1, omp_get_max_threads() / kMaxConcurrentStages);
+#endif
+  auto limit_stage_threads = [&]() {
+#ifdef _OPENMP
+    if (params_.concurrent_stages) {
+      omp_set_num_threads(num_stage_threads);
+    }
+#endif
+  };
+#pragma omp parallel num_threads(kMaxConcurrentStages) \
+    if (params_.concurrent_stages)
+#pragma omp single
+  {
+#pragma omp task
+    {
+      limit_stage_threads();
+      compute_depth_discontinuity_map();
+    }
+#pragma omp task depend(out : depth_map_token)
+    {
+      limit_stage_threads();
+      computeDepthMap(depth_image, depth_map);
+    }
+#pragma omp task depend(in : depth_map_token)
+    {
+      limit_stage_threads();
+      compute_max_distance_map();
+    }
+#pragma omp task depend(in : depth_map_token) depend(out : normal_map_token)
+    {
+      limit_stage_threads();
+      compute_normal_map();
+    }
+#pragma omp task depend(in : normal_map_token)
+    {
+      limit_stage_threads();
+      compute_min_convexity_map();
+    }
+  }
+
+  computeFinalEdgeMap(convexity_map, distance_map, discontinuity_map,
+                      edge_map);
+
+  if (is_incremental) {
+    const int tile_size = params_.incremental.tile_size;
+    num_recomputed_tiles_ = ((image_size.width + tile_size - 1) / tile_size) *
+                            ((image_size.height + tile_size - 1) / tile_size);
+    depth_image.copyTo(workspace_.reference_depth);
+    normal_map->copyTo(workspace_.cached_normal_map);
+    edge_map->copyTo(workspace_.cached_edge_map);
+    workspace_.num_incremental_frames = 0u;
+  }
+}
+
+bool DepthSegmenter::updateGeometricMapsIncrementally(
+    const cv::Mat& depth_image, cv::Mat* depth_map, cv::Mat* normal_map,
+    cv::Mat* edge_map) {
+  const IncrementalParams& incremental = params_.incremental;
+  CHECK_GT(incremental.tile_size, 0u);
+  const cv::Mat& reference_depth = workspace_.reference_depth;
+  if (invalidate_cache_.exchange(false) ||
+      reference_depth.size() != depth_image.size() ||
+      workspace_.cached_edge_map.type() != getEdgeMapType() ||
+      (incremental.full_update_interval > 0u &&
+       workspace_.num_incremental_frames >= incremental.full_update_interval)) {
+    return false;
+  }
+  const int rows = depth_image.rows;
+  const int cols = depth_image.cols;
+  const int tile_size = incremental.tile_size;
+  const int tile_rows = (rows + tile_size - 1) / tile_size;
+  const int tile_cols = (cols + tile_size - 1) / tile_size;
+
+  // The depth map is cheap to compute for every pixel and always matches the
+  // current depth image.
+  depth_map->create(depth_image.size(), CV_32FC3);
+  computeDepthMap(depth_image, depth_map);
+
+  // Find the tiles in which the depth moved by more than the noise, using the
+  // noise model of the max distance map.
+  auto has_changed = [&](const float depth, const float reference) {
+    const bool is_valid = depth > 0.0f && std::isfinite(depth);
+    const bool is_reference_valid =
+        reference > 0.0f && std::isfinite(reference);
+    if (!is_valid || !is_reference_valid) {
+      return is_valid != is_reference_valid;
+    }
+    return std::abs(depth - reference) >
+           computeAxialNoise(reference) *
+               incremental.noise_thresholding_factor;
+  };
+  cv::Mat& changed_tiles = workspace_.changed_tiles;
+  changed_tiles.create(tile_rows, tile_cols, CV_8UC1);
+  changed_tiles.setTo(cv::Scalar(0));
+#pragma omp parallel for
+  for (int tile_y = 0; tile_y < tile_rows; ++tile_y) {
+    uint8_t* changed_row = changed_tiles.ptr<uint8_t>(tile_y);
+    const int y_end = std::min(rows, (tile_y + 1) * tile_size);
+    for (int y = tile_y * tile_size; y < y_end; ++y) {
+      const float* depth_row = depth_image.ptr<float>(y);
+      const float* reference_row = reference_depth.ptr<float>(y);
+      for (int x = 0; x < cols; ++x) {
+        uint8_t& is_changed = changed_row[x / tile_size];
+        if (is_changed == 0u && has_changed(depth_row[x], reference_row[x])) {
+          is_changed = 1u;
+        }
+      }
+    }
+  }
+
+  // A changed pixel influences the maps up to the halo around it, hence the
+  // neighboring tiles within the halo are recomputed as well.
+  const int halo = getStageHalo();
+  const int tile_halo = (halo + tile_size - 1) / tile_size;
+  cv::Mat& recomputed_tiles = workspace_.recomputed_tiles;
+  cv::dilate(changed_tiles, recomputed_tiles,
+             cv::getStructuringElement(
+                 cv::MORPH_RECT,
+                 cv::Size(2 * tile_halo + 1, 2 * tile_halo + 1)));
+
+  // Recompute the runs of consecutive tiles of every tile row as one region,
+  // together with the halo as context, and update the cache with its
+  // interior.
+  num_recomputed_tiles_ = 0u;
+  cv::Mat& region_depth = workspace_.region_depth;
+  cv::Mat& region_depth_map = workspace_.region_depth_map;
+  cv::Mat& region_normal_map = workspace_.region_normal_map;
+  cv::Mat& region_edge_map = workspace_.region_edge_map;
+  for (int tile_y = 0; tile_y < tile_rows; ++tile_y) {
+    const uint8_t* recomputed_row = recomputed_tiles.ptr<uint8_t>(tile_y);
+    int tile_x = 0;
+    while (tile_x < tile_cols) {
+      if (recomputed_row[tile_x] == 0u) {
+        ++tile_x;
+        continue;
+      }
+      const int run_begin = tile_x;
+      while (tile_x < tile_cols && recomputed_row[tile_x] != 0u) {
+        ++tile_x;
+      }
+      num_recomputed_tiles_ += tile_x - run_begin;
+      const cv::Rect interior(
+          cv::Point(run_begin * tile_size, tile_y * tile_size),
+          cv::Point(std::min(cols, tile_x * tile_size),
+                    std::min(rows, (tile_y + 1) * tile_size)));
+      const cv::Rect region =
+          cv::Rect(interior.tl() - cv::Point(halo, halo),
+                   interior.br() + cv::Point(halo, halo)) &
+          cv::Rect(0, 0, cols, rows);
+      // The stages expect continuous images.
+      depth_image(region).copyTo(region_depth);
+      (*depth_map)(region).copyTo(region_depth_map);
+      computeRegionMaps(region_depth, region_depth_map, &region_normal_map,
+                        &region_edge_map);
+      const cv::Rect region_interior(interior.tl() - region.tl(),
+                                     interior.size());
+      region_normal_map(region_interior)
+          .copyTo(workspace_.cached_normal_map(interior));
+      region_edge_map(region_interior)
+          .copyTo(workspace_.cached_edge_map(interior));
+      depth_image(interior).copyTo(workspace_.reference_depth(interior));
+    }
+  }
+  // The maps of a frame may be kept by the caller, hence they are copies,
+  // into the buffers of the caller if these fit.
+  workspace_.cached_normal_map.copyTo(*normal_map);
+  workspace_.cached_edge_map.copyTo(*edge_map);
+  ++workspace_.num_incremental_frames;
+  return true;
+}
+
+bool DepthSegmenter::usesPyramid() const {
+  return params_.pyramid.level > 0u && !params_.roi.enable &&
+         (params_.normals.method ==
+              SurfaceNormalEstimationMethod::kDepthWindowFilter ||
+          params_.normals.method ==
+              SurfaceNormalEstimationMethod::kIntegralImage);
+}
+
+void DepthSegmenter::computeGeometricMapsPyramid(const cv::Mat& depth_image,
+                                                 cv::Mat* depth_map,
+                                                 cv::Mat* normal_map,
+                                                 cv::Mat* edge_map) {
+  const int factor = 1 << params_.pyramid.level;
+  cv::Mat& pyramid_depth = workspace_.pyramid_depth;
+  downsampleDepthImage(depth_image, factor, &pyramid_depth);
+
+  // Pixel centers of the pyramid level lie at factor * (x + 0.5) - 0.5 of the
+  // full resolution.
+  cv::Mat camera_matrix;
+  depth_camera_.getCameraMatrix().convertTo(camera_matrix, CV_32F);
+  camera_matrix.at<float>(0, 0) /= factor;
+  camera_matrix.at<float>(1, 1) /= factor;
+  camera_matrix.at<float>(0, 2) =
+      (camera_matrix.at<float>(0, 2) + 0.5f) / factor - 0.5f;
+  camera_matrix.at<float>(1, 2) =
+      (camera_matrix.at<float>(1, 2) + 0.5f) / factor - 0.5f;
+  RayTable& pyramid_rays = workspace_.pyramid_rays;
+  pyramid_rays.compute(camera_matrix, pyramid_depth.size());
+  cv::Mat& pyramid_depth_map = workspace_.pyramid_depth_map;
+  backProjectDepth(pyramid_depth, pyramid_rays, cv::Point(0, 0),
+                   &pyramid_depth_map);
+  // The stages run with their unscaled window sizes on the level.
+  cv::Mat& pyramid_normal_map = workspace_.pyramid_normal_map;
+  cv::Mat& pyramid_edge_map = workspace_.pyramid_edge_map;
+  computeRegionMaps(pyramid_depth, pyramid_depth_map, &pyramid_normal_map,
+                    &pyramid_edge_map);
+
+  // The labels are computed on the level again, their boundaries are refined
+  // with the points of the full resolution depth map.
+  depth_map->create(depth_image.size(), CV_32FC3);
+  computeDepthMap(depth_image, depth_map);
+  upsampleNearest(pyramid_normal_map, factor, depth_image.size(), normal_map);
+  upsampleNearest(pyramid_edge_map, factor, depth_image.size(), edge_map);
+}
+
+void DepthSegmenter::computeGeometricMapsRoi(const cv::Mat& depth_image,
+                                             cv::Mat* depth_map,
+                                             cv::Mat* normal_map,
+                                             cv::Mat* edge_map) {
+  const cv::Size image_size = depth_image.size();
+  const cv::Rect roi = getRoi(image_size);
+  const int halo = getStageHalo();
+  const cv::Rect region = cv::Rect(roi.tl() - cv::Point(halo, halo),
+                                   roi.br() + cv::Point(halo, halo)) &
+                          cv::Rect(cv::Point(0, 0), image_size);
+  cv::Mat& region_depth = workspace_.region_depth;
+  cropDepthImage(depth_image, region, &region_depth);
+  cv::Mat& region_depth_map = workspace_.region_depth_map;
+  backProjectDepth(region_depth, depth_camera_.getRayTable(), region.tl(),
+                   &region_depth_map);
+  cv::Mat& region_normal_map = workspace_.region_normal_map;
+  cv::Mat& region_edge_map = workspace_.region_edge_map;
+  computeRegionMaps(region_depth, region_depth_map, &region_normal_map,
+                    &region_edge_map);
+
+  // Pixels outside of the region of interest are invalid points and edges,
+  // such that they are never labeled.
+  const cv::Rect region_roi(roi.tl() - region.tl(), roi.size());
+  constexpr float kNan = std::numeric_limits<float>::quiet_NaN();
+  depth_map->create(image_size, CV_32FC3);
+  depth_map->setTo(cv::Scalar::all(kNan));
+  region_depth_map(region_roi).copyTo((*depth_map)(roi));
+  normal_map->create(image_size, CV_32FC3);
+  normal_map->setTo(cv::Scalar::all(kNan));
+  region_normal_map(region_roi).copyTo((*normal_map)(roi));
+  createZeros(image_size, region_edge_map.type(), edge_map);
+  cv::Mat roi_edge_map = (*edge_map)(roi);
+  region_edge_map(region_roi).copyTo(roi_edge_map);
+  roi_edge_map.setTo(cv::Scalar(0), (region_depth(region_roi) == 0.0f) &
+                                        (depth_image(roi) > 0.0f));
+}
+
+void DepthSegmenter::computeRegionMaps(const cv::Mat& depth_image,
+                                       const cv::Mat& depth_map,
+                                       cv::Mat* normal_map,
+                                       cv::Mat* edge_map) {
+  CHECK_NOTNULL(normal_map);
+  CHECK_NOTNULL(edge_map);
+  const cv::Size region_size = depth_image.size();
+  createZeros(region_size, CV_32FC3, normal_map);
+  const int edge_map_type = getEdgeMapType();
+  cv::Mat& discontinuity_map = workspace_.stage_discontinuity_map;
+  cv::Mat& distance_map = workspace_.stage_distance_map;
+  cv::Mat& convexity_map = workspace_.stage_convexity_map;
+  createZeros(region_size, edge_map_type, &discontinuity_map);
+  createZeros(region_size, edge_map_type, &distance_map);
+  createZeros(region_size, edge_map_type, &convexity_map);
+  edge_map->create(region_size, edge_map_type);
+  if (params_.depth_discontinuity.use_discontinuity) {
+    computeDepthDiscontinuityMap(depth_image, &discontinuity_map);
+  }
+  if (params_.max_distance.use_max_distance) {
+    computeMaxDistanceMap(depth_map, &distance_map);
+  }
+  computeNormalMap(depth_map, normal_map);
+  if (params_.min_convexity.use_min_convexity) {
+    computeMinConvexityMap(depth_map, *normal_map, &convexity_map);
+  }
+  computeFinalEdgeMap(convexity_map, distance_map, discontinuity_map,
+                      edge_map);
+}
+
+int DepthSegmenter::getStageHalo() const {
+  // The sum of the support radii of all stages bounds the support of every
+  // chain of stages. Morphological openings and closings reach twice their
+  // size.
+  return params_.normals.window_size / 2u +
+         params_.min_convexity.window_size / 2u *
+             params_.min_convexity.step_size +
+         2u * params_.min_convexity.morphological_opening_size +
+         params_.max_distance.window_size / 2u +
+         params_.depth_discontinuity.kernel_size / 2u +
+         2u * params_.final_edge.morphological_opening_size +
+         2u * params_.final_edge.morphological_closing_size;
+}
+
+int DepthSegmenter::getEdgeMapType() const {
+  if (!params_.compact_maps) {
+    return CV_32FC1;
+  }
+  const bool has_binary_max_distance =
+      !params_.max_distance.use_max_distance ||
+      (params_.max_distance.method == MaxDistanceMapMethod::kFused &&
+       params_.max_distance.use_threshold);
+  const bool has_binary_min_convexity =
+      !params_.min_convexity.use_min_convexity ||
+      (params_.min_convexity.method == MinConvexityMapMethod::kFused &&
+       params_.min_convexity.use_threshold);
+  if (!has_binary_max_distance || !has_binary_min_convexity) {
+    LOG_FIRST_N(WARNING, 1) << "The compact maps require the fused and "
+                               "thresholded max distance and min convexity "
+                               "maps, using float maps instead.";
+    return CV_32FC1;
+  }
+  return CV_8UC1;
+}
+
+cv::Rect DepthSegmenter::getRoi(const cv::Size& image_size) const {
+  const cv::Rect image_rect(cv::Point(0, 0), image_size);
+  if (!params_.roi.enable) {
+    return image_rect;
+  }
+  const int width = params_.roi.width > 0 ? params_.roi.width
+                                          : image_size.width - params_.roi.x;
+  const int height = params_.roi.height > 0
+                         ? params_.roi.height
+                         : image_size.height - params_.roi.y;
+  const cv::Rect roi = cv::Rect(params_.roi.x, params_.roi.y,
+                                std::max(width, 0), std::max(height, 0)) &
+                       image_rect;
+  CHECK_GT(roi.area(), 0) << "The region of interest lies outside the image.";
+  return roi;
+}
+
+void DepthSegmenter::cropDepthImage(const cv::Mat& depth_image,
+                                    const cv::Rect& region,
+                                    cv::Mat* cropped_depth_image) const {
+  CHECK_NOTNULL(cropped_depth_image);
+  // The stages expect continuous images.
+  depth_image(region).copyTo(*cropped_depth_image);
+  if (!params_.roi.enable) {
+    return;
+  }
+  const float min_depth = params_.roi.min_depth;
+  const float max_depth = params_.roi.max_depth > 0.0
+                              ? params_.roi.max_depth
+                              : std::numeric_limits<float>::infinity();
+  if (min_depth <= 0.0f && params_.roi.max_depth <= 0.0) {
+    return;
+  }
+  for (int y = 0; y < cropped_depth_image->rows; ++y) {
+    float* depth_row = cropped_depth_image->ptr<float>(y);
+    for (int x = 0; x < cropped_depth_image->cols; ++x) {
+      if (depth_row[x] < min_depth || depth_row[x] > max_depth) {
+        depth_row[x] = 0.0f;
+      }
+    }
   }
 }
 
@@ -690,7 +1532,7 @@ void DepthSegmenter::inpaintImage(const cv::Mat& depth_image,
   CHECK(!depth_image.empty());
   CHECK_EQ(depth_image.type(), CV_32FC1);
   CHECK(!edge_map.empty());
-  CHECK_EQ(edge_map.type(), CV_32FC1);
+  CHECK(edge_map.type() == CV_32FC1 || edge_map.type() == CV_8UC1);
   CHECK(!label_map.empty());
   CHECK_EQ(label_map.type(), CV_8UC3);
   CHECK_EQ(depth_image.size(), edge_map.size());
@@ -728,17 +1570,455 @@ void DepthSegmenter::generateRandomColorsAndLabels(
   *labels = labels_;
 }
 
-void DepthSegmenter::labelMap(const cv::Mat& rgb_image,
+// Dense segment index of labels that do not belong to any segment.
+constexpr size_t kNoSegment = std::numeric_limits<size_t>::max();
+
+// Edge points are only assigned to labeled points closer than this distance,
+// which lie within this window half size around them.
+constexpr double kEdgeReassignmentMaxDistance = 0.05;
+constexpr int kEdgeReassignmentWindowHalfSize = 4;
+
+static inline bool isEdgePoint(const cv::Mat& depth_image,
+                               const cv::Mat& edge_map_8u, const int y,
+                               const int x) {
+  return edge_map_8u.at<uint8_t>(y, x) == 0u &&
+         depth_image.at<float>(y, x) > 0.0f;
+}
+
+static inline double squaredDistance(const cv::Vec3f& a, const cv::Vec3f& b) {
+  const double dx = static_cast<double>(a[0]) - b[0];
+  const double dy = static_cast<double>(a[1]) - b[1];
+  const double dz = static_cast<double>(a[2]) - b[2];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+void DepthSegmenter::reassignEdgePoints(const cv::Mat& depth_image,
+                                        const cv::Mat& depth_map,
+                                        const cv::Mat& edge_map_8u,
+                                        cv::Mat* output_labels) {
+  CHECK_EQ(depth_image.size(), edge_map_8u.size());
+  CHECK_EQ(depth_image.size(), depth_map.size());
+  CHECK_NOTNULL(output_labels);
+  CHECK_EQ(output_labels->size(), depth_image.size());
+  switch (params_.label.edge_reassignment_method) {
+    case EdgeReassignmentMethod::kWindowSearch:
+      reassignEdgePointsWindowSearch(depth_image, depth_map, edge_map_8u,
+                                     output_labels);
+      break;
+    case EdgeReassignmentMethod::kJumpFlooding:
+      reassignEdgePointsJumpFlooding(depth_image, depth_map, edge_map_8u,
+                                     output_labels);
+      break;
+  }
+}
+
+void DepthSegmenter::reassignEdgePointsWindowSearch(
+    const cv::Mat& depth_image, const cv::Mat& depth_map,
+    const cv::Mat& edge_map_8u, cv::Mat* output_labels) {
+  constexpr double kMaxSquaredDistance =
+      kEdgeReassignmentMaxDistance * kEdgeReassignmentMaxDistance;
+  const int rows = output_labels->rows;
+  const int cols = output_labels->cols;
+  // Only the labels of edge points are written and only the labels of
+  // non-edge points are read, hence the rows are independent.
+#pragma omp parallel for
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      if (!isEdgePoint(depth_image, edge_map_8u, y, x)) {
+        continue;
+      }
+      // We assign edgepoints by default to -1.
+      int32_t label = -1;
+      const cv::Vec3f& edge_point = depth_map.at<cv::Vec3f>(y, x);
+      double min_squared_distance = kMaxSquaredDistance;
+      const int min_i = std::max(-kEdgeReassignmentWindowHalfSize, -x);
+      const int max_i = std::min(kEdgeReassignmentWindowHalfSize, cols - 1 - x);
+      const int min_j = std::max(-kEdgeReassignmentWindowHalfSize, -y);
+      const int max_j = std::min(kEdgeReassignmentWindowHalfSize, rows - 1 - y);
+      for (int i = min_i; i <= max_i; ++i) {
+        for (int j = min_j; j <= max_j; ++j) {
+          if (i == 0 && j == 0) {
+            continue;
+          }
+          const double squared_distance = squaredDistance(
+              edge_point, depth_map.at<cv::Vec3f>(y + j, x + i));
+          if (squared_distance >= min_squared_distance ||
+              isEdgePoint(depth_image, edge_map_8u, y + j, x + i)) {
+            continue;
+          }
+          const int32_t neighbor_label =
+              output_labels->at<int32_t>(y + j, x + i);
+          if (neighbor_label < 0) {
+            continue;
+          }
+          min_squared_distance = squared_distance;
+          label = neighbor_label;
+        }
+      }
+      output_labels->at<int32_t>(y, x) = label;
+    }
+  }
+}
+
+void DepthSegmenter::reassignEdgePointsJumpFlooding(
+    const cv::Mat& depth_image, const cv::Mat& depth_map,
+    const cv::Mat& edge_map_8u, cv::Mat* output_labels) {
+  constexpr double kMaxSquaredDistance =
+      kEdgeReassignmentMaxDistance * kEdgeReassignmentMaxDistance;
+  constexpr int32_t kNoSeed = -1;
+  const int rows = output_labels->rows;
+  const int cols = output_labels->cols;
+  cv::Mat& seeds = workspace_.jump_flooding_seeds;
+  cv::Mat& next_seeds = workspace_.jump_flooding_next_seeds;
+  seeds.create(output_labels->size(), CV_32SC1);
+  next_seeds.create(output_labels->size(), CV_32SC1);
+
+  // The labeled non-edge points are the seeds.
+#pragma omp parallel for
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      const bool is_seed = !isEdgePoint(depth_image, edge_map_8u, y, x) &&
+                           output_labels->at<int32_t>(y, x) >= 0;
+      seeds.at<int32_t>(y, x) = is_seed ? y * cols + x : kNoSeed;
+    }
+  }
+
+  // Every edge point takes the closest seed seen by its neighbors at
+  // decreasing offsets, as long as the seed lies within the search window
+  // and the distance threshold.
+  for (int step = kEdgeReassignmentWindowHalfSize; step > 0; step /= 2) {
+#pragma omp parallel for
+    for (int y = 0; y < rows; ++y) {
+      for (int x = 0; x < cols; ++x) {
+        int32_t best_seed = seeds.at<int32_t>(y, x);
+        if (!isEdgePoint(depth_image, edge_map_8u, y, x)) {
+          next_seeds.at<int32_t>(y, x) = best_seed;
+          continue;
+        }
+        const cv::Vec3f& edge_point = depth_map.at<cv::Vec3f>(y, x);
+        double min_squared_distance = kMaxSquaredDistance;
+        if (best_seed != kNoSeed) {
+          min_squared_distance = squaredDistance(
+              edge_point, depth_map.at<cv::Vec3f>(best_seed / cols,
+                                                  best_seed % cols));
+        }
+        for (int j = -step; j <= step; j += step) {
+          if (y + j < 0 || y + j >= rows) {
+            continue;
+          }
+          for (int i = -step; i <= step; i += step) {
+            if ((i == 0 && j == 0) || x + i < 0 || x + i >= cols) {
+              continue;
+            }
+            const int32_t seed = seeds.at<int32_t>(y + j, x + i);
+            if (seed == kNoSeed || seed == best_seed) {
+              continue;
+            }
+            const int seed_y = seed / cols;
+            const int seed_x = seed % cols;
+            if (std::abs(seed_y - y) > kEdgeReassignmentWindowHalfSize ||
+                std::abs(seed_x - x) > kEdgeReassignmentWindowHalfSize) {
+              continue;
+            }
+            const double squared_distance = squaredDistance(
+                edge_point, depth_map.at<cv::Vec3f>(seed_y, seed_x));
+            if (squared_distance < min_squared_distance) {
+              min_squared_distance = squared_distance;
+              best_seed = seed;
+            }
+          }
+        }
+        next_seeds.at<int32_t>(y, x) = best_seed;
+      }
+    }
+    cv::swap(seeds, next_seeds);
+  }
+
+#pragma omp parallel for
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      if (!isEdgePoint(depth_image, edge_map_8u, y, x)) {
+        continue;
+      }
+      const int32_t seed = seeds.at<int32_t>(y, x);
+      output_labels->at<int32_t>(y, x) =
+          seed == kNoSeed
+              ? -1
+              : output_labels->at<int32_t>(seed / cols, seed % cols);
+    }
+  }
+}
+
+void DepthSegmenter::labelContours(const cv::Mat& edge_map,
+                                   const size_t min_size,
+                                   cv::Mat* edge_map_8u, cv::Mat* output,
+                                   cv::Mat* output_labels,
+                                   std::vector<cv::Scalar>* colors,
+                                   std::vector<int>* labels) {
+  CHECK_NOTNULL(edge_map_8u);
+  CHECK_NOTNULL(output);
+  CHECK_NOTNULL(output_labels);
+  CHECK_NOTNULL(colors);
+  CHECK_NOTNULL(labels);
+  std::vector<std::vector<cv::Point>> contours;
+  std::vector<cv::Vec4i> hierarchy;
+  edge_map.convertTo(*edge_map_8u, CV_8U);
+  static const cv::Point kContourOffset = cv::Point(0, 0);
+  cv::findContours(*edge_map_8u, contours, hierarchy,
+                   cv::RETR_TREE, /*cv::RETR_CCOMP*/
+                   cv::CHAIN_APPROX_NONE, kContourOffset);
+
+  generateRandomColorsAndLabels(contours.size(), colors, labels);
+  for (size_t i = 0u; i < contours.size(); ++i) {
+    const double area = cv::contourArea(contours[i]);
+    constexpr int kNoParentContour = -1;
+    if (area < min_size) {
+      const int parent_contour = hierarchy[i][3];
+      if (parent_contour == kNoParentContour) {
+        // Assign black color to areas that have no parent contour.
+        (*colors)[i] = cv::Scalar(0, 0, 0);
+        (*labels)[i] = -1;
+        drawContours(*edge_map_8u, contours, i, cv::Scalar(0u), cv::FILLED, 8,
+                     hierarchy);
+      } else {
+        if (hierarchy[i][0] == -1 && hierarchy[i][1] == -1) {
+          // Assign the color of the parent contour.
+          (*colors)[i] = (*colors)[parent_contour];
+          (*labels)[i] = (*labels)[parent_contour];
+        } else {
+          (*colors)[i] = cv::Scalar(0, 0, 0);
+          (*labels)[i] = -1;
+          drawContours(*edge_map_8u, contours, i, cv::Scalar(0u), cv::FILLED,
+                       8, hierarchy);
+        }
+      }
+    }
+  }
+
+  createZeros(edge_map.size(), CV_32SC1, output_labels);
+  for (size_t i = 0u; i < contours.size(); ++i) {
+    drawContours(*output, contours, i, cv::Scalar((*colors)[i]), cv::FILLED,
+                 8, hierarchy);
+    drawContours(*output_labels, contours, i, cv::Scalar((*labels)[i]),
+                 cv::FILLED, 8, hierarchy);
+    drawContours(*edge_map_8u, contours, i, cv::Scalar(0u), 1, 8, hierarchy);
+  }
+
+  cv::Mat& edge_mask = workspace_.label_edge_mask;
+  cv::compare(*edge_map_8u, 0u, edge_mask, cv::CMP_EQ);
+  output->setTo(cv::Scalar(0, 0, 0), edge_mask);
+  output_labels->setTo(-1, edge_mask);
+}
+
+void DepthSegmenter::labelComponents(const cv::Mat& edge_map,
+                                     const size_t min_size,
+                                     cv::Mat* edge_map_8u, cv::Mat* output,
+                                     cv::Mat* output_labels,
+                                     std::vector<cv::Scalar>* colors,
+                                     std::vector<int>* labels) {
+  CHECK_NOTNULL(edge_map_8u);
+  CHECK_NOTNULL(output);
+  CHECK_NOTNULL(output_labels);
+  CHECK_NOTNULL(colors);
+  CHECK_NOTNULL(labels);
+  edge_map.convertTo(*edge_map_8u, CV_8U);
+  ConnectedComponents& components = workspace_.connected_components;
+  labelConnectedComponents(*edge_map_8u, &components);
+
+  // As with the contours, the area of a component includes all the
+  // components it encloses.
+  std::vector<size_t> areas(components.sizes);
+  std::vector<size_t> num_children(components.size(), 0u);
+  for (size_t i = components.size() - 1u; i > 0u; --i) {
+    areas[components.parents[i]] += areas[i];
+    ++num_children[components.parents[i]];
+  }
+
+  // Component 0 is the background surrounding the image, its children have
+  // no parent contour. Parents precede their children, so inherited labels
+  // are final once they are read.
+  constexpr int kOuterBackground = 0;
+  generateRandomColorsAndLabels(components.size(), colors, labels);
+  (*colors)[kOuterBackground] = cv::Scalar(0, 0, 0);
+  (*labels)[kOuterBackground] = -1;
+  for (size_t i = 1u; i < components.size(); ++i) {
+    if (areas[i] >= min_size) {
+      continue;
+    }
+    const int parent = components.parents[i];
+    if (parent != kOuterBackground && num_children[parent] == 1u) {
+      // Assign the color of the parent component.
+      (*colors)[i] = (*colors)[parent];
+      (*labels)[i] = (*labels)[parent];
+    } else {
+      (*colors)[i] = cv::Scalar(0, 0, 0);
+      (*labels)[i] = -1;
+    }
+  }
+
+  // Background pixels, the borders of the foreground components and removed
+  // components are edge points.
+  output_labels->create(edge_map.size(), CV_32SC1);
+  const cv::Mat& component_labels = components.labels;
+#pragma omp parallel for
+  for (int y = 0; y < edge_map.rows; ++y) {
+    for (int x = 0; x < edge_map.cols; ++x) {
+      const int32_t component = component_labels.at<int32_t>(y, x);
+      int32_t label = -1;
+      if (components.is_foreground[component] &&
+          components.is_foreground[component_labels.at<int32_t>(y - 1, x)] &&
+          components.is_foreground[component_labels.at<int32_t>(y + 1, x)] &&
+          components.is_foreground[component_labels.at<int32_t>(y, x - 1)] &&
+          components.is_foreground[component_labels.at<int32_t>(y, x + 1)]) {
+        label = (*labels)[component];
+      }
+      output_labels->at<int32_t>(y, x) = label;
+      if (label < 0) {
+        edge_map_8u->at<uint8_t>(y, x) = 0u;
+      } else {
+        const cv::Scalar& color = (*colors)[component];
+        output->at<cv::Vec3b>(y, x) = cv::Vec3b(color[0], color[1], color[2]);
+      }
+    }
+  }
+}
+
+void DepthSegmenter::labelEdgeMap(const cv::Mat& edge_map,
+                                  const size_t min_size, cv::Mat* edge_map_8u,
+                                  cv::Mat* output, cv::Mat* output_labels,
+                                  std::vector<cv::Scalar>* colors,
+                                  std::vector<int>* labels) {
+  if (params_.label.method == LabelMapMethod::kContour) {
+    labelContours(edge_map, min_size, edge_map_8u, output, output_labels,
+                  colors, labels);
+  } else {
+    CHECK(params_.label.method == LabelMapMethod::kConnectedComponents);
+    labelComponents(edge_map, min_size, edge_map_8u, output, output_labels,
+                    colors, labels);
+  }
+}
+
+void DepthSegmenter::labelPyramidRegions(const cv::Mat& edge_map,
+                                         cv::Mat* edge_map_8u,
+                                         cv::Mat* output,
+                                         cv::Mat* output_labels,
+                                         std::vector<cv::Scalar>* colors,
+                                         std::vector<int>* labels) {
+  const int factor = 1 << params_.pyramid.level;
+  const int rows = edge_map.rows;
+  const int cols = edge_map.cols;
+
+  // The edge map is upsampled from the level, hence the first pixel of every
+  // block is the edge of its level pixel. Sampling it, rather than using the
+  // edge map of the level, keeps the edges the caller removed.
+  cv::Mat& level_edge_map = workspace_.pyramid_label_edge_map;
+  level_edge_map.create((rows + factor - 1) / factor,
+                        (cols + factor - 1) / factor, edge_map.type());
+  const size_t pixel_size = edge_map.elemSize();
+  for (int y = 0; y < level_edge_map.rows; ++y) {
+    const uint8_t* edge_row = edge_map.ptr<uint8_t>(y * factor);
+    uint8_t* level_edge_row = level_edge_map.ptr<uint8_t>(y);
+    for (int x = 0; x < level_edge_map.cols; ++x) {
+      std::memcpy(level_edge_row + x * pixel_size,
+                  edge_row + x * factor * pixel_size, pixel_size);
+    }
+  }
+
+  // The minimal size is given in full resolution pixels.
+  const size_t min_size =
+      std::max<size_t>(params_.label.min_size / (factor * factor), 1u);
+  cv::Mat& level_colors = workspace_.pyramid_label_colors;
+  createZeros(level_edge_map.size(), CV_8UC3, &level_colors);
+  cv::Mat& level_labels = workspace_.pyramid_labels;
+  labelEdgeMap(level_edge_map, min_size, &workspace_.pyramid_label_edge_map_8u,
+               &level_colors, &level_labels, colors, labels);
+
+  // Every pixel takes the label of its level pixel, unless a level pixel
+  // within half a block has another label. These pixels along the boundaries
+  // of the level, as well as the edge points, are reassigned by their full
+  // resolution points.
+  edge_map.convertTo(*edge_map_8u, CV_8U);
+  output_labels->create(edge_map.size(), CV_32SC1);
+  const int radius = std::max(factor / 2, 1);
+#pragma omp parallel for
+  for (int y = 0; y < rows; ++y) {
+    const int level_y_begin = std::max(y - radius, 0) / factor;
+    const int level_y_end = std::min(y + radius, rows - 1) / factor;
+    const int32_t* level_label_row = level_labels.ptr<int32_t>(y / factor);
+    int32_t* label_row = output_labels->ptr<int32_t>(y);
+    uint8_t* edge_row = edge_map_8u->ptr<uint8_t>(y);
+    cv::Vec3b* output_row = output->ptr<cv::Vec3b>(y);
+    for (int x = 0; x < cols; ++x) {
+      const int32_t label = level_label_row[x / factor];
+      bool is_edge_point = label < 0 || edge_row[x] == 0u;
+      const int level_x_begin = std::max(x - radius, 0) / factor;
+      const int level_x_end = std::min(x + radius, cols - 1) / factor;
+      for (int level_y = level_y_begin;
+           level_y <= level_y_end && !is_edge_point; ++level_y) {
+        const int32_t* neighbor_row = level_labels.ptr<int32_t>(level_y);
+        for (int level_x = level_x_begin; level_x <= level_x_end; ++level_x) {
+          if (neighbor_row[level_x] != label) {
+            is_edge_point = true;
+            break;
+          }
+        }
+      }
+      if (is_edge_point) {
+        label_row[x] = -1;
+        edge_row[x] = 0u;
+      } else {
+        label_row[x] = label;
+        const cv::Scalar& color = (*colors)[label];
+        output_row[x] = cv::Vec3b(color[0], color[1], color[2]);
+      }
+    }
+  }
+}
+
+void DepthSegmenter::labelRegions(const cv::Mat& depth_image,
+                                  const cv::Mat& depth_map,
+                                  const cv::Mat& edge_map, cv::Mat* edge_map_8u,
+                                  cv::Mat* output, cv::Mat* output_labels,
+                                  std::vector<cv::Scalar>* colors,
+                                  std::vector<size_t>* segment_indices,
+                                  std::vector<int>* segment_labels) {
+  CHECK_NOTNULL(segment_indices);
+  CHECK_NOTNULL(segment_labels);
+  std::vector<int> labels;
+  if (usesPyramid()) {
+    labelPyramidRegions(edge_map, edge_map_8u, output, output_labels, colors,
+                        &labels);
+  } else {
+    labelEdgeMap(edge_map, params_.label.min_size, edge_map_8u, output,
+                 output_labels, colors, &labels);
+  }
+
+  // Map the labels to dense segment indices in order of appearance.
+  segment_indices->assign(labels.size(), kNoSegment);
+  segment_labels->clear();
+  segment_labels->reserve(labels.size());
+  for (size_t i = 0u; i < labels.size(); ++i) {
+    if (labels[i] >= 0 && (*segment_indices)[labels[i]] == kNoSegment) {
+      (*segment_indices)[labels[i]] = segment_labels->size();
+      segment_labels->push_back(labels[i]);
+    }
+  }
+
+  reassignEdgePoints(depth_image, depth_map, *edge_map_8u, output_labels);
+}
+
+void DepthSegmenter::labelMap(const cv::Mat& rgb_image, const bool bgr_input,
                               const cv::Mat& depth_image,
                               const cv::Mat& depth_map, const cv::Mat& edge_map,
                               const cv::Mat& normal_map, cv::Mat* labeled_map,
-                              std::vector<cv::Mat>* segment_masks,
-                              std::vector<Segment>* segments) {
+                              std::vector<SegmentMask>* segment_masks,
+                              SegmentTable* segments) {
+  ScopedStageTimer stage_timer(Stage::kLabelMap, getActiveStageTimer());
   CHECK(!rgb_image.empty());
   CHECK(!depth_image.empty());
   CHECK_EQ(depth_image.type(), CV_32FC1);
   CHECK(!edge_map.empty());
-  CHECK_EQ(edge_map.type(), CV_32FC1);
+  CHECK(edge_map.type() == CV_32FC1 || edge_map.type() == CV_8UC1);
   CHECK_EQ(depth_map.type(), CV_32FC3);
   CHECK_EQ(normal_map.type(), CV_32FC3);
   CHECK_EQ(depth_image.size(), edge_map.size());
@@ -747,169 +2027,129 @@ void DepthSegmenter::labelMap(const cv::Mat& rgb_image,
   CHECK_NOTNULL(segment_masks);
   CHECK_NOTNULL(segments)->clear();
 
-  constexpr size_t kMaskValue = 255u;
+  if (!params_.roi.enable) {
+    labelMapRegion(rgb_image, bgr_input, depth_image, depth_map, edge_map,
+                   normal_map, cv::Point(0, 0), labeled_map, segment_masks,
+                   segments);
+  } else {
+    // Label the region of interest only and move the labels to the frame.
+    const cv::Rect roi = getRoi(depth_image.size());
+    cv::Mat& roi_depth_image = workspace_.roi_depth_image;
+    cropDepthImage(depth_image, roi, &roi_depth_image);
+    cv::Mat& roi_labeled_map = workspace_.roi_labeled_map;
+    labelMapRegion(rgb_image(roi), bgr_input, roi_depth_image, depth_map(roi),
+                   edge_map(roi), normal_map(roi), roi.tl(), &roi_labeled_map,
+                   segment_masks, segments);
+    createZeros(depth_image.size(), CV_8UC3, labeled_map);
+    roi_labeled_map.copyTo((*labeled_map)(roi));
+    for (SegmentMask& segment_mask : *segment_masks) {
+      segment_mask.shift(roi.tl());
+    }
+  }
 
-  cv::Mat original_depth_map;
-  cv::rgbd::depthTo3d(depth_image, depth_camera_.getCameraMatrix(),
-                      original_depth_map);
+  if (params_.label.display) {
+    static const std::string kWindowName = "LabelMap";
+    cv::namedWindow(kWindowName, cv::WINDOW_AUTOSIZE);
+    imshow(kWindowName, *labeled_map);
+    cv::waitKey(1);
+  }
+}
 
-  cv::Mat output = cv::Mat::zeros(depth_image.size(), CV_8UC3);
+void DepthSegmenter::labelMapRegion(
+    const cv::Mat& rgb_image, const bool bgr_input, const cv::Mat& depth_image,
+    const cv::Mat& depth_map, const cv::Mat& edge_map,
+    const cv::Mat& normal_map, const cv::Point& offset, cv::Mat* labeled_map,
+    std::vector<SegmentMask>* segment_masks, SegmentTable* segments) {
+  // Read BGR images in place rather than converting the whole frame.
+  const size_t red_index = bgr_input ? 2u : 0u;
+  const size_t blue_index = 2u - red_index;
+
+  // The points of the segments are back-projected from the depth image only
+  // for the labeled pixels, with the rays of the depth camera.
+  const RayTable& rays = depth_camera_.getRayTable();
+
+  // The labels are drawn into the labeled map, such that its buffer is kept.
+  createZeros(depth_image.size(), CV_8UC3, labeled_map);
+  cv::Mat& output = *labeled_map;
   switch (params_.label.method) {
-    case LabelMapMethod::kContour: {
-      // TODO(ff): Move to method.
-      std::vector<std::vector<cv::Point>> contours;
-      std::vector<cv::Vec4i> hierarchy;
-      cv::Mat edge_map_8u;
-      edge_map.convertTo(edge_map_8u, CV_8U);
-      static const cv::Point kContourOffset = cv::Point(0, 0);
-      cv::findContours(edge_map_8u, contours, hierarchy,
-                       cv::RETR_TREE, /*cv::RETR_CCOMP*/
-                       cv::CHAIN_APPROX_NONE, kContourOffset);
-
+    case LabelMapMethod::kContour:
+    case LabelMapMethod::kConnectedComponents: {
+      cv::Mat& edge_map_8u = workspace_.label_edge_map_8u;
+      cv::Mat& output_labels = workspace_.output_labels;
       std::vector<cv::Scalar> colors;
-      std::vector<int> labels;
-      generateRandomColorsAndLabels(contours.size(), &colors, &labels);
-      for (size_t i = 0u; i < contours.size(); ++i) {
-        const double area = cv::contourArea(contours[i]);
-        constexpr int kNoParentContour = -1;
-        if (area < params_.label.min_size) {
-          const int parent_contour = hierarchy[i][3];
-          if (parent_contour == kNoParentContour) {
-            // Assign black color to areas that have no parent contour.
-            colors[i] = cv::Scalar(0, 0, 0);
-            labels[i] = -1;
-            drawContours(edge_map_8u, contours, i, cv::Scalar(0u), cv::FILLED, 8,
-                         hierarchy);
-          } else {
-            if (hierarchy[i][0] == -1 && hierarchy[i][1] == -1) {
-              // Assign the color of the parent contour.
-              colors[i] = colors[parent_contour];
-              labels[i] = labels[parent_contour];
-            } else {
-              colors[i] = cv::Scalar(0, 0, 0);
-              labels[i] = -1;
-              drawContours(edge_map_8u, contours, i, cv::Scalar(0u), cv::FILLED,
-                           8, hierarchy);
-            }
+      std::vector<size_t> segment_indices;
+      std::vector<int> segment_labels;
+      labelRegions(depth_image, depth_map, edge_map, &edge_map_8u, &output,
+                   &output_labels, &colors, &segment_indices, &segment_labels);
+
+      // First pass: color the reassigned edge points and count the points of
+      // each segment.
+      std::vector<size_t> segment_sizes(segment_labels.size(), 0u);
+      for (int y = 0; y < output_labels.rows; ++y) {
+        for (int x = 0; x < output_labels.cols; ++x) {
+          const int32_t label = output_labels.at<int32_t>(y, x);
+          if (label > 0 && isEdgePoint(depth_image, edge_map_8u, y, x)) {
+            output.at<cv::Vec3b>(y, x) = cv::Vec3b(
+                colors[label][0], colors[label][1], colors[label][2]);
+          }
+          if (label >= 0 && label < static_cast<int>(segment_indices.size()) &&
+              segment_indices[label] != kNoSegment) {
+            ++segment_sizes[segment_indices[label]];
           }
         }
       }
 
-      cv::Mat output_labels =
-          cv::Mat(depth_image.size(), CV_32SC1, cv::Scalar(0));
-      for (size_t i = 0u; i < contours.size(); ++i) {
-        drawContours(output, contours, i, cv::Scalar(colors[i]), cv::FILLED, 8,
-                     hierarchy);
-        drawContours(output_labels, contours, i, cv::Scalar(labels[i]),
-                     cv::FILLED, 8, hierarchy);
-        drawContours(edge_map_8u, contours, i, cv::Scalar(0u), 1, 8, hierarchy);
-      }
-
-      output.setTo(cv::Scalar(0, 0, 0), edge_map_8u == 0u);
-      output_labels.setTo(-1, edge_map_8u == 0u);
-      // Create a map of all the labels.
-      std::map<size_t, size_t> labels_map;
-      size_t value = 0u;
-      for (size_t i = 0u; i < labels.size(); ++i) {
-        if (labels[i] >= 0) {
-          // Create a new map if label is not yet in keys.
-          if (labels_map.find(labels[i]) == labels_map.end()) {
-            labels_map[labels[i]] = value;
-            ++value;
-          }
+      // Only keep the segments that reach the minimal size and allocate the
+      // point buffers once for all of them.
+      std::vector<size_t> table_indices(segment_labels.size(), kNoSegment);
+      for (size_t i = 0u; i < segment_labels.size(); ++i) {
+        if (segment_sizes[i] >= params_.label.min_size) {
+          table_indices[i] = segments->size();
+          segments->addSegment(segment_sizes[i], segment_labels[i]);
         }
       }
-      segments->resize(labels_map.size());
-      segment_masks->resize(labels_map.size());
-      for (cv::Mat& segment_mask : *segment_masks) {
-        segment_mask = cv::Mat(depth_image.size(), CV_8UC1, cv::Scalar(0));
+      segments->resizeBuffers();
+      segment_masks->resize(segments->size());
+      for (SegmentMask& segment_mask : *segment_masks) {
+        segment_mask.clear();
       }
-      for (size_t x = 0u; x < output_labels.cols; ++x) {
-        for (size_t y = 0u; y < output_labels.rows; ++y) {
-          int32_t label = output_labels.at<int32_t>(y, x);
-          // Check if edge point and assign the nearest neighbor label.
-          const bool is_edge_point = edge_map_8u.at<uint8_t>(y, x) == 0u &&
-                                     depth_image.at<float>(y, x) > 0.0f;
-          if (is_edge_point) {
-            // We assign edgepoints by default to -1.
-            label = -1;
-            const cv::Vec3f& edge_point = depth_map.at<cv::Vec3f>(y, x);
-            constexpr double kMinNearestNeighborDistance = 0.05;
-            double min_dist = kMinNearestNeighborDistance;
-            constexpr int kFilterSizeHalfFloored = 4u;
-            for (int i = -kFilterSizeHalfFloored; i <= kFilterSizeHalfFloored;
-                 ++i) {
-              if (static_cast<int>(x) + i < 0) {
-                continue;
-              }
-              if (static_cast<int>(x) + i >= output_labels.cols) {
-                break;
-              }
-              for (int j = -kFilterSizeHalfFloored; j <= kFilterSizeHalfFloored;
-                   ++j) {
-                if (static_cast<int>(y) + j < 0 || (i == 0 && j == 0)) {
-                  continue;
-                }
-                if (static_cast<int>(y) + j >= output_labels.rows) {
-                  break;
-                }
-                const cv::Vec3f filter_point =
-                    depth_map.at<cv::Vec3f>(y + j, x + i);
-                const double dist = cv::norm(edge_point - filter_point);
-                if (dist >= min_dist) {
-                  continue;
-                }
-                const bool filter_point_is_edge_point =
-                    edge_map_8u.at<uint8_t>(y + j, x + i) == 0u &&
-                    depth_image.at<float>(y + j, x + i) > 0.0f;
-                if (!filter_point_is_edge_point) {
-                  const int label_tmp = output_labels.at<int32_t>(y + j, x + i);
-                  if (label_tmp < 0) {
-                    continue;
-                  }
-                  min_dist = dist;
-                  label = label_tmp;
-                  output_labels.at<int32_t>(y, x) = label;
-                }
-              }
-            }
-            if (label > 0) {
-              output.at<cv::Vec3b>(y, x) = cv::Vec3b(
-                  colors[label][0], colors[label][1], colors[label][2]);
-            }
+
+      // Second pass: scatter the points, normals and colors of the kept
+      // segments into their ranges of the table.
+      std::vector<size_t> write_positions = segments->offsets;
+      for (int y = 0; y < output_labels.rows; ++y) {
+        for (int x = 0; x < output_labels.cols; ++x) {
+          const int32_t label = output_labels.at<int32_t>(y, x);
+          if (label < 0 || label >= static_cast<int>(segment_indices.size()) ||
+              segment_indices[label] == kNoSegment) {
+            continue;
           }
-          if (label < 0) {
+          const size_t table_index = table_indices[segment_indices[label]];
+          if (table_index == kNoSegment) {
             continue;
+          }
+          // Append vectors from depth_map and normals from normal_map to
+          // vectors of segments.
+          const cv::Vec3b original_color = rgb_image.at<cv::Vec3b>(y, x);
+          cv::Vec3f color_f;
+          constexpr bool kUseOriginalColors = true;
+          if (kUseOriginalColors) {
+            color_f = cv::Vec3f(static_cast<float>(original_color[red_index]),
+                                static_cast<float>(original_color[1]),
+                                static_cast<float>(original_color[blue_index]));
           } else {
-            // Append vectors from depth_map and normals from normal_map to
-            // vectors of segments.
-            cv::Vec3f point = original_depth_map.at<cv::Vec3f>(y, x);
-            cv::Vec3f normal = normal_map.at<cv::Vec3f>(y, x);
-            cv::Vec3b original_color = rgb_image.at<cv::Vec3b>(y, x);
-            cv::Vec3f color_f;
-            constexpr bool kUseOriginalColors = true;
-            if (kUseOriginalColors) {
-              color_f = cv::Vec3f(static_cast<float>(original_color[0]),
-                                  static_cast<float>(original_color[1]),
-                                  static_cast<float>(original_color[2]));
-            } else {
-              color_f = cv::Vec3f(static_cast<float>(colors[label][0]),
-                                  static_cast<float>(colors[label][1]),
-                                  static_cast<float>(colors[label][2]));
-            }
-            std::vector<cv::Vec3f> rgb_point_with_normals{point, normal,
-                                                          color_f};
-            Segment& segment = (*segments)[labels_map.at(label)];
-            segment.points.push_back(point);
-            segment.normals.push_back(normal);
-            segment.original_colors.push_back(color_f);
-            segment.label.insert(label);
-            cv::Mat& segment_mask = (*segment_masks)[labels_map.at(label)];
-            segment_mask.at<uint8_t>(y, x) = kMaskValue;
+            color_f = cv::Vec3f(static_cast<float>(colors[label][0]),
+                                static_cast<float>(colors[label][1]),
+                                static_cast<float>(colors[label][2]));
           }
+          const size_t position = write_positions[table_index]++;
+          segments->points[position] = rays.backProject(
+              x + offset.x, y + offset.y, depth_image.at<float>(y, x));
+          segments->normals[position] = normal_map.at<cv::Vec3f>(y, x);
+          segments->original_colors[position] = color_f;
+          (*segment_masks)[table_index].addPixel(y, x);
         }
       }
-      CHECK_EQ(segments->size(), labels_map.size());
       break;
     }
     case LabelMapMethod::kFloodFill: {
@@ -926,56 +2166,229 @@ void DepthSegmenter::labelMap(const cv::Mat& rgb_image,
       std::vector<cv::Scalar> colors;
       std::vector<int> labels;
       generateRandomColorsAndLabels(labeled_segments.size(), &colors, &labels);
-      segments->resize(labeled_segments.size());
+      for (size_t i = 0u; i < labeled_segments.size(); ++i) {
+        if (labeled_segments[i].size() >= params_.label.min_size) {
+          segments->addSegment(labeled_segments[i].size(), i);
+        }
+      }
+      segments->resizeBuffers();
+      segment_masks->clear();
       // Assign the colors and labels to the segments.
+      size_t table_index = 0u;
       for (size_t i = 0u; i < labeled_segments.size(); ++i) {
         cv::Vec3b color;
-        if (labeled_segments[i].size() < params_.label.min_size) {
+        const bool is_kept =
+            labeled_segments[i].size() >= params_.label.min_size;
+        if (!is_kept) {
           color = cv::Vec3b(0, 0, 0);
         } else {
           color = cv::Vec3b(colors[i][0], colors[i][1], colors[i][2]);
         }
-        cv::Mat segment_mask =
-            cv::Mat(depth_image.size(), CV_8UC1, cv::Scalar(0));
         for (size_t j = 0u; j < labeled_segments[i].size(); ++j) {
           const size_t x = labeled_segments[i][j].x;
           const size_t y = labeled_segments[i][j].y;
           output.at<cv::Vec3b>(y, x) = color;
-          // TODO(ff): We might need this here.
-          // if (color == cv::Vec3b(0, 0, 0)) {
-          //   continue;
-          // }
-          cv::Vec3f point = depth_map.at<cv::Vec3f>(y, x);
-          cv::Vec3f normal = normal_map.at<cv::Vec3f>(y, x);
+          if (!is_kept) {
+            continue;
+          }
           cv::Vec3b original_color = rgb_image.at<cv::Vec3f>(y, x);
-          cv::Vec3f color_f{float(original_color[0]), float(original_color[1]),
-                            float(original_color[2])};
-          Segment& segment = (*segments)[i];
-          segment.points.push_back(point);
-          segment.normals.push_back(normal);
-          segment.original_colors.push_back(color_f);
-          segment.label.insert(i);
-          segment_mask.at<uint8_t>(y, x) = kMaskValue;
+          cv::Vec3f color_f{float(original_color[red_index]),
+                            float(original_color[1]),
+                            float(original_color[blue_index])};
+          const size_t position = segments->offsets[table_index] + j;
+          segments->points[position] = depth_map.at<cv::Vec3f>(y, x);
+          segments->normals[position] = normal_map.at<cv::Vec3f>(y, x);
+          segments->original_colors[position] = color_f;
+        }
+        if (is_kept) {
+          // The masks expect the pixels in row-major order.
+          std::vector<cv::Point2i> pixels = labeled_segments[i];
+          std::sort(pixels.begin(), pixels.end(),
+                    [](const cv::Point2i& a, const cv::Point2i& b) {
+                      return a.y < b.y || (a.y == b.y && a.x < b.x);
+                    });
+          SegmentMask segment_mask;
+          for (const cv::Point2i& pixel : pixels) {
+            segment_mask.addPixel(pixel.y, pixel.x);
+          }
+          segment_masks->push_back(segment_mask);
+          ++table_index;
         }
-        CHECK_EQ(segment_mask.size(), depth_image.size());
-        segment_masks->push_back(segment_mask.clone());
       }
       break;
     }
   }
 
-  // Remove small segments from segments vector.
-  for (size_t i = 0u; i < segments->size();) {
-    if ((*segments)[i].points.size() < params_.label.min_size) {
-      segments->erase(segments->begin() + i);
-      segment_masks->erase(segment_masks->begin() + i);
-    } else {
-      ++i;
+  if (params_.label.use_inpaint) {
+    inpaintImage(depth_image, edge_map, output, &output);
+  }
+}
+
+void DepthSegmenter::labelMap(
+    const cv::Mat& rgb_image, const bool bgr_input, const cv::Mat& depth_image,
+    const SemanticInstanceSegmentation& instance_segmentation,
+    const cv::Mat& depth_map, const cv::Mat& edge_map,
+    const cv::Mat& normal_map, cv::Mat* labeled_map,
+    std::vector<SegmentMask>* segment_masks, SegmentTable* segments) {
+  labelMap(rgb_image, bgr_input, depth_image, depth_map, edge_map, normal_map,
+           labeled_map, segment_masks, segments);
+
+  // Count the overlap of all segments with all instances in one pass over
+  // the segment pixels.
+  const InstanceIdImage& instance_ids = workspace_.instance_ids;
+  workspace_.instance_ids.compute(instance_segmentation.masks,
+                                  depth_image.size());
+  InstanceOverlap& overlap = workspace_.instance_overlap;
+  overlap.reset(segments->size(), instance_segmentation.masks.size());
+  for (size_t i = 0u; i < segments->size(); ++i) {
+    for (const SegmentMask::Run& run : (*segment_masks)[i].runs) {
+      for (int x = run.x_begin; x < run.x_end; ++x) {
+        overlap.add(i, instance_ids, run.y, x);
+      }
     }
   }
 
-  if (params_.label.use_inpaint) {
-    inpaintImage(depth_image, edge_map, output, &output);
+  for (size_t i = 0u; i < segments->size(); ++i) {
+    // For each DS segment identify the corresponding
+    // maximally overlapping mask, if any.
+    const size_t instance_label = overlap.assignInstance(
+        i, (*segment_masks)[i].size(),
+        params_.semantic_instance_segmentation.overlap_threshold);
+    if (instance_label != kUnassignedLabel) {
+      // Found a maximally overlapping mask, assign the corresponding semantic
+      // and instance labels. Instance label 0u corresponds to a segment with
+      // no overlapping mask, thus the instance ids start at 1u.
+      segments->semantic_labels[i] =
+          instance_segmentation.labels[instance_label - 1u];
+      segments->instance_labels[i] = instance_label;
+    }
+  }
+}
+
+void DepthSegmenter::labelImage(const cv::Mat& depth_image,
+                                const cv::Mat& depth_map,
+                                const cv::Mat& edge_map,
+                                const cv::Mat& normal_map, cv::Mat* label_image,
+                                std::vector<SegmentDescriptor>* descriptors) {
+  ScopedStageTimer stage_timer(Stage::kLabelMap, getActiveStageTimer());
+  CHECK(!depth_image.empty());
+  CHECK_EQ(depth_image.type(), CV_32FC1);
+  CHECK(!edge_map.empty());
+  CHECK(edge_map.type() == CV_32FC1 || edge_map.type() == CV_8UC1);
+  CHECK_EQ(depth_map.type(), CV_32FC3);
+  CHECK_EQ(normal_map.type(), CV_32FC3);
+  CHECK_EQ(depth_image.size(), edge_map.size());
+  CHECK_EQ(depth_image.size(), depth_map.size());
+  CHECK_EQ(depth_image.size(), normal_map.size());
+  CHECK_NOTNULL(label_image);
+  CHECK_NOTNULL(descriptors)->clear();
+  CHECK(params_.label.method == LabelMapMethod::kContour ||
+        params_.label.method == LabelMapMethod::kConnectedComponents)
+      << "The label image requires the contour or connected components "
+         "label method.";
+
+  if (!params_.roi.enable) {
+    labelImageRegion(depth_image, depth_map, edge_map, normal_map,
+                     cv::Point(0, 0), label_image, descriptors);
+    return;
+  }
+  // Label the region of interest only and move the labels to the frame.
+  const cv::Rect roi = getRoi(depth_image.size());
+  cv::Mat& roi_depth_image = workspace_.roi_depth_image;
+  cropDepthImage(depth_image, roi, &roi_depth_image);
+  cv::Mat& roi_label_image = workspace_.roi_label_image;
+  labelImageRegion(roi_depth_image, depth_map(roi), edge_map(roi),
+                   normal_map(roi), roi.tl(), &roi_label_image, descriptors);
+  createZeros(depth_image.size(), CV_32SC1, label_image);
+  roi_label_image.copyTo((*label_image)(roi));
+}
+
+void DepthSegmenter::labelImageRegion(
+    const cv::Mat& depth_image, const cv::Mat& depth_map,
+    const cv::Mat& edge_map, const cv::Mat& normal_map,
+    const cv::Point& offset, cv::Mat* label_image,
+    std::vector<SegmentDescriptor>* descriptors) {
+  cv::Mat& output = workspace_.label_image_colors;
+  createZeros(depth_image.size(), CV_8UC3, &output);
+  cv::Mat& edge_map_8u = workspace_.label_edge_map_8u;
+  std::vector<cv::Scalar> colors;
+  std::vector<size_t> segment_indices;
+  std::vector<int> segment_labels;
+  labelRegions(depth_image, depth_map, edge_map, &edge_map_8u, &output,
+               label_image, &colors, &segment_indices, &segment_labels);
+
+  const RayTable& rays = depth_camera_.getRayTable();
+
+  // First pass: accumulate the statistics of all segments.
+  const size_t num_segments = segment_labels.size();
+  std::vector<size_t> num_pixels(num_segments, 0u);
+  std::vector<size_t> num_points(num_segments, 0u);
+  std::vector<cv::Vec3d> point_sums(num_segments, cv::Vec3d(0.0, 0.0, 0.0));
+  std::vector<cv::Vec3d> normal_sums(num_segments, cv::Vec3d(0.0, 0.0, 0.0));
+  std::vector<cv::Point> min_corners(
+      num_segments, cv::Point(label_image->cols, label_image->rows));
+  std::vector<cv::Point> max_corners(num_segments, cv::Point(-1, -1));
+  for (int y = 0; y < label_image->rows; ++y) {
+    for (int x = 0; x < label_image->cols; ++x) {
+      const int32_t label = label_image->at<int32_t>(y, x);
+      if (label < 0 || label >= static_cast<int>(segment_indices.size()) ||
+          segment_indices[label] == kNoSegment) {
+        continue;
+      }
+      const size_t i = segment_indices[label];
+      ++num_pixels[i];
+      min_corners[i].x = std::min(min_corners[i].x, x);
+      min_corners[i].y = std::min(min_corners[i].y, y);
+      max_corners[i].x = std::max(max_corners[i].x, x);
+      max_corners[i].y = std::max(max_corners[i].y, y);
+      // Back-project the raw depth, like labelMap does for its points.
+      const float z = depth_image.at<float>(y, x);
+      if (z > 0.0f && std::isfinite(z)) {
+        point_sums[i] +=
+            cv::Vec3d(rays.backProject(x + offset.x, y + offset.y, z));
+        ++num_points[i];
+      }
+      const cv::Vec3f& normal = normal_map.at<cv::Vec3f>(y, x);
+      if (std::isfinite(normal[0]) && std::isfinite(normal[1]) &&
+          std::isfinite(normal[2])) {
+        normal_sums[i] += cv::Vec3d(normal[0], normal[1], normal[2]);
+      }
+    }
+  }
+
+  // Only keep the segments that reach the minimal size.
+  std::vector<int32_t> segment_ids(num_segments, 0);
+  for (size_t i = 0u; i < num_segments; ++i) {
+    if (num_pixels[i] < params_.label.min_size) {
+      continue;
+    }
+    SegmentDescriptor descriptor;
+    descriptor.label = segment_labels[i];
+    descriptor.num_pixels = num_pixels[i];
+    if (num_points[i] > 0u) {
+      descriptor.centroid = point_sums[i] / static_cast<double>(num_points[i]);
+    }
+    const double normal_norm = cv::norm(normal_sums[i]);
+    if (normal_norm > 0.0) {
+      descriptor.mean_normal = normal_sums[i] / normal_norm;
+    }
+    descriptor.bounding_box = cv::Rect(
+        min_corners[i] + offset, max_corners[i] + offset + cv::Point(1, 1));
+    descriptors->push_back(descriptor);
+    segment_ids[i] = descriptors->size();
+  }
+
+  // Second pass: replace the labels by the segment ids.
+  for (int y = 0; y < label_image->rows; ++y) {
+    for (int x = 0; x < label_image->cols; ++x) {
+      int32_t& label = label_image->at<int32_t>(y, x);
+      if (label < 0 || label >= static_cast<int>(segment_indices.size()) ||
+          segment_indices[label] == kNoSegment) {
+        label = 0;
+      } else {
+        label = segment_ids[segment_indices[label]];
+      }
+    }
   }
 
   if (params_.label.display) {
@@ -984,134 +2397,246 @@ void DepthSegmenter::labelMap(const cv::Mat& rgb_image,
     imshow(kWindowName, output);
     cv::waitKey(1);
   }
-  *labeled_map = output;
 }
 
-void DepthSegmenter::labelMap(
-    const cv::Mat& rgb_image, const cv::Mat& depth_image,
+void DepthSegmenter::labelImage(
+    const cv::Mat& depth_image,
     const SemanticInstanceSegmentation& instance_segmentation,
     const cv::Mat& depth_map, const cv::Mat& edge_map,
-    const cv::Mat& normal_map, cv::Mat* labeled_map,
-    std::vector<cv::Mat>* segment_masks, std::vector<Segment>* segments) {
-  labelMap(rgb_image, depth_image, depth_map, edge_map, normal_map, labeled_map,
-           segment_masks, segments);
+    const cv::Mat& normal_map, cv::Mat* label_image,
+    std::vector<SegmentDescriptor>* descriptors) {
+  labelImage(depth_image, depth_map, edge_map, normal_map, label_image,
+             descriptors);
+
+  // Count the overlap of all segments with all instances in one pass over
+  // the label image.
+  const InstanceIdImage& instance_ids = workspace_.instance_ids;
+  workspace_.instance_ids.compute(instance_segmentation.masks,
+                                  label_image->size());
+  InstanceOverlap& overlap = workspace_.instance_overlap;
+  overlap.reset(descriptors->size() + 1u, instance_segmentation.masks.size());
+  for (int y = 0; y < label_image->rows; ++y) {
+    const int32_t* segment_ids = label_image->ptr<int32_t>(y);
+    for (int x = 0; x < label_image->cols; ++x) {
+      overlap.add(segment_ids[x], instance_ids, y, x);
+    }
+  }
 
-  for (size_t i = 0u; i < segments->size(); ++i) {
-    // For each DS segment identify the corresponding
-    // maximally overlapping mask, if any.
-    size_t maximally_overlapping_mask_index = 0u;
-    int max_overlap_size = 0;
-    int segment_size = cv::countNonZero((*segment_masks)[i]);
-
-    for (size_t j = 0u; j < instance_segmentation.masks.size(); ++j) {
-      // Search through all masks to find the maximally overlapping one.
-      cv::Mat mask_overlap;
-      cv::bitwise_and((*segment_masks)[i], instance_segmentation.masks[j],
-                      mask_overlap);
-
-      int overlap_size = cv::countNonZero(mask_overlap);
-      float normalized_overlap = (float)overlap_size / (float)segment_size;
-
-      if (overlap_size > max_overlap_size &&
-          normalized_overlap >
-              params_.semantic_instance_segmentation.overlap_threshold) {
-        maximally_overlapping_mask_index = j;
-        max_overlap_size = overlap_size;
-      }
+  for (size_t i = 0u; i < descriptors->size(); ++i) {
+    SegmentDescriptor& descriptor = (*descriptors)[i];
+    const size_t instance_label = overlap.assignInstance(
+        i + 1u, descriptor.num_pixels,
+        params_.semantic_instance_segmentation.overlap_threshold);
+    if (instance_label != kUnassignedLabel) {
+      descriptor.semantic_label =
+          instance_segmentation.labels[instance_label - 1u];
+      descriptor.instance_label = instance_label;
     }
+  }
+}
+
+FrameSegmenter::FrameSegmenter(const Params& params)
+    : params_(params),
+      depth_segmenter_(depth_camera_, params_),
+      needs_initialization_(true),
+      num_initializations_(0u) {}
+
+void FrameSegmenter::setParams(const Params& params) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  params_ = params;
+  needs_initialization_ = true;
+}
 
-    if (max_overlap_size > 0) {
-      // Found a maximally overlapping mask, assign
-      // the corresponding semantic and instance labels.
-      (*segments)[i].semantic_label.insert(
-          instance_segmentation.labels[maximally_overlapping_mask_index]);
-      // Instance label 0u corresponds to a segment with no overlapping
-      // mask, thus the assigned index is incremented by 1u.
-      (*segments)[i].instance_label.insert(maximally_overlapping_mask_index +
-                                           1u);
+void FrameSegmenter::initializeIfNeeded(const cv::Size& image_size,
+                                        const cv::Mat& depth_intrinsics) {
+  if (!needs_initialization_) {
+    const cv::Mat camera_matrix = depth_camera_.getCameraMatrix();
+    const bool intrinsics_changed =
+        camera_matrix.type() != depth_intrinsics.type() ||
+        camera_matrix.size() != depth_intrinsics.size() ||
+        cv::norm(camera_matrix, depth_intrinsics, cv::NORM_INF) != 0.0;
+    const bool size_changed =
+        depth_camera_.getHeight() != static_cast<size_t>(image_size.height) ||
+        depth_camera_.getWidth() != static_cast<size_t>(image_size.width);
+    if (!intrinsics_changed && !size_changed) {
+      return;
     }
   }
+  depth_camera_.initialize(image_size.height, image_size.width, CV_32FC1,
+                           depth_intrinsics.clone());
+  depth_segmenter_.initialize();
+  needs_initialization_ = false;
+  ++num_initializations_;
 }
 
-void segmentSingleFrame(const cv::Mat& rgb_image, const cv::Mat& depth_image,
-                        const cv::Mat& depth_intrinsics,
-                        depth_segmentation::Params& params, cv::Mat* label_map,
-                        cv::Mat* normal_map,
-                        std::vector<cv::Mat>* segment_masks,
-                        std::vector<Segment>* segments) {
+void FrameSegmenter::segment(const cv::Mat& rgb_image, const bool bgr_input,
+                             const cv::Mat& depth_image,
+                             const cv::Mat& depth_intrinsics,
+                             cv::Mat* label_map, cv::Mat* normal_map,
+                             std::vector<SegmentMask>* segment_masks,
+                             SegmentTable* segments) {
   CHECK(!rgb_image.empty());
   CHECK(!depth_image.empty());
+  CHECK(!depth_intrinsics.empty());
   CHECK_NOTNULL(label_map);
   CHECK_NOTNULL(normal_map);
   CHECK_NOTNULL(segment_masks);
   CHECK_NOTNULL(segments);
+  std::lock_guard<std::mutex> lock(mutex_);
+  initializeIfNeeded(depth_image.size(), depth_intrinsics);
+
+  // Invalid depths, zeros of 16 bit images as well as NaNs, are zero.
+  rescaleDepthImage(depth_image, &rescaled_depth_);
+  depth_segmenter_.computeGeometricMaps(rescaled_depth_, depth_image,
+                                        &depth_map_, normal_map, &edge_map_);
+
+  // Label the remaning segments, without the edges at invalid depths.
+  cv::compare(rescaled_depth_, 0.0, invalid_depth_mask_, cv::CMP_EQ);
+  edge_map_.setTo(cv::Scalar(0), invalid_depth_mask_);
+  depth_segmenter_.labelMap(rgb_image, bgr_input, rescaled_depth_, depth_map_,
+                            edge_map_, *normal_map, label_map, segment_masks,
+                            segments);
+}
 
-  DepthCamera depth_camera;
-  DepthSegmenter depth_segmenter(depth_camera, params);
+void segmentSingleFrame(const cv::Mat& rgb_image, const bool bgr_input,
+                        const cv::Mat& depth_image,
+                        const cv::Mat& depth_intrinsics,
+                        depth_segmentation::Params& params, cv::Mat* label_map,
+                        cv::Mat* normal_map,
+                        std::vector<SegmentMask>* segment_masks,
+                        SegmentTable* segments) {
+  FrameSegmenter frame_segmenter(params);
+  frame_segmenter.segment(rgb_image, bgr_input, depth_image, depth_intrinsics,
+                          label_map, normal_map, segment_masks, segments);
+}
 
-  depth_camera.initialize(depth_image.rows, depth_image.cols, CV_32FC1,
-                          depth_intrinsics);
-  depth_segmenter.initialize();
+void downsampleDepthImage(const cv::Mat& depth_image, const int factor,
+                          cv::Mat* downsampled_depth) {
+  CHECK(!depth_image.empty());
+  CHECK_EQ(depth_image.type(), CV_32FC1);
+  CHECK_GT(factor, 0);
+  CHECK_NOTNULL(downsampled_depth);
+  const int rows = depth_image.rows;
+  const int cols = depth_image.cols;
+  downsampled_depth->create((rows + factor - 1) / factor,
+                            (cols + factor - 1) / factor, CV_32FC1);
+#pragma omp parallel for
+  for (int y = 0; y < downsampled_depth->rows; ++y) {
+    std::vector<float> block_depths;
+    block_depths.reserve(factor * factor);
+    float* downsampled_row = downsampled_depth->ptr<float>(y);
+    const int y_end = std::min(rows, (y + 1) * factor);
+    for (int x = 0; x < downsampled_depth->cols; ++x) {
+      block_depths.clear();
+      const int x_end = std::min(cols, (x + 1) * factor);
+      for (int block_y = y * factor; block_y < y_end; ++block_y) {
+        const float* depth_row = depth_image.ptr<float>(block_y);
+        for (int block_x = x * factor; block_x < x_end; ++block_x) {
+          const float depth = depth_row[block_x];
+          if (depth > 0.0f && std::isfinite(depth)) {
+            block_depths.push_back(depth);
+          }
+        }
+      }
+      if (block_depths.empty()) {
+        downsampled_row[x] = 0.0f;
+        continue;
+      }
+      // The lower median, an actual depth of the block, never blends the
+      // depths of foreground and background.
+      const auto median =
+          block_depths.begin() + (block_depths.size() - 1u) / 2u;
+      std::nth_element(block_depths.begin(), median, block_depths.end());
+      downsampled_row[x] = *median;
+    }
+  }
+}
 
-  cv::Mat rescaled_depth = cv::Mat(depth_image.size(), CV_32FC1);
-  if (depth_image.type() == CV_16UC1) {
-    cv::rgbd::rescaleDepth(depth_image, CV_32FC1, rescaled_depth);
-  } else if (depth_image.type() != CV_32FC1) {
-    LOG(FATAL) << "Depth image is of unknown type.";
-  } else {
-    rescaled_depth = depth_image;
-  }
-
-  // Compute depth map from rescaled depth image.
-  cv::Mat depth_map(rescaled_depth.size(), CV_32FC3);
-  depth_segmenter.computeDepthMap(rescaled_depth, &depth_map);
-
-  // Compute normals based on specified method.
-  *normal_map = cv::Mat(depth_map.size(), CV_32FC3, 0.0f);
-  if (params.normals.method ==
-          depth_segmentation::SurfaceNormalEstimationMethod::kFals ||
-      params.normals.method ==
-          depth_segmentation::SurfaceNormalEstimationMethod::kSri ||
-      params.normals.method ==
-          depth_segmentation::SurfaceNormalEstimationMethod::
-              kDepthWindowFilter) {
-    depth_segmenter.computeNormalMap(depth_map, normal_map);
-  } else if (params.normals.method ==
-             depth_segmentation::SurfaceNormalEstimationMethod::kLinemod) {
-    depth_segmenter.computeNormalMap(depth_image, normal_map);
-  }
-
-  // Compute depth discontinuity map.
-  cv::Mat discontinuity_map = cv::Mat::zeros(rescaled_depth.size(), CV_32FC1);
-  if (params.depth_discontinuity.use_discontinuity) {
-    depth_segmenter.computeDepthDiscontinuityMap(rescaled_depth,
-                                                 &discontinuity_map);
-  }
-
-  // Compute maximum distance map.
-  cv::Mat distance_map = cv::Mat::zeros(rescaled_depth.size(), CV_32FC1);
-  if (params.max_distance.use_max_distance) {
-    depth_segmenter.computeMaxDistanceMap(depth_map, &distance_map);
-  }
-
-  // Compute minimum convexity map.
-  cv::Mat convexity_map = cv::Mat::zeros(rescaled_depth.size(), CV_32FC1);
-  if (params.min_convexity.use_min_convexity) {
-    depth_segmenter.computeMinConvexityMap(depth_map, *normal_map,
-                                           &convexity_map);
-  }
-
-  // Compute final edge map.
-  cv::Mat edge_map(rescaled_depth.size(), CV_32FC1);
-  depth_segmenter.computeFinalEdgeMap(convexity_map, distance_map,
-                                      discontinuity_map, &edge_map);
-
-  // Label the remaning segments.
-  cv::Mat remove_no_values = cv::Mat::zeros(edge_map.size(), edge_map.type());
-  edge_map.copyTo(remove_no_values, rescaled_depth == rescaled_depth);
-  edge_map = remove_no_values;
-  depth_segmenter.labelMap(rgb_image, rescaled_depth, depth_map, edge_map,
-                           *normal_map, label_map, segment_masks, segments);
+void upsampleNearest(const cv::Mat& image, const int factor,
+                     const cv::Size& size, cv::Mat* upsampled) {
+  CHECK(!image.empty());
+  CHECK_GT(factor, 0);
+  CHECK_NOTNULL(upsampled);
+  CHECK_EQ(image.cols, (size.width + factor - 1) / factor);
+  CHECK_EQ(image.rows, (size.height + factor - 1) / factor);
+  upsampled->create(size, image.type());
+  const size_t pixel_size = image.elemSize();
+#pragma omp parallel for
+  for (int y = 0; y < size.height; ++y) {
+    const uint8_t* image_row = image.ptr<uint8_t>(y / factor);
+    uint8_t* upsampled_row = upsampled->ptr<uint8_t>(y);
+    for (int x = 0; x < size.width; ++x) {
+      std::memcpy(upsampled_row + x * pixel_size,
+                  image_row + (x / factor) * pixel_size, pixel_size);
+    }
+  }
+}
+
+double computeLabelAgreement(const cv::Mat& labels,
+                             const cv::Mat& reference_labels) {
+  CHECK_EQ(labels.type(), CV_32SC1);
+  CHECK_EQ(reference_labels.type(), CV_32SC1);
+  CHECK_EQ(labels.size(), reference_labels.size());
+  double max_label;
+  double max_reference_label;
+  cv::minMaxLoc(labels, nullptr, &max_label);
+  cv::minMaxLoc(reference_labels, nullptr, &max_reference_label);
+  const size_t num_labels = std::max(0.0, max_label) + 1u;
+  const size_t num_reference_labels = std::max(0.0, max_reference_label) + 1u;
+
+  // Overlap of every segment with every reference segment.
+  std::vector<size_t> overlaps(num_labels * num_reference_labels, 0u);
+  size_t num_labeled_pixels = 0u;
+  for (int y = 0; y < labels.rows; ++y) {
+    const int32_t* label_row = labels.ptr<int32_t>(y);
+    const int32_t* reference_row = reference_labels.ptr<int32_t>(y);
+    for (int x = 0; x < labels.cols; ++x) {
+      const int32_t label = std::max(label_row[x], 0);
+      const int32_t reference_label = std::max(reference_row[x], 0);
+      if (label == 0 && reference_label == 0) {
+        continue;
+      }
+      ++num_labeled_pixels;
+      if (label > 0 && reference_label > 0) {
+        ++overlaps[label * num_reference_labels + reference_label];
+      }
+    }
+  }
+  if (num_labeled_pixels == 0u) {
+    return 1.0;
+  }
+  // Every segment agrees with the reference segment it overlaps most.
+  size_t num_agreeing_pixels = 0u;
+  for (size_t label = 1u; label < num_labels; ++label) {
+    const auto row = overlaps.begin() + label * num_reference_labels;
+    num_agreeing_pixels += *std::max_element(row, row + num_reference_labels);
+  }
+  return static_cast<double>(num_agreeing_pixels) / num_labeled_pixels;
+}
+
+void rescaleDepthImage(const cv::Mat& depth_image, cv::Mat* rescaled_depth) {
+  CHECK(!depth_image.empty());
+  CHECK(depth_image.type() == CV_16UC1 || depth_image.type() == CV_32FC1);
+  CHECK_NOTNULL(rescaled_depth);
+  rescaled_depth->create(depth_image.size(), CV_32FC1);
+  constexpr float kMillimetersToMeters = 0.001f;
+  const bool is_millimeters = depth_image.type() == CV_16UC1;
+#pragma omp parallel for
+  for (int y = 0; y < depth_image.rows; ++y) {
+    float* output = rescaled_depth->ptr<float>(y);
+    if (is_millimeters) {
+      // Zero millimeters stay zero meters.
+      const uint16_t* input = depth_image.ptr<uint16_t>(y);
+      for (int x = 0; x < depth_image.cols; ++x) {
+        output[x] = kMillimetersToMeters * input[x];
+      }
+    } else {
+      const float* input = depth_image.ptr<float>(y);
+      for (int x = 0; x < depth_image.cols; ++x) {
+        output[x] = input[x] == input[x] ? input[x] : 0.0f;
+      }
+    }
+  }
 }
 
 }  // namespace depth_segmentation
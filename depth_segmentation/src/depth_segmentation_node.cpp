@@ -1,4 +1,13 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
 #include <cv_bridge/cv_bridge.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <dynamic_reconfigure/server.h>
 #include <image_transport/image_transport.h>
 #include <image_transport/subscriber.h>
@@ -6,10 +15,6 @@
 #include <message_filters/subscriber.h>
 #include <message_filters/sync_policies/approximate_time.h>
 #include <message_filters/synchronizer.h>
-#include <pcl/PCLPointCloud2.h>
-#include <pcl/point_types.h>
-#include <pcl_conversions/pcl_conversions.h>
-#include <pcl_ros/point_cloud.h>
 #include <sensor_msgs/CameraInfo.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/PointCloud2.h>
@@ -24,26 +29,13 @@
 #include <mask_rcnn_ros/Result.h>
 #endif
 
+#include "depth_segmentation/LabelImage.h"
+#include "depth_segmentation/bounded_queue.h"
+#include "depth_segmentation/SegmentedScene.h"
 #include "depth_segmentation/depth_segmentation.h"
+#include "depth_segmentation/point_cloud.h"
 #include "depth_segmentation/ros_common.h"
 
-struct PointSurfelLabel {
-  PCL_ADD_POINT4D;
-  PCL_ADD_NORMAL4D;
-  PCL_ADD_RGB;
-  uint8_t instance_label;
-  uint8_t semantic_label;
-
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-} EIGEN_ALIGN16;
-
-POINT_CLOUD_REGISTER_POINT_STRUCT(
-    PointSurfelLabel,
-    (float, x, x)(float, y, y)(float, z, z)(float, normal_x, normal_x)(
-        float, normal_y, normal_y)(float, normal_z, normal_z)(float, rgb, rgb)(
-        uint8_t, instance_label, instance_label)(uint8_t, semantic_label,
-                                                 semantic_label))
-
 class DepthSegmentationNode {
  public:
   DepthSegmentationNode()
@@ -54,10 +46,31 @@ class DepthSegmentationNode {
         rgb_camera_(),
         params_(),
         camera_tracker_(depth_camera_, rgb_camera_),
-        depth_segmenter_(depth_camera_, params_) {
+        depth_segmenter_(depth_camera_, params_),
+        use_pipeline_(false),
+        pipeline_policy_(depth_segmentation::QueueFullPolicy::kDropOldest),
+        pipeline_running_(false),
+        has_depth_seq_(false),
+        last_depth_seq_(0u) {
+    node_handle_.param<bool>("timing/enable", params_.timing.enable,
+                             params_.timing.enable);
+    node_handle_.param<bool>("timing/publish_diagnostics",
+                             params_.timing.publish_diagnostics,
+                             params_.timing.publish_diagnostics);
+    node_handle_.param<double>("timing/diagnostics_rate",
+                               params_.timing.diagnostics_rate,
+                               params_.timing.diagnostics_rate);
+    CHECK_GT(params_.timing.diagnostics_rate, 0.0);
     node_handle_.param<bool>("semantic_instance_segmentation/enable",
                              params_.semantic_instance_segmentation.enable,
                              params_.semantic_instance_segmentation.enable);
+    int pipeline_queue_size = 2;
+    bool pipeline_drop_oldest = true;
+    node_handle_.param<bool>("pipeline/enable", use_pipeline_, use_pipeline_);
+    node_handle_.param<int>("pipeline/queue_size", pipeline_queue_size,
+                            pipeline_queue_size);
+    node_handle_.param<bool>("pipeline/drop_oldest", pipeline_drop_oldest,
+                             pipeline_drop_oldest);
     node_handle_.param<float>(
         "semantic_instance_segmentation/overlap_threshold",
         params_.semantic_instance_segmentation.overlap_threshold,
@@ -136,12 +149,47 @@ class DepthSegmentationNode {
                                                          1000);
     point_cloud2_scene_pub_ =
         node_handle_.advertise<sensor_msgs::PointCloud2>("segmented_scene", 1);
+    if (params_.timing.publish_diagnostics) {
+      diagnostics_pub_ =
+          node_handle_.advertise<diagnostic_msgs::DiagnosticArray>(
+              "diagnostics", 1);
+    }
 
     node_handle_.param<bool>("visualize_segmented_scene",
                              params_.visualize_segmented_scene,
                              params_.visualize_segmented_scene);
+    node_handle_.param<bool>("batch_segments", params_.batch_segments,
+                             params_.batch_segments);
+    if (params_.batch_segments) {
+      segmented_scene_pub_ =
+          node_handle_.advertise<depth_segmentation::SegmentedScene>(
+              "segmented_scene_batch", 10);
+    }
+    node_handle_.param<bool>("output_label_image", params_.output_label_image,
+                             params_.output_label_image);
+    if (params_.output_label_image) {
+      label_image_pub_ = node_handle_.advertise<depth_segmentation::LabelImage>(
+          "label_image", 10);
+    }
+
+    if (use_pipeline_ && params_.semantic_instance_segmentation.enable) {
+      use_pipeline_ = false;
+      ROS_WARN_STREAM(
+          "Turning off the pipeline as semantic instance segmentation "
+          "is processed synchronously.");
+    }
+    if (use_pipeline_) {
+      CHECK_GT(pipeline_queue_size, 0);
+      pipeline_policy_ =
+          pipeline_drop_oldest
+              ? depth_segmentation::QueueFullPolicy::kDropOldest
+              : depth_segmentation::QueueFullPolicy::kBackpressure;
+      startPipeline(pipeline_queue_size);
+    }
   }
 
+  ~DepthSegmentationNode() { stopPipeline(); }
+
  private:
   ros::NodeHandle node_handle_;
   image_transport::ImageTransport image_transport_;
@@ -166,11 +214,44 @@ class DepthSegmentationNode {
   depth_segmentation::RgbCamera rgb_camera_;
 
   depth_segmentation::Params params_;
+  // Reused across frames to keep the segment buffers allocated.
+  depth_segmentation::SegmentTable segments_;
+
+  // Everything a frame carries from one stage of the pipeline to the next.
+  struct Frame {
+    sensor_msgs::Image::ConstPtr depth_msg;
+    sensor_msgs::Image::ConstPtr rgb_msg;
+    std::chrono::steady_clock::time_point arrival_time;
+    cv_bridge::CvImageConstPtr cv_rgb_image;
+    cv::Mat rescaled_depth;
+    cv::Mat depth_map;
+    cv::Mat normal_map;
+    cv::Mat edge_map;
+    // The rgb image is read in place, in the color order of its encoding.
+    bool bgr_input = false;
+    depth_segmentation::SegmentTable segments;
+    // Only used if the label image is published instead of the segments.
+    cv::Mat label_image;
+    std::vector<depth_segmentation::SegmentDescriptor> descriptors;
+  };
+  typedef std::unique_ptr<Frame> FramePtr;
+  typedef depth_segmentation::BoundedQueue<FramePtr> FrameQueue;
+
+  // Frame of the synchronous mode, reused across frames.
+  Frame frame_;
 
  public:
   depth_segmentation::CameraTracker camera_tracker_;
   depth_segmentation::DepthSegmenter depth_segmenter_;
 
+  // Applies the request while the pipeline stages are between frames, as
+  // they read the params without copying them.
+  void dynamicReconfigureCallback(
+      depth_segmentation::DepthSegmenterConfig& config, uint32_t level) {
+    std::unique_lock<std::shared_timed_mutex> lock(params_mutex_);
+    depth_segmenter_.dynamicReconfigureCallback(config, level);
+  }
+
  private:
   std::string rgb_image_topic_;
   std::string rgb_camera_info_topic_;
@@ -188,6 +269,13 @@ class DepthSegmentationNode {
 
   ros::Publisher point_cloud2_segment_pub_;
   ros::Publisher point_cloud2_scene_pub_;
+  ros::Publisher diagnostics_pub_;
+  ros::Publisher segmented_scene_pub_;
+  // Its cloud is the scene cloud, reused across frames to keep the point
+  // buffer allocated.
+  depth_segmentation::SegmentedScene segmented_scene_;
+  ros::Publisher label_image_pub_;
+  depth_segmentation::LabelImage label_image_msg_;
 
   message_filters::Synchronizer<ImageSyncPolicy>* image_sync_policy_;
 
@@ -200,6 +288,30 @@ class DepthSegmentationNode {
       image_segmentation_sync_policy_;
 #endif
 
+  // In pipeline mode the image callback only queues the frames. Decoding and
+  // the geometric maps, labelling and publishing each run on their own
+  // thread, connected by bounded queues.
+  bool use_pipeline_;
+  depth_segmentation::QueueFullPolicy pipeline_policy_;
+  std::atomic<bool> pipeline_running_;
+  std::unique_ptr<FrameQueue> geometry_queue_;
+  std::unique_ptr<FrameQueue> label_queue_;
+  std::unique_ptr<FrameQueue> publish_queue_;
+  // Published frames, handed back to the callback to reuse their buffers.
+  std::unique_ptr<FrameQueue> recycled_frames_;
+  std::vector<std::thread> pipeline_threads_;
+  // Held shared by the stages while they process a frame and exclusively by
+  // the dynamic reconfigure callback. The synchronous mode runs on the
+  // thread of the callback and needs no lock.
+  std::shared_timed_mutex params_mutex_;
+
+  // Sequence number of the last depth image received by the callbacks.
+  bool has_depth_seq_;
+  uint32_t last_depth_seq_;
+  // The diagnostics are published from all threads that count frames.
+  std::mutex diagnostics_mutex_;
+  std::chrono::steady_clock::time_point last_diagnostics_time_;
+
   void publish_tf(const cv::Mat cv_transform, const ros::Time& timestamp) {
     // Rotate such that the world frame initially aligns with the camera_link
     // frame.
@@ -226,108 +338,158 @@ class DepthSegmentationNode {
         transform, timestamp, camera_frame_, world_frame_));
   }
 
-  void fillPoint(const cv::Vec3f& point, const cv::Vec3f& normals,
-                 const cv::Vec3f& colors, pcl::PointSurfel* point_pcl) {
-    point_pcl->x = point[0];
-    point_pcl->y = point[1];
-    point_pcl->z = point[2];
-    point_pcl->normal_x = normals[0];
-    point_pcl->normal_y = normals[1];
-    point_pcl->normal_z = normals[2];
-    point_pcl->r = colors[0];
-    point_pcl->g = colors[1];
-    point_pcl->b = colors[2];
-  }
-
-  void fillPoint(const cv::Vec3f& point, const cv::Vec3f& normals,
-                 const cv::Vec3f& colors, const size_t& semantic_label,
-                 const size_t& instance_label, PointSurfelLabel* point_pcl) {
-    point_pcl->x = point[0];
-    point_pcl->y = point[1];
-    point_pcl->z = point[2];
-    point_pcl->normal_x = normals[0];
-    point_pcl->normal_y = normals[1];
-    point_pcl->normal_z = normals[2];
-    point_pcl->r = colors[0];
-    point_pcl->g = colors[1];
-    point_pcl->b = colors[2];
-
-    point_pcl->semantic_label = semantic_label;
-    point_pcl->instance_label = instance_label;
-  }
-
-  void publish_segments(
-      const std::vector<depth_segmentation::Segment>& segments,
-      const std_msgs::Header& header) {
+  void publish_segments(const depth_segmentation::SegmentTable& segments,
+                        const std_msgs::Header& header) {
+    depth_segmentation::ScopedStageTimer stage_timer(
+        depth_segmentation::Stage::kPublish,
+        depth_segmenter_.getActiveStageTimer());
     CHECK_GT(segments.size(), 0u);
+    // The scene cloud is written once, every segment cloud is a slice of it.
+    sensor_msgs::PointCloud2& scene_cloud = segmented_scene_.cloud;
+    depth_segmentation::segmentsToPointCloud2(
+        segments, params_.semantic_instance_segmentation.enable,
+        params_.batch_segments, &scene_cloud);
+    scene_cloud.header.stamp = header.stamp;
+    scene_cloud.header.frame_id = header.frame_id;
+    if (params_.batch_segments) {
+      segmented_scene_.header = scene_cloud.header;
+      segmented_scene_.segment_offsets.assign(segments.offsets.begin(),
+                                              segments.offsets.end());
+      segmented_scene_.segment_sizes.assign(segments.sizes.begin(),
+                                            segments.sizes.end());
+      segmented_scene_pub_.publish(segmented_scene_);
+    } else {
+      for (std::size_t s = 0u; s < segments.size(); ++s) {
+        CHECK_GT(segments.sizes[s], 0u);
+        sensor_msgs::PointCloud2 pcl2_msg;
+        depth_segmentation::extractSegmentPointCloud2(segments, s, scene_cloud,
+                                                      &pcl2_msg);
+        point_cloud2_segment_pub_.publish(pcl2_msg);
+      }
+    }
+
     // Just for rviz also publish the whole scene, as otherwise only ~10
     // segments are shown:
     // https://github.com/ros-visualization/rviz/issues/689
-    sensor_msgs::PointCloud2 pcl2_msg;
+    if (params_.visualize_segmented_scene) {
+      point_cloud2_scene_pub_.publish(scene_cloud);
+    }
+  }
 
-    if (params_.semantic_instance_segmentation.enable) {
-      pcl::PointCloud<PointSurfelLabel>::Ptr scene_pcl(
-          new pcl::PointCloud<PointSurfelLabel>);
-      for (depth_segmentation::Segment segment : segments) {
-        CHECK_GT(segment.points.size(), 0u);
-        pcl::PointCloud<PointSurfelLabel>::Ptr segment_pcl(
-            new pcl::PointCloud<PointSurfelLabel>);
-        for (std::size_t i = 0u; i < segment.points.size(); ++i) {
-          PointSurfelLabel point_pcl;
-          uint8_t semantic_label = 0u;
-          uint8_t instance_label = 0u;
-          if (segment.instance_label.size() > 0u) {
-            instance_label = *(segment.instance_label.begin());
-            semantic_label = *(segment.semantic_label.begin());
-          }
-          fillPoint(segment.points[i], segment.normals[i],
-                    segment.original_colors[i], semantic_label, instance_label,
-                    &point_pcl);
+  void publish_label_image(
+      const cv::Mat& label_image,
+      const std::vector<depth_segmentation::SegmentDescriptor>& descriptors,
+      const std_msgs::Header& header) {
+    depth_segmentation::ScopedStageTimer stage_timer(
+        depth_segmentation::Stage::kPublish,
+        depth_segmenter_.getActiveStageTimer());
+    CHECK_EQ(label_image.type(), CV_32SC1);
+    label_image_msg_.header = header;
+    cv_bridge::CvImage(header, sensor_msgs::image_encodings::TYPE_32SC1,
+                       label_image)
+        .toImageMsg(label_image_msg_.label_image);
+    label_image_msg_.segments.resize(descriptors.size());
+    for (std::size_t i = 0u; i < descriptors.size(); ++i) {
+      const depth_segmentation::SegmentDescriptor& descriptor = descriptors[i];
+      depth_segmentation::LabelImageSegment& segment_msg =
+          label_image_msg_.segments[i];
+      segment_msg.centroid.x = descriptor.centroid[0];
+      segment_msg.centroid.y = descriptor.centroid[1];
+      segment_msg.centroid.z = descriptor.centroid[2];
+      segment_msg.mean_normal.x = descriptor.mean_normal[0];
+      segment_msg.mean_normal.y = descriptor.mean_normal[1];
+      segment_msg.mean_normal.z = descriptor.mean_normal[2];
+      segment_msg.bounding_box.x_offset = descriptor.bounding_box.x;
+      segment_msg.bounding_box.y_offset = descriptor.bounding_box.y;
+      segment_msg.bounding_box.width = descriptor.bounding_box.width;
+      segment_msg.bounding_box.height = descriptor.bounding_box.height;
+      segment_msg.num_pixels = descriptor.num_pixels;
+      segment_msg.instance_label = descriptor.instance_label;
+      segment_msg.semantic_label = descriptor.semantic_label;
+    }
+    label_image_pub_.publish(label_image_msg_);
+  }
 
-          segment_pcl->push_back(point_pcl);
-          scene_pcl->push_back(point_pcl);
-        }
-        sensor_msgs::PointCloud2 pcl2_msg;
-        pcl::toROSMsg(*segment_pcl, pcl2_msg);
-        pcl2_msg.header.stamp = header.stamp;
-        pcl2_msg.header.frame_id = header.frame_id;
-        point_cloud2_segment_pub_.publish(pcl2_msg);
-      }
-      if (params_.visualize_segmented_scene) {
-        pcl::toROSMsg(*scene_pcl, pcl2_msg);
-      }
+  // Counts the frame as processed or dropped, if timing is enabled.
+  void countFrame(const bool is_processed, const std_msgs::Header& header) {
+    depth_segmentation::StageTimer* stage_timer =
+        depth_segmenter_.getActiveStageTimer();
+    if (stage_timer == nullptr) {
+      return;
+    }
+    if (is_processed) {
+      stage_timer->addProcessedFrame();
     } else {
-      pcl::PointCloud<pcl::PointSurfel>::Ptr scene_pcl(
-          new pcl::PointCloud<pcl::PointSurfel>);
-      for (depth_segmentation::Segment segment : segments) {
-        CHECK_GT(segment.points.size(), 0u);
-        pcl::PointCloud<pcl::PointSurfel>::Ptr segment_pcl(
-            new pcl::PointCloud<pcl::PointSurfel>);
-        for (std::size_t i = 0u; i < segment.points.size(); ++i) {
-          pcl::PointSurfel point_pcl;
-
-          fillPoint(segment.points[i], segment.normals[i],
-                    segment.original_colors[i], &point_pcl);
-
-          segment_pcl->push_back(point_pcl);
-          scene_pcl->push_back(point_pcl);
-        }
-        sensor_msgs::PointCloud2 pcl2_msg;
-        pcl::toROSMsg(*segment_pcl, pcl2_msg);
-        pcl2_msg.header.stamp = header.stamp;
-        pcl2_msg.header.frame_id = header.frame_id;
-        point_cloud2_segment_pub_.publish(pcl2_msg);
-      }
-      if (params_.visualize_segmented_scene) {
-        pcl::toROSMsg(*scene_pcl, pcl2_msg);
-      }
+      stage_timer->addDroppedFrame();
     }
+    if (params_.timing.publish_diagnostics) {
+      publishDiagnostics(*stage_timer, header);
+    }
+  }
 
-    if (params_.visualize_segmented_scene) {
-      pcl2_msg.header.stamp = header.stamp;
-      pcl2_msg.header.frame_id = header.frame_id;
-      point_cloud2_scene_pub_.publish(pcl2_msg);
+  // Counts the frames that never reached the callback, e.g. dropped by the
+  // subscriber queues or the synchronizer, from the gaps between the sequence
+  // numbers of consecutive depth images. Only called by the callbacks.
+  void countMissedFrames(const std_msgs::Header& header) {
+    depth_segmentation::StageTimer* stage_timer =
+        depth_segmenter_.getActiveStageTimer();
+    // A smaller sequence number means the camera restarted.
+    if (stage_timer != nullptr && has_depth_seq_ &&
+        header.seq > last_depth_seq_ + 1u) {
+      stage_timer->addDroppedFrames(header.seq - last_depth_seq_ - 1u);
     }
+    has_depth_seq_ = true;
+    last_depth_seq_ = header.seq;
+  }
+
+  // Publishes the statistics at the diagnostics rate at most, as computing
+  // the percentiles sorts all sample windows.
+  void publishDiagnostics(const depth_segmentation::StageTimer& stage_timer,
+                          const std_msgs::Header& header) {
+    {
+      const std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now();
+      const std::chrono::duration<double> period(
+          1.0 / params_.timing.diagnostics_rate);
+      std::lock_guard<std::mutex> lock(diagnostics_mutex_);
+      if (now - last_diagnostics_time_ < period) {
+        return;
+      }
+      last_diagnostics_time_ = now;
+    }
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = "depth_segmentation: timing";
+    status.message = "Stage wall times in milliseconds.";
+    auto add_value = [&status](const std::string& key,
+                               const std::string& value) {
+      diagnostic_msgs::KeyValue key_value;
+      key_value.key = key;
+      key_value.value = value;
+      status.values.push_back(key_value);
+    };
+    add_value("frames_processed",
+              std::to_string(stage_timer.getNumProcessedFrames()));
+    add_value("frames_dropped",
+              std::to_string(stage_timer.getNumDroppedFrames()));
+    for (size_t i = 0u; i < depth_segmentation::kNumStages; ++i) {
+      const depth_segmentation::Stage stage =
+          static_cast<depth_segmentation::Stage>(i);
+      const depth_segmentation::StageStatistics statistics =
+          stage_timer.getStatistics(stage);
+      if (statistics.num_samples == 0u) {
+        continue;
+      }
+      const std::string name = depth_segmentation::getStageName(stage);
+      add_value(name + "/last", std::to_string(statistics.last));
+      add_value(name + "/p50", std::to_string(statistics.p50));
+      add_value(name + "/p95", std::to_string(statistics.p95));
+      add_value(name + "/p99", std::to_string(statistics.p99));
+    }
+    diagnostic_msgs::DiagnosticArray diagnostics_msg;
+    diagnostics_msg.header.stamp = header.stamp;
+    diagnostics_msg.status.push_back(status);
+    diagnostics_pub_.publish(diagnostics_msg);
   }
 
 #ifdef MASKRCNNROS_AVAILABLE
@@ -340,9 +502,10 @@ class DepthSegmentationNode {
     semantic_instance_segmentation->labels.reserve(
         segmentation_msg->masks.size());
     for (size_t i = 0u; i < segmentation_msg->masks.size(); ++i) {
-      cv_bridge::CvImagePtr cv_mask_image;
-      cv_mask_image = cv_bridge::toCvCopy(segmentation_msg->masks[i],
-                                          sensor_msgs::image_encodings::MONO8);
+      // Shared if the mask already is mono8, the clone below owns the data.
+      cv_bridge::CvImageConstPtr cv_mask_image = cv_bridge::toCvShare(
+          segmentation_msg->masks[i], segmentation_msg,
+          sensor_msgs::image_encodings::MONO8);
       semantic_instance_segmentation->masks.push_back(
           cv_mask_image->image.clone());
       semantic_instance_segmentation->labels.push_back(
@@ -351,36 +514,29 @@ class DepthSegmentationNode {
   }
 #endif
 
+  // Shares the buffers of the messages instead of copying them. The rescaled
+  // depth is always a new image, as the depth camera keeps the previous one.
   void preprocess(const sensor_msgs::Image::ConstPtr& depth_msg,
                   const sensor_msgs::Image::ConstPtr& rgb_msg,
                   cv::Mat* rescaled_depth, cv::Mat* dilated_rescaled_depth,
-                  cv_bridge::CvImagePtr cv_rgb_image,
-                  cv_bridge::CvImagePtr cv_depth_image, cv::Mat* bw_image,
+                  const cv_bridge::CvImageConstPtr& cv_rgb_image,
+                  cv_bridge::CvImageConstPtr* cv_depth_image, cv::Mat* bw_image,
                   cv::Mat* mask) {
     CHECK_NOTNULL(rescaled_depth);
     CHECK_NOTNULL(dilated_rescaled_depth);
     CHECK(cv_rgb_image);
-    CHECK(cv_depth_image);
+    CHECK_NOTNULL(cv_depth_image);
     CHECK_NOTNULL(bw_image);
     CHECK_NOTNULL(mask);
 
-    if (depth_msg->encoding == sensor_msgs::image_encodings::TYPE_16UC1) {
-      cv_depth_image = cv_bridge::toCvCopy(
-          depth_msg, sensor_msgs::image_encodings::TYPE_16UC1);
-      *rescaled_depth = cv::Mat::zeros(cv_depth_image->image.size(), CV_32FC1);
-      cv::rgbd::rescaleDepth(cv_depth_image->image, CV_32FC1, *rescaled_depth);
-    } else if (depth_msg->encoding ==
-               sensor_msgs::image_encodings::TYPE_32FC1) {
-      cv_depth_image = cv_bridge::toCvCopy(
-          depth_msg, sensor_msgs::image_encodings::TYPE_32FC1);
-      *rescaled_depth = cv_depth_image->image;
-    } else {
+    if (depth_msg->encoding != sensor_msgs::image_encodings::TYPE_16UC1 &&
+        depth_msg->encoding != sensor_msgs::image_encodings::TYPE_32FC1) {
       LOG(FATAL) << "Unknown depth image encoding.";
     }
-
-    constexpr double kZeroValue = 0.0;
-    cv::Mat nan_mask = *rescaled_depth != *rescaled_depth;
-    rescaled_depth->setTo(kZeroValue, nan_mask);
+    *cv_depth_image = cv_bridge::toCvShare(depth_msg);
+    *rescaled_depth = cv::Mat((*cv_depth_image)->image.size(), CV_32FC1);
+    depth_segmentation::rescaleDepthImage((*cv_depth_image)->image,
+                                          rescaled_depth);
 
     if (params_.dilate_depth_image) {
       cv::Mat element = cv::getStructuringElement(
@@ -392,9 +548,11 @@ class DepthSegmentationNode {
       *dilated_rescaled_depth = *rescaled_depth;
     }
 
-    *bw_image = cv::Mat::zeros(cv_rgb_image->image.size(), CV_8UC1);
-
-    cvtColor(cv_rgb_image->image, *bw_image, cv::COLOR_RGB2GRAY);
+    if (rgb_msg->encoding == sensor_msgs::image_encodings::BGR8) {
+      cvtColor(cv_rgb_image->image, *bw_image, cv::COLOR_BGR2GRAY);
+    } else {
+      cvtColor(cv_rgb_image->image, *bw_image, cv::COLOR_RGB2GRAY);
+    }
 
     *mask = cv::Mat::zeros(bw_image->size(), CV_8UC1);
     mask->setTo(cv::Scalar(depth_segmentation::CameraTracker::kImageRange));
@@ -403,8 +561,9 @@ class DepthSegmentationNode {
   void computeEdgeMap(const sensor_msgs::Image::ConstPtr& depth_msg,
                       const sensor_msgs::Image::ConstPtr& rgb_msg,
                       cv::Mat& rescaled_depth,
-                      cv_bridge::CvImagePtr cv_rgb_image,
-                      cv_bridge::CvImagePtr cv_depth_image, cv::Mat& bw_image,
+                      const cv_bridge::CvImageConstPtr& cv_rgb_image,
+                      const cv_bridge::CvImageConstPtr& cv_depth_image,
+                      cv::Mat& bw_image,
                       cv::Mat& mask, cv::Mat* depth_map, cv::Mat* normal_map,
                       cv::Mat* edge_map) {
 #ifdef WRITE_IMAGES
@@ -436,100 +595,201 @@ class DepthSegmentationNode {
       }
     }
 
-    *depth_map = cv::Mat::zeros(depth_camera_.getWidth(),
-                                depth_camera_.getHeight(), CV_32FC3);
-    depth_segmenter_.computeDepthMap(rescaled_depth, depth_map);
+    depth_segmenter_.computeGeometricMaps(rescaled_depth,
+                                          cv_depth_image->image, depth_map,
+                                          normal_map, edge_map);
+  }
 
-    // Compute normal map.
-    *normal_map = cv::Mat::zeros(depth_map->size(), CV_32FC3);
+  // Decodes the images and computes the edge map of the frame. Returns false
+  // if the frame is skipped as the tracker has no reference images yet.
+  bool computeFrameEdgeMap(Frame* frame) {
+    CHECK_NOTNULL(frame);
+    const sensor_msgs::Image::ConstPtr& depth_msg = frame->depth_msg;
+    const sensor_msgs::Image::ConstPtr& rgb_msg = frame->rgb_msg;
+    frame->cv_rgb_image = cv_bridge::toCvShare(rgb_msg);
+    frame->bgr_input = rgb_msg->encoding == sensor_msgs::image_encodings::BGR8;
+
+    cv_bridge::CvImageConstPtr cv_depth_image;
+    cv::Mat dilated_rescaled_depth, bw_image, mask;
+    preprocess(depth_msg, rgb_msg, &frame->rescaled_depth,
+               &dilated_rescaled_depth, frame->cv_rgb_image, &cv_depth_image,
+               &bw_image, &mask);
+    const bool has_tracker_images = !camera_tracker_.getRgbImage().empty() &&
+                                    !camera_tracker_.getDepthImage().empty();
+    const bool is_tracker_ready =
+        has_tracker_images || !depth_segmentation::kUseTracker;
+    if (is_tracker_ready) {
+      computeEdgeMap(depth_msg, rgb_msg, dilated_rescaled_depth,
+                     frame->cv_rgb_image, cv_depth_image, bw_image, mask,
+                     &frame->depth_map, &frame->normal_map, &frame->edge_map);
+
+      // Remove the edges at invalid depths in place, such that the edge map
+      // of a recycled frame keeps its buffer.
+      frame->edge_map.setTo(cv::Scalar(0),
+                            dilated_rescaled_depth != dilated_rescaled_depth);
+    }
+
+    // Update the member images to the new images.
+    // TODO(ff): Consider only doing this, when we are far enough away
+    // from a frame. (Which basically means we would set a keyframe.)
+    depth_camera_.setImage(frame->rescaled_depth);
+    depth_camera_.setMask(mask);
+    rgb_camera_.setImage(bw_image);
+    return is_tracker_ready;
+  }
 
-    if (params_.normals.method ==
-            depth_segmentation::SurfaceNormalEstimationMethod::kFals ||
-        params_.normals.method ==
-            depth_segmentation::SurfaceNormalEstimationMethod::kSri ||
-        params_.normals.method ==
-            depth_segmentation::SurfaceNormalEstimationMethod::
-                kDepthWindowFilter) {
-      depth_segmenter_.computeNormalMap(*depth_map, normal_map);
-    } else if (params_.normals.method ==
-               depth_segmentation::SurfaceNormalEstimationMethod::kLinemod) {
-      depth_segmenter_.computeNormalMap(cv_depth_image->image, normal_map);
+  void labelFrame(Frame* frame) {
+    CHECK_NOTNULL(frame);
+    if (params_.output_label_image) {
+      depth_segmenter_.labelImage(frame->rescaled_depth, frame->depth_map,
+                                  frame->edge_map, frame->normal_map,
+                                  &frame->label_image, &frame->descriptors);
+      return;
     }
+    cv::Mat label_map(frame->edge_map.size(), CV_32FC1);
+    std::vector<depth_segmentation::SegmentMask> segment_masks;
+    depth_segmenter_.labelMap(frame->cv_rgb_image->image, frame->bgr_input,
+                              frame->rescaled_depth, frame->depth_map,
+                              frame->edge_map, frame->normal_map, &label_map,
+                              &segment_masks, &frame->segments);
+  }
 
-    // Compute depth discontinuity map.
-    cv::Mat discontinuity_map = cv::Mat::zeros(
-        depth_camera_.getWidth(), depth_camera_.getHeight(), CV_32FC1);
-    if (params_.depth_discontinuity.use_discontinuity) {
-      depth_segmenter_.computeDepthDiscontinuityMap(rescaled_depth,
-                                                    &discontinuity_map);
+  void publishFrame(const Frame& frame) {
+    if (params_.output_label_image) {
+      publish_label_image(frame.label_image, frame.descriptors,
+                          frame.depth_msg->header);
+    } else if (frame.segments.size() > 0u) {
+      publish_segments(frame.segments, frame.depth_msg->header);
     }
+    countFrame(true, frame.depth_msg->header);
+  }
 
-    // Compute maximum distance map.
-    cv::Mat distance_map = cv::Mat::zeros(depth_camera_.getWidth(),
-                                          depth_camera_.getHeight(), CV_32FC1);
-    if (params_.max_distance.use_max_distance) {
-      depth_segmenter_.computeMaxDistanceMap(*depth_map, &distance_map);
+  void imageCallback(const sensor_msgs::Image::ConstPtr& depth_msg,
+                     const sensor_msgs::Image::ConstPtr& rgb_msg) {
+    countMissedFrames(depth_msg->header);
+    if (!camera_info_ready_) {
+      countFrame(false, depth_msg->header);
+      return;
+    }
+    if (use_pipeline_) {
+      queueFrame(depth_msg, rgb_msg);
+      return;
     }
 
-    // Compute minimum convexity map.
-    cv::Mat convexity_map = cv::Mat::zeros(depth_camera_.getWidth(),
-                                           depth_camera_.getHeight(), CV_32FC1);
-    if (params_.min_convexity.use_min_convexity) {
-      depth_segmenter_.computeMinConvexityMap(*depth_map, *normal_map,
-                                              &convexity_map);
+    depth_segmentation::ScopedStageTimer frame_timer(
+        depth_segmentation::Stage::kFrame,
+        depth_segmenter_.getActiveStageTimer());
+    frame_.depth_msg = depth_msg;
+    frame_.rgb_msg = rgb_msg;
+    if (computeFrameEdgeMap(&frame_)) {
+      labelFrame(&frame_);
+      publishFrame(frame_);
+    } else {
+      countFrame(false, depth_msg->header);
     }
+  }
 
-    // Compute final edge map.
-    *edge_map = cv::Mat::zeros(depth_camera_.getWidth(),
-                               depth_camera_.getHeight(), CV_32FC1);
-    depth_segmenter_.computeFinalEdgeMap(convexity_map, distance_map,
-                                         discontinuity_map, edge_map);
+  void startPipeline(const size_t queue_size) {
+    geometry_queue_.reset(new FrameQueue(queue_size));
+    label_queue_.reset(new FrameQueue(queue_size));
+    publish_queue_.reset(new FrameQueue(queue_size));
+    // Enough frames for all queues and the ones in flight in the stages.
+    recycled_frames_.reset(new FrameQueue(4u * queue_size + 3u));
+    pipeline_running_ = true;
+    pipeline_threads_.emplace_back(&DepthSegmentationNode::runGeometryStage,
+                                   this);
+    pipeline_threads_.emplace_back(&DepthSegmentationNode::runLabelStage, this);
+    pipeline_threads_.emplace_back(&DepthSegmentationNode::runPublishStage,
+                                   this);
   }
 
-  void imageCallback(const sensor_msgs::Image::ConstPtr& depth_msg,
-                     const sensor_msgs::Image::ConstPtr& rgb_msg) {
-    if (camera_info_ready_) {
-      cv_bridge::CvImagePtr cv_rgb_image(new cv_bridge::CvImage);
-      cv_rgb_image = cv_bridge::toCvCopy(rgb_msg, rgb_msg->encoding);
-      if (rgb_msg->encoding == sensor_msgs::image_encodings::BGR8) {
-        cv::cvtColor(cv_rgb_image->image, cv_rgb_image->image, CV_BGR2RGB);
-      }
+  // Lets the stages drain their queues and waits for them to finish.
+  void stopPipeline() {
+    pipeline_running_ = false;
+    for (std::thread& thread : pipeline_threads_) {
+      thread.join();
+    }
+    pipeline_threads_.clear();
+  }
 
-      cv_bridge::CvImagePtr cv_depth_image(new cv_bridge::CvImage);
-      cv::Mat rescaled_depth, dilated_rescaled_depth, bw_image, mask, depth_map,
-          normal_map, edge_map;
-      preprocess(depth_msg, rgb_msg, &rescaled_depth, &dilated_rescaled_depth,
-                 cv_rgb_image, cv_depth_image, &bw_image, &mask);
-      if (!camera_tracker_.getRgbImage().empty() &&
-              !camera_tracker_.getDepthImage().empty() ||
-          !depth_segmentation::kUseTracker) {
-        computeEdgeMap(depth_msg, rgb_msg, dilated_rescaled_depth, cv_rgb_image,
-                       cv_depth_image, bw_image, mask, &depth_map, &normal_map,
-                       &edge_map);
+  void queueFrame(const sensor_msgs::Image::ConstPtr& depth_msg,
+                  const sensor_msgs::Image::ConstPtr& rgb_msg) {
+    FramePtr frame;
+    if (!recycled_frames_->tryPop(&frame)) {
+      frame.reset(new Frame);
+    }
+    frame->depth_msg = depth_msg;
+    frame->rgb_msg = rgb_msg;
+    frame->arrival_time = std::chrono::steady_clock::now();
+    pushFrame(&frame, geometry_queue_.get());
+  }
 
-        cv::Mat label_map(edge_map.size(), CV_32FC1);
-        cv::Mat remove_no_values =
-            cv::Mat::zeros(edge_map.size(), edge_map.type());
-        edge_map.copyTo(remove_no_values,
-                        dilated_rescaled_depth == dilated_rescaled_depth);
-        edge_map = remove_no_values;
-        std::vector<depth_segmentation::Segment> segments;
-        std::vector<cv::Mat> segment_masks;
+  // Pushes the frame according to the queue policy and counts every frame
+  // that had to be dropped for it as such. Dropped frames are recycled.
+  void pushFrame(FramePtr* frame, FrameQueue* queue) {
+    CHECK_NOTNULL(frame);
+    CHECK_NOTNULL(queue);
+    const std_msgs::Header header = (*frame)->depth_msg->header;
+    const size_t num_dropped = depth_segmentation::pushWithPolicy(
+        pipeline_policy_, pipeline_running_, frame, queue,
+        recycled_frames_.get());
+    if (*frame) {
+      // The pipeline stopped while waiting for room.
+      recycled_frames_->tryPush(frame);
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(params_mutex_);
+    for (size_t i = 0u; i < num_dropped; ++i) {
+      countFrame(false, header);
+    }
+  }
 
-        depth_segmenter_.labelMap(cv_rgb_image->image, rescaled_depth,
-                                  depth_map, edge_map, normal_map, &label_map,
-                                  &segment_masks, &segments);
+  void runGeometryStage() {
+    FramePtr frame;
+    while (depth_segmentation::waitAndPop(pipeline_running_, &frame,
+                                          geometry_queue_.get())) {
+      // The lock is not held while pushing, which may wait for the next
+      // stage.
+      std::shared_lock<std::shared_timed_mutex> lock(params_mutex_);
+      if (computeFrameEdgeMap(frame.get())) {
+        lock.unlock();
+        pushFrame(&frame, label_queue_.get());
+      } else {
+        countFrame(false, frame->depth_msg->header);
+        lock.unlock();
+        recycled_frames_->tryPush(&frame);
+      }
+    }
+  }
 
-        if (segments.size() > 0u) {
-          publish_segments(segments, depth_msg->header);
-        }
+  void runLabelStage() {
+    FramePtr frame;
+    while (depth_segmentation::waitAndPop(pipeline_running_, &frame,
+                                          label_queue_.get())) {
+      {
+        std::shared_lock<std::shared_timed_mutex> lock(params_mutex_);
+        labelFrame(frame.get());
       }
-      // Update the member images to the new images.
-      // TODO(ff): Consider only doing this, when we are far enough away
-      // from a frame. (Which basically means we would set a keyframe.)
-      depth_camera_.setImage(rescaled_depth);
-      depth_camera_.setMask(mask);
-      rgb_camera_.setImage(bw_image);
+      pushFrame(&frame, publish_queue_.get());
+    }
+  }
+
+  void runPublishStage() {
+    FramePtr frame;
+    while (depth_segmentation::waitAndPop(pipeline_running_, &frame,
+                                          publish_queue_.get())) {
+      std::shared_lock<std::shared_timed_mutex> lock(params_mutex_);
+      publishFrame(*frame);
+      // The frame time of the pipeline is the latency from arrival to
+      // publishing, including the time spent waiting in the queues.
+      depth_segmentation::StageTimer* stage_timer =
+          depth_segmenter_.getActiveStageTimer();
+      if (stage_timer != nullptr) {
+        const std::chrono::duration<double, std::milli> latency =
+            std::chrono::steady_clock::now() - frame->arrival_time;
+        stage_timer->addSample(depth_segmentation::Stage::kFrame,
+                               latency.count());
+      }
+      recycled_frames_->tryPush(&frame);
     }
   }
 
@@ -538,22 +798,24 @@ class DepthSegmentationNode {
       const sensor_msgs::Image::ConstPtr& depth_msg,
       const sensor_msgs::Image::ConstPtr& rgb_msg,
       const mask_rcnn_ros::Result::ConstPtr& segmentation_msg) {
+    countMissedFrames(depth_msg->header);
     depth_segmentation::SemanticInstanceSegmentation instance_segmentation;
     semanticInstanceSegmentationFromRosMsg(segmentation_msg,
                                            &instance_segmentation);
 
+    depth_segmentation::ScopedStageTimer frame_timer(
+        depth_segmentation::Stage::kFrame,
+        depth_segmenter_.getActiveStageTimer());
     if (camera_info_ready_) {
-      cv_bridge::CvImagePtr cv_rgb_image(new cv_bridge::CvImage);
-      cv_rgb_image = cv_bridge::toCvCopy(rgb_msg, rgb_msg->encoding);
-      if (rgb_msg->encoding == sensor_msgs::image_encodings::BGR8) {
-        cv::cvtColor(cv_rgb_image->image, cv_rgb_image->image, CV_BGR2RGB);
-      }
+      cv_bridge::CvImageConstPtr cv_rgb_image = cv_bridge::toCvShare(rgb_msg);
+      const bool bgr_input =
+          rgb_msg->encoding == sensor_msgs::image_encodings::BGR8;
 
-      cv_bridge::CvImagePtr cv_depth_image(new cv_bridge::CvImage);
+      cv_bridge::CvImageConstPtr cv_depth_image;
       cv::Mat rescaled_depth, dilated_rescaled_depth, bw_image, mask, depth_map,
           normal_map, edge_map;
       preprocess(depth_msg, rgb_msg, &rescaled_depth, &dilated_rescaled_depth,
-                 cv_rgb_image, cv_depth_image, &bw_image, &mask);
+                 cv_rgb_image, &cv_depth_image, &bw_image, &mask);
       if (!camera_tracker_.getRgbImage().empty() &&
               !camera_tracker_.getDepthImage().empty() ||
           !depth_segmentation::kUseTracker) {
@@ -567,17 +829,25 @@ class DepthSegmentationNode {
         edge_map.copyTo(remove_no_values,
                         dilated_rescaled_depth == dilated_rescaled_depth);
         edge_map = remove_no_values;
-        std::vector<depth_segmentation::Segment> segments;
-        std::vector<cv::Mat> segment_masks;
-
-        depth_segmenter_.labelMap(cv_rgb_image->image, rescaled_depth,
-                                  instance_segmentation, depth_map, edge_map,
-                                  normal_map, &label_map, &segment_masks,
-                                  &segments);
-
-        if (segments.size() > 0u) {
-          publish_segments(segments, depth_msg->header);
+        if (params_.output_label_image) {
+          depth_segmenter_.labelImage(rescaled_depth, instance_segmentation,
+                                      depth_map, edge_map, normal_map,
+                                      &frame_.label_image, &frame_.descriptors);
+          publish_label_image(frame_.label_image, frame_.descriptors,
+                              depth_msg->header);
+        } else {
+          std::vector<depth_segmentation::SegmentMask> segment_masks;
+          depth_segmenter_.labelMap(cv_rgb_image->image, bgr_input,
+                                    rescaled_depth, instance_segmentation,
+                                    depth_map, edge_map, normal_map,
+                                    &label_map, &segment_masks, &segments_);
+          if (segments_.size() > 0u) {
+            publish_segments(segments_, depth_msg->header);
+          }
         }
+        countFrame(true, depth_msg->header);
+      } else {
+        countFrame(false, depth_msg->header);
       }
 
       // Update the member images to the new images.
@@ -586,6 +856,8 @@ class DepthSegmentationNode {
       depth_camera_.setImage(rescaled_depth);
       depth_camera_.setMask(mask);
       rgb_camera_.setImage(bw_image);
+    } else {
+      countFrame(false, depth_msg->header);
     }
   }
 #endif
@@ -608,7 +880,7 @@ class DepthSegmentationNode {
     K_depth.at<float>(1, 2) = depth_info.K[5];
     K_depth.at<float>(2, 2) = depth_info.K[8];
 
-    depth_camera_.initialize(depth_image_size.x(), depth_image_size.y(),
+    depth_camera_.initialize(depth_image_size.y(), depth_image_size.x(),
                              CV_32FC1, K_depth);
 
     sensor_msgs::CameraInfo rgb_info;
@@ -622,7 +894,7 @@ class DepthSegmentationNode {
     K_rgb.at<float>(1, 2) = rgb_info.K[5];
     K_rgb.at<float>(2, 2) = rgb_info.K[8];
 
-    rgb_camera_.initialize(rgb_image_size.x(), rgb_image_size.y(), CV_8UC1,
+    rgb_camera_.initialize(rgb_image_size.y(), rgb_image_size.x(), CV_8UC1,
                            K_rgb);
 
     depth_segmenter_.initialize();
@@ -648,8 +920,8 @@ int main(int argc, char** argv) {
       CallbackType dynamic_reconfigure_function;
 
   dynamic_reconfigure_function = boost::bind(
-      &depth_segmentation::DepthSegmenter::dynamicReconfigureCallback,
-      &depth_segmentation_node.depth_segmenter_, _1, _2);
+      &DepthSegmentationNode::dynamicReconfigureCallback,
+      &depth_segmentation_node, _1, _2);
   reconfigure_server.setCallback(dynamic_reconfigure_function);
 
   while (ros::ok()) {
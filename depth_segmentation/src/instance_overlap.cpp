@@ -0,0 +1,99 @@
+#include "depth_segmentation/instance_overlap.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <glog/logging.h>
+
+#include "depth_segmentation/common.h"
+
+namespace depth_segmentation {
+
+void InstanceOverlap::reset(const size_t num_segments,
+                            const size_t num_instances) {
+  CHECK_LT(num_instances, kSharedInstanceId)
+      << "Too many instances for 16 bit instance ids.";
+  this->num_segments = num_segments;
+  num_instance_ids = num_instances + 1u;
+  counts.assign(num_segments * num_instance_ids, 0u);
+}
+
+size_t InstanceOverlap::assignInstance(const size_t segment,
+                                       const size_t segment_size,
+                                       const float overlap_threshold) const {
+  CHECK_LT(segment, num_segments);
+  CHECK_GT(segment_size, 0u);
+  size_t instance_label = kUnassignedLabel;
+  size_t max_overlap_size = 0u;
+  for (size_t instance_id = 1u; instance_id < num_instance_ids;
+       ++instance_id) {
+    const size_t overlap_size = count(segment, instance_id);
+    const float normalized_overlap =
+        static_cast<float>(overlap_size) / segment_size;
+    if (overlap_size > max_overlap_size &&
+        normalized_overlap > overlap_threshold) {
+      instance_label = instance_id;
+      max_overlap_size = overlap_size;
+    }
+  }
+  return instance_label;
+}
+
+void InstanceOverlap::addSharedPixel(const size_t segment,
+                                     const InstanceIdImage& instance_ids,
+                                     const int index) {
+  const std::vector<InstanceIdImage::SharedPixel>& shared_pixels =
+      instance_ids.shared_pixels;
+  auto shared_pixel = std::lower_bound(
+      shared_pixels.begin(), shared_pixels.end(), index,
+      [](const InstanceIdImage::SharedPixel& pixel, const int index) {
+        return pixel.index < index;
+      });
+  CHECK(shared_pixel != shared_pixels.end() && shared_pixel->index == index);
+  for (; shared_pixel != shared_pixels.end() && shared_pixel->index == index;
+       ++shared_pixel) {
+    add(segment, shared_pixel->instance_id);
+  }
+}
+
+void InstanceIdImage::compute(const std::vector<cv::Mat>& masks,
+                              const cv::Size& image_size) {
+  CHECK_LT(masks.size(), kSharedInstanceId)
+      << "Too many instances for 16 bit instance ids.";
+  ids.create(image_size, CV_16UC1);
+  ids.setTo(cv::Scalar(0));
+  shared_pixels.clear();
+  for (size_t j = 0u; j < masks.size(); ++j) {
+    CHECK_EQ(masks[j].type(), CV_8UC1);
+    CHECK_EQ(masks[j].size(), image_size);
+    const uint16_t instance_id = j + 1u;
+    for (int y = 0; y < image_size.height; ++y) {
+      const uint8_t* mask_row = masks[j].ptr<uint8_t>(y);
+      uint16_t* id_row = ids.ptr<uint16_t>(y);
+      for (int x = 0; x < image_size.width; ++x) {
+        if (mask_row[x] == 0u) {
+          continue;
+        }
+        uint16_t& id = id_row[x];
+        if (id == 0u) {
+          id = instance_id;
+          continue;
+        }
+        // The pixel is covered by several masks, which are listed instead.
+        const int index = y * image_size.width + x;
+        if (id != kSharedInstanceId) {
+          shared_pixels.push_back({index, id});
+          id = kSharedInstanceId;
+        }
+        shared_pixels.push_back({index, instance_id});
+      }
+    }
+  }
+  std::sort(shared_pixels.begin(), shared_pixels.end(),
+            [](const SharedPixel& a, const SharedPixel& b) {
+              return a.index < b.index ||
+                     (a.index == b.index && a.instance_id < b.instance_id);
+            });
+}
+
+}  // namespace depth_segmentation
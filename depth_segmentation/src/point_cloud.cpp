@@ -0,0 +1,129 @@
+#include "depth_segmentation/point_cloud.h"
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include <glog/logging.h>
+
+namespace depth_segmentation {
+
+namespace {
+
+constexpr size_t kPointOffset = 0u;
+constexpr size_t kNormalOffset = 12u;
+constexpr size_t kColorOffset = 24u;
+constexpr size_t kInstanceLabelOffset = 28u;
+constexpr size_t kSemanticLabelOffset = 29u;
+constexpr size_t kSegmentIdOffset = 30u;
+
+void addField(const std::string& name, const size_t offset,
+              const uint8_t datatype, sensor_msgs::PointCloud2* cloud) {
+  sensor_msgs::PointField field;
+  field.name = name;
+  field.offset = offset;
+  field.datatype = datatype;
+  field.count = 1u;
+  cloud->fields.push_back(field);
+}
+
+// Same field names and types as pcl::PointSurfel and the labelled surfels
+// previously published by the node, such that subscribers are unaffected.
+void setFields(const bool with_labels, const bool with_segment_ids,
+               sensor_msgs::PointCloud2* cloud) {
+  cloud->fields.clear();
+  addField("x", kPointOffset, sensor_msgs::PointField::FLOAT32, cloud);
+  addField("y", kPointOffset + 4u, sensor_msgs::PointField::FLOAT32, cloud);
+  addField("z", kPointOffset + 8u, sensor_msgs::PointField::FLOAT32, cloud);
+  addField("normal_x", kNormalOffset, sensor_msgs::PointField::FLOAT32, cloud);
+  addField("normal_y", kNormalOffset + 4u, sensor_msgs::PointField::FLOAT32,
+           cloud);
+  addField("normal_z", kNormalOffset + 8u, sensor_msgs::PointField::FLOAT32,
+           cloud);
+  if (with_labels) {
+    addField("rgb", kColorOffset, sensor_msgs::PointField::FLOAT32, cloud);
+    addField("instance_label", kInstanceLabelOffset,
+             sensor_msgs::PointField::UINT8, cloud);
+    addField("semantic_label", kSemanticLabelOffset,
+             sensor_msgs::PointField::UINT8, cloud);
+  } else {
+    addField("rgba", kColorOffset, sensor_msgs::PointField::UINT32, cloud);
+  }
+  if (with_segment_ids) {
+    addField("segment_id", kSegmentIdOffset, sensor_msgs::PointField::UINT16,
+             cloud);
+  }
+}
+
+void setLayout(const size_t num_points, sensor_msgs::PointCloud2* cloud) {
+  cloud->height = 1u;
+  cloud->width = num_points;
+  cloud->is_bigendian = false;
+  cloud->point_step = kPointCloud2PointStep;
+  cloud->row_step = kPointCloud2PointStep * num_points;
+  cloud->is_dense = true;
+  cloud->data.resize(cloud->row_step);
+}
+
+}  // namespace
+
+void segmentsToPointCloud2(const SegmentTable& segments,
+                           const bool with_labels,
+                           const bool with_segment_ids,
+                           sensor_msgs::PointCloud2* cloud) {
+  CHECK_NOTNULL(cloud);
+  CHECK_EQ(segments.points.size(), segments.normals.size());
+  CHECK_EQ(segments.points.size(), segments.original_colors.size());
+  if (with_segment_ids) {
+    CHECK_LE(segments.size(), std::numeric_limits<uint16_t>::max() + 1u)
+        << "Too many segments for 16 bit segment ids.";
+  }
+  setFields(with_labels, with_segment_ids, cloud);
+  setLayout(segments.points.size(), cloud);
+
+  uint8_t* data = cloud->data.data();
+#pragma omp parallel for
+  for (size_t s = 0u; s < segments.size(); ++s) {
+    const uint8_t instance_label = segments.instance_labels[s];
+    const uint8_t semantic_label = segments.semantic_labels[s];
+    const uint16_t segment_id = with_segment_ids ? s : 0u;
+    const size_t end = segments.offsets[s] + segments.sizes[s];
+    for (size_t i = segments.offsets[s]; i < end; ++i) {
+      uint8_t* point = data + i * kPointCloud2PointStep;
+      std::memcpy(point + kPointOffset, segments.points[i].val,
+                  3u * sizeof(float));
+      std::memcpy(point + kNormalOffset, segments.normals[i].val,
+                  3u * sizeof(float));
+      const cv::Vec3f& color = segments.original_colors[i];
+      // Packed like PCL, alpha in the highest byte.
+      const uint32_t rgba = static_cast<uint32_t>(255u) << 24u |
+                            static_cast<uint32_t>(color[0]) << 16u |
+                            static_cast<uint32_t>(color[1]) << 8u |
+                            static_cast<uint32_t>(color[2]);
+      std::memcpy(point + kColorOffset, &rgba, sizeof(rgba));
+      point[kInstanceLabelOffset] = with_labels ? instance_label : 0u;
+      point[kSemanticLabelOffset] = with_labels ? semantic_label : 0u;
+      std::memcpy(point + kSegmentIdOffset, &segment_id, sizeof(segment_id));
+    }
+  }
+}
+
+void extractSegmentPointCloud2(const SegmentTable& segments,
+                               const size_t segment_index,
+                               const sensor_msgs::PointCloud2& scene_cloud,
+                               sensor_msgs::PointCloud2* segment_cloud) {
+  CHECK_NOTNULL(segment_cloud);
+  CHECK_LT(segment_index, segments.size());
+  CHECK_EQ(scene_cloud.point_step, kPointCloud2PointStep);
+  CHECK_EQ(scene_cloud.width, segments.points.size());
+  segment_cloud->header = scene_cloud.header;
+  segment_cloud->fields = scene_cloud.fields;
+  setLayout(segments.sizes[segment_index], segment_cloud);
+  std::memcpy(segment_cloud->data.data(),
+              scene_cloud.data.data() +
+                  segments.offsets[segment_index] * kPointCloud2PointStep,
+              segment_cloud->row_step);
+}
+
+}  // namespace depth_segmentation
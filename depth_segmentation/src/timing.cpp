@@ -0,0 +1,142 @@
+#include "depth_segmentation/timing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+
+#include <glog/logging.h>
+
+namespace depth_segmentation {
+
+std::string getStageName(const Stage stage) {
+  switch (stage) {
+    case Stage::kDepthMap:
+      return "depth_map";
+    case Stage::kNormalMap:
+      return "normal_map";
+    case Stage::kDepthDiscontinuityMap:
+      return "depth_discontinuity_map";
+    case Stage::kMaxDistanceMap:
+      return "max_distance_map";
+    case Stage::kMinConvexityMap:
+      return "min_convexity_map";
+    case Stage::kFinalEdgeMap:
+      return "final_edge_map";
+    case Stage::kLabelMap:
+      return "label_map";
+    case Stage::kPublish:
+      return "publish";
+    case Stage::kFrame:
+      return "frame";
+    case Stage::kNumStages:
+      break;
+  }
+  LOG(FATAL) << "Unknown stage.";
+  return "";
+}
+
+StageTimer::StageTimer(const size_t window_size)
+    : window_size_(window_size),
+      num_processed_frames_(0u),
+      num_dropped_frames_(0u) {
+  CHECK_GT(window_size_, 0u);
+}
+
+void StageTimer::addSample(const Stage stage, const double milliseconds) {
+  const size_t index = static_cast<size_t>(stage);
+  CHECK_LT(index, kNumStages);
+  std::lock_guard<std::mutex> lock(mutex_);
+  RollingWindow& window = windows_[index];
+  if (window.samples.size() < window_size_) {
+    window.samples.push_back(milliseconds);
+  } else {
+    window.samples[window.next] = milliseconds;
+  }
+  window.next = (window.next + 1u) % window_size_;
+  window.last = milliseconds;
+}
+
+void StageTimer::addProcessedFrame() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++num_processed_frames_;
+}
+
+void StageTimer::addDroppedFrame() { addDroppedFrames(1u); }
+
+void StageTimer::addDroppedFrames(const size_t num_frames) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  num_dropped_frames_ += num_frames;
+}
+
+void StageTimer::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (RollingWindow& window : windows_) {
+    window = RollingWindow();
+  }
+  num_processed_frames_ = 0u;
+  num_dropped_frames_ = 0u;
+}
+
+StageStatistics StageTimer::getStatistics(const Stage stage) const {
+  const size_t index = static_cast<size_t>(stage);
+  CHECK_LT(index, kNumStages);
+  std::vector<double> samples;
+  StageStatistics statistics;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples = windows_[index].samples;
+    statistics.last = windows_[index].last;
+  }
+  statistics.num_samples = samples.size();
+  if (samples.empty()) {
+    return statistics;
+  }
+  statistics.mean = std::accumulate(samples.begin(), samples.end(), 0.0) /
+                    static_cast<double>(samples.size());
+  std::sort(samples.begin(), samples.end());
+  // Nearest rank percentiles.
+  auto percentile = [&samples](const double fraction) {
+    const size_t rank = static_cast<size_t>(
+        std::ceil(fraction * static_cast<double>(samples.size())));
+    return samples[std::max<size_t>(rank, 1u) - 1u];
+  };
+  statistics.p50 = percentile(0.50);
+  statistics.p95 = percentile(0.95);
+  statistics.p99 = percentile(0.99);
+  statistics.max = samples.back();
+  return statistics;
+}
+
+size_t StageTimer::getNumProcessedFrames() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_processed_frames_;
+}
+
+size_t StageTimer::getNumDroppedFrames() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_dropped_frames_;
+}
+
+std::string StageTimer::print() const {
+  std::stringstream stream;
+  stream << std::fixed << std::setprecision(3);
+  stream << "frames processed: " << getNumProcessedFrames()
+         << ", dropped: " << getNumDroppedFrames() << "\n";
+  for (size_t i = 0u; i < kNumStages; ++i) {
+    const Stage stage = static_cast<Stage>(i);
+    const StageStatistics statistics = getStatistics(stage);
+    if (statistics.num_samples == 0u) {
+      continue;
+    }
+    stream << std::left << std::setw(25) << getStageName(stage)
+           << " n: " << statistics.num_samples
+           << " mean: " << statistics.mean << " p50: " << statistics.p50
+           << " p95: " << statistics.p95 << " p99: " << statistics.p99
+           << " max: " << statistics.max << " [ms]\n";
+  }
+  return stream.str();
+}
+
+}  // namespace depth_segmentation
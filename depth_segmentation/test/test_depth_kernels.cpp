@@ -0,0 +1,135 @@
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "depth_segmentation/common.h"
+#include "depth_segmentation/depth_kernels.h"
+#include "depth_segmentation/depth_segmentation.h"
+#include "depth_segmentation/testing_entrypoint.h"
+#include "depth_segmentation/testing_fixtures.h"
+
+namespace depth_segmentation {
+
+class DepthKernelsTest : public ::testing::Test {
+ protected:
+  DepthKernelsTest()
+      : depth_camera_(), params_(), depth_segmenter_(depth_camera_, params_) {
+    camera_matrix_ = makeTestCameraMatrix();
+    depth_camera_.initialize(480u, 640u, CV_32FC1, camera_matrix_);
+    depth_segmenter_.initialize();
+
+    // A plane with a box in front of it, with noise and invalid depths. The
+    // width is not a multiple of the vector width on purpose.
+    depth_image_ = makePlaneWithBoxDepthImage(cv::Size(637, 480));
+    cv::Mat noise(depth_image_.size(), CV_32FC1);
+    cv::randn(noise, 0.0, 0.01);
+    depth_image_ += noise;
+    depth_image_(cv::Rect(50, 60, 7, 5)).setTo(cv::Scalar(0.0f));
+    depth_image_(cv::Rect(500, 300, 3, 9))
+        .setTo(cv::Scalar(std::numeric_limits<float>::quiet_NaN()));
+  }
+  virtual ~DepthKernelsTest() {}
+  virtual void SetUp() {}
+
+  std::vector<SimdLevel> getSimdLevels() const {
+    std::vector<SimdLevel> levels = {SimdLevel::kScalar};
+    if (getSimdLevel() != SimdLevel::kScalar) {
+      levels.push_back(getSimdLevel());
+    }
+    return levels;
+  }
+
+  cv::Mat camera_matrix_;
+  cv::Mat depth_image_;
+  Params params_;
+  DepthCamera depth_camera_;
+  DepthSegmenter depth_segmenter_;
+};
+
+// Expects equal points up to the tolerance, where NaN equals NaN.
+void expectEqualPoints(const cv::Mat& expected, const cv::Mat& actual,
+                       const float tolerance) {
+  ASSERT_EQ(expected.size(), actual.size());
+  ASSERT_EQ(actual.type(), CV_32FC3);
+  size_t num_mismatches = 0u;
+  for (int y = 0; y < expected.rows; ++y) {
+    for (int x = 0; x < expected.cols; ++x) {
+      const cv::Vec3f& a = expected.at<cv::Vec3f>(y, x);
+      const cv::Vec3f& b = actual.at<cv::Vec3f>(y, x);
+      for (int i = 0; i < 3; ++i) {
+        if (!(std::abs(a[i] - b[i]) <= tolerance) &&
+            !(std::isnan(a[i]) && std::isnan(b[i]))) {
+          ++num_mismatches;
+        }
+      }
+    }
+  }
+  EXPECT_EQ(num_mismatches, 0u);
+}
+
+TEST_F(DepthKernelsTest, testBackProjectDepth) {
+  const cv::Mat& depth_image = depth_image_;
+  RayTable rays;
+  rays.compute(camera_matrix_, cv::Size(640, 480));
+  EXPECT_EQ(rays.size(), cv::Size(640, 480));
+  cv::Mat expected_depth_map;
+  cv::rgbd::depthTo3d(depth_image, camera_matrix_, expected_depth_map);
+  for (const SimdLevel level : getSimdLevels()) {
+    SCOPED_TRACE(getSimdLevelName(level));
+    cv::Mat depth_map;
+    backProjectDepth(depth_image, rays, cv::Point(0, 0), &depth_map, level);
+    expectEqualPoints(expected_depth_map, depth_map, 1.0e-6f);
+  }
+
+  // A crop uses the rays of its pixels in the full image.
+  const cv::Rect crop(13, 21, 101, 37);
+  cv::Mat expected_crop_depth_map;
+  backProjectDepth(depth_image, rays, cv::Point(0, 0), &expected_crop_depth_map,
+                   SimdLevel::kScalar);
+  for (const SimdLevel level : getSimdLevels()) {
+    SCOPED_TRACE(getSimdLevelName(level));
+    cv::Mat crop_depth_map;
+    backProjectDepth(depth_image(crop).clone(), rays, crop.tl(),
+                     &crop_depth_map, level);
+    expectEqualPoints(expected_crop_depth_map(crop), crop_depth_map, 0.0f);
+  }
+}
+
+TEST_F(DepthKernelsTest, testDepthDiscontinuityMap) {
+  for (const size_t kernel_size : {1u, 3u, 5u, 7u}) {
+    SCOPED_TRACE(kernel_size);
+    params_.depth_discontinuity.kernel_size = kernel_size;
+    params_.depth_discontinuity.method =
+        DepthDiscontinuityMapMethod::kMorphology;
+    cv::Mat expected_map(depth_image_.size(), CV_32FC1);
+    depth_segmenter_.computeDepthDiscontinuityMap(depth_image_,
+                                                  &expected_map);
+    for (const SimdLevel level : getSimdLevels()) {
+      SCOPED_TRACE(getSimdLevelName(level));
+      cv::Mat discontinuity_map;
+      computeDepthDiscontinuityMapFused(
+          depth_image_, kernel_size,
+          params_.depth_discontinuity.discontinuity_ratio, &discontinuity_map,
+          level);
+      ASSERT_EQ(discontinuity_map.size(), depth_image_.size());
+      EXPECT_EQ(cv::countNonZero(discontinuity_map != expected_map), 0);
+      // Invalid depths are never discontinuities.
+      const cv::Mat is_valid = depth_image_ > 0.0f;
+      EXPECT_EQ(cv::countNonZero(discontinuity_map.setTo(0.0f, is_valid)),
+                0);
+    }
+  }
+
+  // The segmenter uses the fused kernel by default.
+  params_.depth_discontinuity.kernel_size = 3u;
+  params_.depth_discontinuity.method = DepthDiscontinuityMapMethod::kFused;
+  cv::Mat fused_map(depth_image_.size(), CV_32FC1);
+  depth_segmenter_.computeDepthDiscontinuityMap(depth_image_, &fused_map);
+  EXPECT_GT(cv::countNonZero(fused_map), 0);
+}
+
+}  // namespace depth_segmentation
+DEPTH_SEGMENTATION_TESTING_ENTRYPOINT
@@ -1,9 +1,18 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include "depth_segmentation/bounded_queue.h"
 #include "depth_segmentation/common.h"
 #include "depth_segmentation/depth_segmentation.h"
+#include "depth_segmentation/instance_overlap.h"
+#include "depth_segmentation/point_cloud.h"
 #include "depth_segmentation/testing_entrypoint.h"
+#include "depth_segmentation/testing_fixtures.h"
 
 namespace depth_segmentation {
 
@@ -11,13 +20,7 @@ class DepthSegmentationTest : public ::testing::Test {
  protected:
   DepthSegmentationTest()
       : depth_camera_(), params_(), depth_segmenter_(depth_camera_, params_) {
-    cv::Mat camera_matrix = cv::Mat::zeros(3, 3, CV_32FC1);
-    camera_matrix.at<float>(0, 0) = 574.0527954101562f;
-    camera_matrix.at<float>(0, 2) = 319.5f;
-    camera_matrix.at<float>(1, 1) = 574.0527954101562f;
-    camera_matrix.at<float>(1, 2) = 239.5f;
-    camera_matrix.at<float>(2, 2) = 1.0f;
-    depth_camera_.initialize(480u, 640u, CV_32FC1, camera_matrix);
+    depth_camera_.initialize(480u, 640u, CV_32FC1, makeTestCameraMatrix());
     params_.min_convexity.window_size = 3u;
     depth_segmenter_.initialize();
     params_.normals.method = SurfaceNormalEstimationMethod::kDepthWindowFilter;
@@ -27,11 +30,84 @@ class DepthSegmentationTest : public ::testing::Test {
   virtual ~DepthSegmentationTest() {}
   virtual void SetUp() {}
 
+  // A slanted plane with a depth discontinuity at half the image width, as
+  // seen by the camera of the fixture.
+  cv::Mat makeSlantedPlaneDepthMap() const {
+    const cv::Mat camera_matrix = depth_camera_.getCameraMatrix();
+    const float fx = camera_matrix.at<float>(0, 0);
+    const float fy = camera_matrix.at<float>(1, 1);
+    const float cx = camera_matrix.at<float>(0, 2);
+    const float cy = camera_matrix.at<float>(1, 2);
+    const size_t width = depth_camera_.getWidth();
+    const size_t height = depth_camera_.getHeight();
+    cv::Mat depth_map(height, width, CV_32FC3);
+
+    const float kZMinDistance = 1.0f;
+    const float kZStep = 1.0f / fx;
+    const float kZJump = 0.2f;
+    for (size_t y = 0u; y < height; ++y) {
+      float z_distance = kZMinDistance;
+      for (size_t x = 0u; x < width; ++x) {
+        if (x == width / 2u) {
+          z_distance += kZJump;
+        }
+        depth_map.at<cv::Vec3f>(y, x) =
+            cv::Vec3f((x - cx) / fx * z_distance, (y - cy) / fy * z_distance,
+                      z_distance);
+        z_distance += kZStep;
+      }
+    }
+    return depth_map;
+  }
+
+  // The plane with a box in front of it, as seen by the camera of the
+  // fixture.
+  cv::Mat makePlaneWithBoxDepthImage() const {
+    return depth_segmentation::makePlaneWithBoxDepthImage(
+        cv::Size(depth_camera_.getWidth(), depth_camera_.getHeight()));
+  }
+
+  // Computes the geometric maps with the depth image as raw depth image.
+  void computeMaps(const cv::Mat& depth_image, cv::Mat* depth_map,
+                   cv::Mat* normal_map, cv::Mat* edge_map) {
+    depth_segmenter_.computeGeometricMaps(depth_image, depth_image, depth_map,
+                                          normal_map, edge_map);
+  }
+
   Params params_;
   DepthCamera depth_camera_;
   DepthSegmenter depth_segmenter_;
 };
 
+// Counts the image allocations, while forwarding them to the default OpenCV
+// allocator.
+class CountingMatAllocator : public cv::MatAllocator {
+ public:
+  CountingMatAllocator()
+      : std_allocator_(cv::Mat::getStdAllocator()), num_allocations_(0u) {}
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         size_t* step, int flags,
+                         cv::UMatUsageFlags usage_flags) const override {
+    if (data == nullptr) {
+      ++num_allocations_;
+    }
+    return std_allocator_->allocate(dims, sizes, type, data, step, flags,
+                                    usage_flags);
+  }
+  bool allocate(cv::UMatData* data, int access_flags,
+                cv::UMatUsageFlags usage_flags) const override {
+    return std_allocator_->allocate(data, access_flags, usage_flags);
+  }
+  void deallocate(cv::UMatData* data) const override {
+    std_allocator_->deallocate(data);
+  }
+  size_t getNumAllocations() const { return num_allocations_; }
+
+ private:
+  cv::MatAllocator* std_allocator_;
+  mutable std::atomic<size_t> num_allocations_;
+};
+
 TEST_F(DepthSegmentationTest, testNeighborhood) {
   static constexpr size_t kNormalImageWidth = 4u;
   static constexpr size_t kNormalImageHeight = 3u;
@@ -310,5 +386,996 @@ TEST_F(DepthSegmentationTest, testConvexity) {
 
   EXPECT_EQ(cv::countNonZero(expected_convexity != min_convexity_map), 0);
 }
+
+TEST_F(DepthSegmentationTest, testConvexityMethods) {
+  static constexpr size_t kImageWidth = 640u;
+  static constexpr size_t kImageHeight = 480u;
+  cv::Size image_size(kImageWidth, kImageHeight);
+  cv::Mat depth_map(image_size, CV_32FC3);
+  cv::Mat normals(image_size, CV_32FC3);
+  cv::randu(depth_map, cv::Scalar(-1.0f, -1.0f, 0.5f),
+            cv::Scalar(1.0f, 1.0f, 3.0f));
+  cv::randu(normals, cv::Scalar(-1.0f, -1.0f, -1.0f),
+            cv::Scalar(1.0f, 1.0f, 0.0f));
+  params_.min_convexity.use_threshold = false;
+  params_.min_convexity.use_morphological_opening = false;
+
+  for (const size_t window_size : {3u, 5u}) {
+    params_.min_convexity.window_size = window_size;
+    cv::Mat filter_convexity_map(image_size, CV_32FC1);
+    params_.min_convexity.method = MinConvexityMapMethod::kFilter;
+    depth_segmenter_.computeMinConvexityMap(depth_map, normals,
+                                            &filter_convexity_map);
+
+    cv::Mat fused_convexity_map(image_size, CV_32FC1);
+    params_.min_convexity.method = MinConvexityMapMethod::kFused;
+    depth_segmenter_.computeMinConvexityMap(depth_map, normals,
+                                            &fused_convexity_map);
+
+    EXPECT_EQ(cv::countNonZero(filter_convexity_map != fused_convexity_map), 0)
+        << "window_size: " << window_size;
+  }
+}
+
+TEST_F(DepthSegmentationTest, testMaxDistanceMethods) {
+  static constexpr size_t kImageWidth = 640u;
+  static constexpr size_t kImageHeight = 480u;
+  cv::Size image_size(kImageWidth, kImageHeight);
+  const cv::Mat depth_map = makeSlantedPlaneDepthMap();
+
+  // Invalid depths back-project to nan points, also at the image border.
+  constexpr float kNan = std::numeric_limits<float>::quiet_NaN();
+  cv::Mat depth_map_with_nans = depth_map.clone();
+  depth_map_with_nans(cv::Rect(100, 100, 20, 10)).setTo(cv::Scalar::all(kNan));
+  depth_map_with_nans(cv::Rect(0, 200, 1, 3)).setTo(cv::Scalar::all(kNan));
+  depth_map_with_nans.at<cv::Vec3f>(0, kImageWidth / 2u) =
+      cv::Vec3f(kNan, kNan, kNan);
+
+  // Counts the pixels that differ, where nan equals nan.
+  auto count_mismatches = [](const cv::Mat& a, const cv::Mat& b) {
+    return cv::countNonZero((a != b) & ((a == a) | (b == b)));
+  };
+  for (const bool has_nans : {false, true}) {
+    const cv::Mat& input = has_nans ? depth_map_with_nans : depth_map;
+    for (const bool ignore_nan_coordinates : {false, true}) {
+      params_.max_distance.ignore_nan_coordinates = ignore_nan_coordinates;
+      for (const bool exclude_nan : {false, true}) {
+        params_.max_distance.exclude_nan_as_max_distance = exclude_nan;
+        for (const bool use_threshold : {false, true}) {
+          params_.max_distance.use_threshold = use_threshold;
+          for (const size_t window_size : {3u, 5u}) {
+            SCOPED_TRACE(::testing::Message()
+                         << "has_nans: " << has_nans
+                         << ", ignore_nan_coordinates: "
+                         << ignore_nan_coordinates
+                         << ", exclude_nan: " << exclude_nan
+                         << ", use_threshold: " << use_threshold
+                         << ", window_size: " << window_size);
+            params_.max_distance.window_size = window_size;
+            cv::Mat filter_distance_map(image_size, CV_32FC1);
+            params_.max_distance.method = MaxDistanceMapMethod::kFilter;
+            depth_segmenter_.computeMaxDistanceMap(input,
+                                                   &filter_distance_map);
+
+            cv::Mat fused_distance_map(image_size, CV_32FC1);
+            params_.max_distance.method = MaxDistanceMapMethod::kFused;
+            depth_segmenter_.computeMaxDistanceMap(input, &fused_distance_map);
+
+            EXPECT_EQ(count_mismatches(filter_distance_map, fused_distance_map),
+                      0);
+            // Only nan distances that are neither ignored nor excluded make
+            // the maximum nan.
+            const int num_nans =
+                cv::countNonZero(fused_distance_map != fused_distance_map);
+            if (has_nans && !ignore_nan_coordinates && !exclude_nan &&
+                !use_threshold) {
+              EXPECT_GT(num_nans, 0);
+            } else {
+              EXPECT_EQ(num_nans, 0);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_F(DepthSegmentationTest, testIntegralImageNormals) {
+  static constexpr size_t kImageWidth = 640u;
+  static constexpr size_t kImageHeight = 480u;
+  cv::Size image_size(kImageWidth, kImageHeight);
+  const cv::Mat depth_map = makeSlantedPlaneDepthMap();
+
+  constexpr float kNormalTolerance = 1.0e-3f;
+  // The buffers are reused across the window sizes.
+  IntegralImageNormalsBuffers buffers;
+  for (const size_t window_size : {3u, 7u, 13u}) {
+    params_.normals.window_size = window_size;
+    cv::Mat own_normals(image_size, CV_32FC3);
+    computeOwnNormals(params_.normals, depth_map, &own_normals);
+
+    params_.normals.use_distance_refinement = true;
+    cv::Mat integral_normals(image_size, CV_32FC3);
+    computeIntegralImageNormals(params_.normals, depth_map, &buffers,
+                                &integral_normals);
+    EXPECT_LT(cv::norm(own_normals, integral_normals, cv::NORM_INF),
+              kNormalTolerance)
+        << "window_size: " << window_size;
+
+    // Without refinement, only the normals next to the discontinuity differ.
+    params_.normals.use_distance_refinement = false;
+    computeIntegralImageNormals(params_.normals, depth_map, &integral_normals);
+    const cv::Rect plane_region(0, 0, kImageWidth / 2u - window_size / 2u,
+                                kImageHeight);
+    EXPECT_LT(cv::norm(own_normals(plane_region),
+                       integral_normals(plane_region), cv::NORM_INF),
+              kNormalTolerance)
+        << "window_size: " << window_size;
+    EXPECT_GT(cv::norm(own_normals, integral_normals, cv::NORM_INF),
+              kNormalTolerance)
+        << "window_size: " << window_size;
+  }
+}
+
+TEST_F(DepthSegmentationTest, testSymmetricEigen3x3) {
+  cv::RNG rng(42);
+  std::vector<cv::Matx33d> matrices;
+  for (size_t i = 0u; i < 1000u; ++i) {
+    cv::Matx33d random_matrix;
+    rng.fill(random_matrix, cv::RNG::UNIFORM, -1.0, 1.0);
+    matrices.push_back(random_matrix + random_matrix.t());
+  }
+  // Degenerate cases with repeated eigenvalues.
+  const cv::Vec3d axis = cv::normalize(cv::Vec3d(1.0, -2.0, 0.5));
+  const cv::Matx33d axis_outer_product = axis * axis.t();
+  matrices.push_back(cv::Matx33d::zeros());
+  matrices.push_back(cv::Matx33d::eye());
+  matrices.push_back(cv::Matx33d::diag(cv::Vec3d(1.0, 3.0, 2.0)));
+  matrices.push_back(cv::Matx33d::eye() + 2.0 * axis_outer_product);
+  matrices.push_back(cv::Matx33d::eye() - axis_outer_product);
+  matrices.push_back(1.0e-6 * axis_outer_product);
+
+  constexpr double kTolerance = 1.0e-6;
+  for (const cv::Matx33d& matrix : matrices) {
+    cv::Vec3d eigenvalues;
+    cv::Matx33d eigenvectors;
+    computeSymmetricEigen3x3(matrix, &eigenvalues, &eigenvectors);
+
+    cv::Mat expected_eigenvalues;
+    cv::Mat expected_eigenvectors;
+    cv::eigen(cv::Mat(matrix), expected_eigenvalues, expected_eigenvectors);
+
+    const double scale = std::max(cv::norm(matrix, cv::NORM_INF), 1.0);
+    for (size_t i = 0u; i < 3u; ++i) {
+      EXPECT_NEAR(eigenvalues[i], expected_eigenvalues.at<double>(i),
+                  kTolerance * scale);
+      const cv::Vec3d eigenvector(eigenvectors(i, 0), eigenvectors(i, 1),
+                                  eigenvectors(i, 2));
+      EXPECT_NEAR(cv::norm(eigenvector), 1.0, kTolerance);
+      EXPECT_LT(cv::norm(matrix * eigenvector - eigenvalues[i] * eigenvector),
+                kTolerance * scale);
+    }
+  }
+}
+
+TEST_F(DepthSegmentationTest, testWorkspaceAllocations) {
+  static constexpr size_t kImageWidth = 640u;
+  static constexpr size_t kImageHeight = 480u;
+  cv::Size image_size(kImageWidth, kImageHeight);
+  params_.label.display = false;
+  // cv::findContours copies the edge map internally, the connected
+  // components label it in place.
+  params_.label.method = LabelMapMethod::kConnectedComponents;
+
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+  const cv::Mat rgb_image(image_size, CV_8UC3, cv::Scalar(10, 20, 30));
+  cv::Mat depth_map;
+  cv::Mat normal_map;
+  cv::Mat edge_map;
+  cv::Mat label_map;
+  std::vector<SegmentMask> segment_masks;
+  SegmentTable segments;
+  auto segment_frame = [&]() {
+    computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+    depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map,
+                              edge_map, normal_map, &label_map,
+                              &segment_masks, &segments);
+  };
+  // The maps, the workspace buffers and the structuring elements are
+  // created on the first frame.
+  segment_frame();
+  ASSERT_GT(segments.size(), 0u);
+
+  CountingMatAllocator counting_allocator;
+  cv::MatAllocator* default_allocator = cv::Mat::getDefaultAllocator();
+  cv::Mat::setDefaultAllocator(&counting_allocator);
+  constexpr size_t kNumFrames = 3u;
+  for (size_t i = 0u; i < kNumFrames; ++i) {
+    segment_frame();
+  }
+  cv::Mat::setDefaultAllocator(default_allocator);
+  EXPECT_EQ(counting_allocator.getNumAllocations(), 0u);
+}
+
+TEST_F(DepthSegmentationTest, testLabelMapSegmentTable) {
+  params_.label.display = false;
+  constexpr size_t kImageHeight = 480u;
+  constexpr size_t kImageWidth = 640u;
+  cv::Size image_size(kImageWidth, kImageHeight);
+
+  // A plane split into two segments by a vertical edge.
+  cv::Mat depth_image(image_size, CV_32FC1, cv::Scalar(1.0f));
+  cv::Mat rgb_image(image_size, CV_8UC3, cv::Scalar(10, 20, 30));
+  cv::Mat edge_map(image_size, CV_32FC1, cv::Scalar(1.0f));
+  edge_map.col(kImageWidth / 2u).setTo(cv::Scalar(0.0f));
+  cv::Mat depth_map(image_size, CV_32FC3);
+  depth_segmenter_.computeDepthMap(depth_image, &depth_map);
+  cv::Mat normal_map(image_size, CV_32FC3, cv::Scalar(0.0f, 0.0f, -1.0f));
+
+  for (const LabelMapMethod method :
+       {LabelMapMethod::kContour, LabelMapMethod::kConnectedComponents}) {
+    params_.label.method = method;
+    cv::Mat label_map;
+    std::vector<SegmentMask> segment_masks;
+    SegmentTable segments;
+    depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map,
+                              edge_map, normal_map, &label_map, &segment_masks,
+                              &segments);
+
+    ASSERT_EQ(segments.size(), 2u);
+    ASSERT_EQ(segment_masks.size(), segments.size());
+    size_t num_points = 0u;
+    for (size_t i = 0u; i < segments.size(); ++i) {
+      EXPECT_EQ(segments.offsets[i], num_points);
+      EXPECT_GE(segments.sizes[i], params_.label.min_size);
+      EXPECT_EQ(segments.sizes[i], segment_masks[i].size());
+      EXPECT_EQ(segments.instance_labels[i], kUnassignedLabel);
+      num_points += segments.sizes[i];
+    }
+    ASSERT_EQ(segments.points.size(), num_points);
+    ASSERT_EQ(segments.normals.size(), num_points);
+    ASSERT_EQ(segments.original_colors.size(), num_points);
+    for (size_t i = 0u; i < num_points; ++i) {
+      EXPECT_NEAR(segments.points[i][2], 1.0f, 1.0e-6f);
+      EXPECT_EQ(segments.normals[i], cv::Vec3f(0.0f, 0.0f, -1.0f));
+      EXPECT_EQ(segments.original_colors[i], cv::Vec3f(10.0f, 20.0f, 30.0f));
+    }
+  }
+}
+
+TEST_F(DepthSegmentationTest, testEdgeReassignmentMethods) {
+  params_.label.display = false;
+  params_.label.method = LabelMapMethod::kConnectedComponents;
+  constexpr size_t kImageHeight = 480u;
+  constexpr size_t kImageWidth = 640u;
+  cv::Size image_size(kImageWidth, kImageHeight);
+
+  // Two planes at different depths, separated by a band of edge points.
+  cv::Mat depth_image(image_size, CV_32FC1, cv::Scalar(1.0f));
+  depth_image.colRange(kImageWidth / 2u, kImageWidth).setTo(cv::Scalar(1.5f));
+  cv::Mat rgb_image(image_size, CV_8UC3, cv::Scalar(10, 20, 30));
+  cv::Mat edge_map(image_size, CV_32FC1, cv::Scalar(1.0f));
+  edge_map.colRange(kImageWidth / 2u - 2u, kImageWidth / 2u + 2u)
+      .setTo(cv::Scalar(0.0f));
+  cv::Mat depth_map(image_size, CV_32FC3);
+  depth_segmenter_.computeDepthMap(depth_image, &depth_map);
+  cv::Mat normal_map(image_size, CV_32FC3, cv::Scalar(0.0f, 0.0f, -1.0f));
+
+  std::vector<SegmentTable> segments(2u);
+  const EdgeReassignmentMethod kMethods[] = {
+      EdgeReassignmentMethod::kWindowSearch,
+      EdgeReassignmentMethod::kJumpFlooding};
+  for (size_t i = 0u; i < segments.size(); ++i) {
+    params_.label.edge_reassignment_method = kMethods[i];
+    cv::Mat label_map;
+    std::vector<SegmentMask> segment_masks;
+    depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map,
+                              edge_map, normal_map, &label_map, &segment_masks,
+                              &segments[i]);
+    ASSERT_EQ(segments[i].size(), 2u);
+  }
+  // The edge points are only assigned to the plane at their own depth.
+  EXPECT_EQ(segments[0].sizes, segments[1].sizes);
+  for (const cv::Vec3f& point : segments[1].points) {
+    EXPECT_TRUE(point[2] == 1.0f || point[2] == 1.5f);
+  }
+  for (size_t i = 0u; i < segments[1].size(); ++i) {
+    const size_t offset = segments[1].offsets[i];
+    const size_t end = offset + segments[1].sizes[i];
+    for (size_t j = offset; j < end; ++j) {
+      EXPECT_EQ(segments[1].points[j][2], segments[1].points[offset][2]);
+    }
+  }
+}
+
+TEST_F(DepthSegmentationTest, testConnectedComponents) {
+  // A ring enclosing a hole, which itself contains an island.
+  cv::Mat binary_image(20, 20, CV_8UC1, cv::Scalar(0u));
+  binary_image(cv::Rect(2, 2, 16, 16)).setTo(cv::Scalar(1u));
+  binary_image(cv::Rect(6, 6, 8, 8)).setTo(cv::Scalar(0u));
+  binary_image(cv::Rect(9, 9, 2, 2)).setTo(cv::Scalar(1u));
+
+  ConnectedComponents components;
+  labelConnectedComponents(binary_image, &components);
+
+  ASSERT_EQ(components.size(), 4u);
+  EXPECT_EQ(components.sizes, std::vector<size_t>({144u, 192u, 60u, 4u}));
+  EXPECT_EQ(components.parents,
+            std::vector<int>({kNoParentComponent, 0, 1, 2}));
+  EXPECT_EQ(components.is_foreground,
+            std::vector<bool>({false, true, false, true}));
+  EXPECT_EQ(components.labels.at<int32_t>(0, 0), 0);
+  EXPECT_EQ(components.labels.at<int32_t>(2, 2), 1);
+  EXPECT_EQ(components.labels.at<int32_t>(13, 13), 2);
+  EXPECT_EQ(components.labels.at<int32_t>(10, 10), 3);
+
+  // Components crossing the boundaries of the 32 row strips, which are labeled
+  // separately and merged afterwards: a bar and a ring with its hole cross
+  // row 32, two blocks that only touch diagonally meet at row 64.
+  cv::Mat strips_image(80, 40, CV_8UC1, cv::Scalar(0u));
+  strips_image(cv::Rect(5, 10, 3, 40)).setTo(cv::Scalar(1u));
+  strips_image(cv::Rect(25, 20, 12, 24)).setTo(cv::Scalar(1u));
+  strips_image(cv::Rect(28, 23, 6, 18)).setTo(cv::Scalar(0u));
+  strips_image(cv::Rect(15, 50, 4, 14)).setTo(cv::Scalar(1u));
+  strips_image(cv::Rect(19, 64, 4, 10)).setTo(cv::Scalar(1u));
+
+  labelConnectedComponents(strips_image, &components);
+
+  ASSERT_EQ(components.size(), 5u);
+  EXPECT_EQ(components.sizes,
+            std::vector<size_t>({2696u, 120u, 180u, 108u, 96u}));
+  EXPECT_EQ(components.parents,
+            std::vector<int>({kNoParentComponent, 0, 0, 2, 0}));
+  EXPECT_EQ(components.is_foreground,
+            std::vector<bool>({false, true, true, false, true}));
+  EXPECT_EQ(components.labels.at<int32_t>(31, 6), 1);
+  EXPECT_EQ(components.labels.at<int32_t>(32, 6), 1);
+  EXPECT_EQ(components.labels.at<int32_t>(32, 30), 3);
+  EXPECT_EQ(components.labels.at<int32_t>(63, 18), 4);
+  EXPECT_EQ(components.labels.at<int32_t>(64, 19), 4);
+}
+
+TEST_F(DepthSegmentationTest, testStageTimer) {
+  StageTimer stage_timer(100u);
+  for (size_t i = 1u; i <= 100u; ++i) {
+    stage_timer.addSample(Stage::kLabelMap, static_cast<double>(i));
+  }
+  StageStatistics statistics = stage_timer.getStatistics(Stage::kLabelMap);
+  EXPECT_EQ(statistics.num_samples, 100u);
+  EXPECT_DOUBLE_EQ(statistics.last, 100.0);
+  EXPECT_DOUBLE_EQ(statistics.mean, 50.5);
+  EXPECT_DOUBLE_EQ(statistics.p50, 50.0);
+  EXPECT_DOUBLE_EQ(statistics.p95, 95.0);
+  EXPECT_DOUBLE_EQ(statistics.p99, 99.0);
+  EXPECT_DOUBLE_EQ(statistics.max, 100.0);
+
+  // Only the most recent samples are kept.
+  for (size_t i = 0u; i < 100u; ++i) {
+    stage_timer.addSample(Stage::kLabelMap, 1.0);
+  }
+  statistics = stage_timer.getStatistics(Stage::kLabelMap);
+  EXPECT_EQ(statistics.num_samples, 100u);
+  EXPECT_DOUBLE_EQ(statistics.max, 1.0);
+  EXPECT_EQ(stage_timer.getStatistics(Stage::kDepthMap).num_samples, 0u);
+
+  stage_timer.addProcessedFrame();
+  stage_timer.addDroppedFrame();
+  stage_timer.addDroppedFrames(3u);
+  EXPECT_EQ(stage_timer.getNumProcessedFrames(), 1u);
+  EXPECT_EQ(stage_timer.getNumDroppedFrames(), 4u);
+
+  // The stages of the segmenter are only timed if timing is enabled.
+  cv::Mat depth_image(480, 640, CV_32FC1, cv::Scalar(1.0f));
+  cv::Mat depth_map(depth_image.size(), CV_32FC3);
+  depth_segmenter_.computeDepthMap(depth_image, &depth_map);
+  EXPECT_EQ(depth_segmenter_.getStageTimer()
+                .getStatistics(Stage::kDepthMap)
+                .num_samples,
+            0u);
+  params_.timing.enable = true;
+  depth_segmenter_.computeDepthMap(depth_image, &depth_map);
+  EXPECT_EQ(depth_segmenter_.getStageTimer()
+                .getStatistics(Stage::kDepthMap)
+                .num_samples,
+            1u);
+}
+
+TEST_F(DepthSegmentationTest, testFrameSegmenter) {
+  params_.label.display = false;
+  params_.label.min_size = 50u;
+  FrameSegmenter frame_segmenter(params_);
+
+  const cv::Mat depth_image =
+      depth_segmentation::makePlaneWithBoxDepthImage(cv::Size(128, 96));
+  cv::Mat rgb_image(depth_image.size(), CV_8UC3, cv::Scalar(10, 20, 30));
+  cv::Mat intrinsics = depth_camera_.getCameraMatrix().clone();
+  intrinsics.at<float>(0, 2) = 63.5f;
+  intrinsics.at<float>(1, 2) = 47.5f;
+
+  cv::Mat label_map;
+  cv::Mat normal_map;
+  std::vector<SegmentMask> segment_masks;
+  SegmentTable first_segments;
+  frame_segmenter.segment(rgb_image, false, depth_image, intrinsics, &label_map,
+                          &normal_map, &segment_masks, &first_segments);
+  SegmentTable segments;
+  frame_segmenter.segment(rgb_image, false, depth_image, intrinsics, &label_map,
+                          &normal_map, &segment_masks, &segments);
+  EXPECT_EQ(frame_segmenter.getNumInitializations(), 1u);
+  EXPECT_FALSE(segments.empty());
+  EXPECT_EQ(segments.sizes, first_segments.sizes);
+  EXPECT_EQ(segments.points, first_segments.points);
+
+  // Changing the intrinsics or the resolution rebuilds the segmenter.
+  cv::Mat other_intrinsics = intrinsics.clone();
+  other_intrinsics.at<float>(0, 0) = 500.0f;
+  frame_segmenter.segment(rgb_image, false, depth_image, other_intrinsics,
+                          &label_map, &normal_map, &segment_masks, &segments);
+  EXPECT_EQ(frame_segmenter.getNumInitializations(), 2u);
+  const cv::Mat half_depth_image = depth_image(cv::Rect(0, 0, 64, 48)).clone();
+  const cv::Mat half_rgb_image = rgb_image(cv::Rect(0, 0, 64, 48)).clone();
+  frame_segmenter.segment(half_rgb_image, false, half_depth_image,
+                          other_intrinsics, &label_map, &normal_map,
+                          &segment_masks, &segments);
+  EXPECT_EQ(frame_segmenter.getNumInitializations(), 3u);
+  frame_segmenter.segment(half_rgb_image, false, half_depth_image,
+                          other_intrinsics, &label_map, &normal_map,
+                          &segment_masks, &segments);
+  EXPECT_EQ(frame_segmenter.getNumInitializations(), 3u);
+}
+
+TEST_F(DepthSegmentationTest, testBoundedQueue) {
+  // The capacity is exact, even though it is not a power of two.
+  BoundedQueue<int> queue(3u);
+  EXPECT_EQ(queue.capacity(), 3u);
+  for (int i = 0; i < 3; ++i) {
+    int value = i;
+    EXPECT_TRUE(queue.tryPush(&value));
+  }
+  int value = 3;
+  EXPECT_FALSE(queue.tryPush(&value));
+
+  // Dropping the oldest value keeps the queue in order and hands the dropped
+  // value over.
+  std::atomic<bool> running(true);
+  BoundedQueue<int> dropped_values(1u);
+  EXPECT_EQ(pushWithPolicy(QueueFullPolicy::kDropOldest, running, &value,
+                           &queue, &dropped_values),
+            1u);
+  for (int i = 1; i < 4; ++i) {
+    EXPECT_TRUE(queue.tryPop(&value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.tryPop(&value));
+  EXPECT_TRUE(dropped_values.tryPop(&value));
+  EXPECT_EQ(value, 0);
+
+  // Once stopped, a full queue drops the pushed value and an empty queue
+  // stops waiting.
+  for (int i = 0; i < 3; ++i) {
+    value = i;
+    EXPECT_TRUE(queue.tryPush(&value));
+  }
+  running = false;
+  EXPECT_EQ(
+      pushWithPolicy(QueueFullPolicy::kBackpressure, running, &value, &queue),
+      1u);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(waitAndPop(running, &value, &queue));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(waitAndPop(running, &value, &queue));
+}
+
+TEST_F(DepthSegmentationTest, testConcurrentStages) {
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+
+  cv::Mat depth_map, normal_map, edge_map;
+  computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+  params_.concurrent_stages = true;
+  cv::Mat concurrent_depth_map, concurrent_normal_map, concurrent_edge_map;
+  computeMaps(depth_image, &concurrent_depth_map, &concurrent_normal_map,
+              &concurrent_edge_map);
+
+  // NaN values compare unequal, hence compare the raw bytes.
+  auto equal_bytes = [](const cv::Mat& a, const cv::Mat& b) {
+    return a.size() == b.size() && a.type() == b.type() &&
+           std::equal(a.datastart, a.dataend, b.datastart);
+  };
+  EXPECT_TRUE(equal_bytes(depth_map, concurrent_depth_map));
+  EXPECT_TRUE(equal_bytes(normal_map, concurrent_normal_map));
+  EXPECT_TRUE(equal_bytes(edge_map, concurrent_edge_map));
+}
+
+TEST_F(DepthSegmentationTest, testRescaleDepthImage) {
+  cv::Mat millimeters(2, 3, CV_16UC1, cv::Scalar(1500));
+  millimeters.at<uint16_t>(1, 2) = 0u;
+  cv::Mat rescaled_depth;
+  rescaleDepthImage(millimeters, &rescaled_depth);
+  EXPECT_EQ(rescaled_depth.type(), CV_32FC1);
+  EXPECT_NEAR(rescaled_depth.at<float>(0, 0), 1.5f, 1.0e-6f);
+  EXPECT_EQ(rescaled_depth.at<float>(1, 2), 0.0f);
+
+  cv::Mat meters(2, 3, CV_32FC1, cv::Scalar(2.0f));
+  meters.at<float>(0, 1) = std::numeric_limits<float>::quiet_NaN();
+  rescaleDepthImage(meters, &rescaled_depth);
+  EXPECT_EQ(rescaled_depth.at<float>(0, 0), 2.0f);
+  EXPECT_EQ(rescaled_depth.at<float>(0, 1), 0.0f);
+}
+
+TEST_F(DepthSegmentationTest, testBgrInput) {
+  params_.label.display = false;
+  params_.label.min_size = 50u;
+  const cv::Mat depth_image =
+      depth_segmentation::makePlaneWithBoxDepthImage(cv::Size(128, 96));
+  cv::Mat rgb_image(depth_image.size(), CV_8UC3, cv::Scalar(10, 20, 30));
+  cv::Mat intrinsics = depth_camera_.getCameraMatrix().clone();
+  intrinsics.at<float>(0, 2) = 63.5f;
+  intrinsics.at<float>(1, 2) = 47.5f;
+
+  cv::Mat label_map;
+  cv::Mat normal_map;
+  std::vector<SegmentMask> segment_masks;
+  SegmentTable rgb_segments;
+  FrameSegmenter rgb_segmenter(params_);
+  rgb_segmenter.segment(rgb_image, false, depth_image, intrinsics, &label_map,
+                        &normal_map, &segment_masks, &rgb_segments);
+
+  // The BGR image yields the same segment colors in RGB order.
+  cv::Mat bgr_image;
+  cv::cvtColor(rgb_image, bgr_image, cv::COLOR_RGB2BGR);
+  SegmentTable bgr_segments;
+  rgb_segmenter.segment(bgr_image, true, depth_image, intrinsics, &label_map,
+                        &normal_map, &segment_masks, &bgr_segments);
+  ASSERT_FALSE(rgb_segments.empty());
+  EXPECT_EQ(bgr_segments.original_colors, rgb_segments.original_colors);
+  EXPECT_EQ(bgr_segments.original_colors.front(),
+            cv::Vec3f(10.0f, 20.0f, 30.0f));
+}
+
+TEST_F(DepthSegmentationTest, testPointCloud2) {
+  SegmentTable segments;
+  segments.addSegment(2u, 7u);
+  segments.addSegment(1u, 9u);
+  segments.resizeBuffers();
+  segments.instance_labels[1] = 3u;
+  segments.semantic_labels[1] = 5u;
+  for (size_t i = 0u; i < 3u; ++i) {
+    segments.points[i] = cv::Vec3f(i, i + 0.5f, 1.0f);
+    segments.normals[i] = cv::Vec3f(0.0f, 0.0f, -1.0f);
+    segments.original_colors[i] = cv::Vec3f(10.0f * i, 20.0f, 30.0f);
+  }
+
+  sensor_msgs::PointCloud2 scene_cloud;
+  segmentsToPointCloud2(segments, true, true, &scene_cloud);
+  EXPECT_EQ(scene_cloud.width, 3u);
+  EXPECT_EQ(scene_cloud.data.size(), 3u * kPointCloud2PointStep);
+  ASSERT_EQ(scene_cloud.fields.size(), 10u);
+  EXPECT_EQ(scene_cloud.fields[6].name, "rgb");
+  EXPECT_EQ(scene_cloud.fields[8].name, "semantic_label");
+  EXPECT_EQ(scene_cloud.fields[9].name, "segment_id");
+
+  sensor_msgs::PointCloud2 segment_cloud;
+  extractSegmentPointCloud2(segments, 1u, scene_cloud, &segment_cloud);
+  EXPECT_EQ(segment_cloud.width, 1u);
+  ASSERT_EQ(segment_cloud.data.size(), kPointCloud2PointStep);
+  const uint8_t* point = segment_cloud.data.data();
+  float y;
+  std::memcpy(&y, point + segment_cloud.fields[1].offset, sizeof(y));
+  EXPECT_EQ(y, 2.5f);
+  uint32_t rgb;
+  std::memcpy(&rgb, point + segment_cloud.fields[6].offset, sizeof(rgb));
+  EXPECT_EQ(rgb & 0xffffffu, (20u << 16u) | (20u << 8u) | 30u);
+  EXPECT_EQ(point[segment_cloud.fields[7].offset], 3u);
+  EXPECT_EQ(point[segment_cloud.fields[8].offset], 5u);
+  uint16_t segment_id;
+  std::memcpy(&segment_id, point + segment_cloud.fields[9].offset,
+              sizeof(segment_id));
+  EXPECT_EQ(segment_id, 1u);
+
+  segmentsToPointCloud2(segments, false, false, &scene_cloud);
+  ASSERT_EQ(scene_cloud.fields.size(), 7u);
+  EXPECT_EQ(scene_cloud.fields[6].name, "rgba");
+}
+
+TEST_F(DepthSegmentationTest, testLabelImage) {
+  params_.label.display = false;
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+  cv::Mat rgb_image(depth_image.size(), CV_8UC3, cv::Scalar(90, 90, 90));
+  cv::Mat depth_map, normal_map, edge_map;
+  computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+
+  cv::Mat label_map;
+  std::vector<SegmentMask> segment_masks;
+  SegmentTable segments;
+  depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map, edge_map,
+                            normal_map, &label_map, &segment_masks, &segments);
+  cv::Mat label_image;
+  std::vector<SegmentDescriptor> descriptors;
+  depth_segmenter_.labelImage(depth_image, depth_map, edge_map, normal_map,
+                              &label_image, &descriptors);
+
+  // The descriptors summarize the same segments as the table.
+  EXPECT_EQ(label_image.type(), CV_32SC1);
+  ASSERT_GE(segments.size(), 2u);
+  ASSERT_EQ(descriptors.size(), segments.size());
+  for (size_t i = 0u; i < segments.size(); ++i) {
+    const SegmentDescriptor& descriptor = descriptors[i];
+    EXPECT_EQ(descriptor.label, segments.labels[i]);
+    EXPECT_EQ(descriptor.num_pixels, segments.sizes[i]);
+    const cv::Mat segment_pixels = label_image == static_cast<int32_t>(i + 1u);
+    cv::Mat segment_mask;
+    segment_masks[i].toMat(label_image.size(), &segment_mask);
+    EXPECT_EQ(cv::countNonZero(segment_pixels != segment_mask), 0);
+    EXPECT_EQ(descriptor.bounding_box, segment_masks[i].boundingBox());
+    cv::Vec3d point_sum(0.0, 0.0, 0.0);
+    for (size_t j = segments.offsets[i];
+         j < segments.offsets[i] + segments.sizes[i]; ++j) {
+      point_sum += cv::Vec3d(segments.points[j]);
+    }
+    const cv::Vec3d centroid =
+        point_sum / static_cast<double>(descriptor.num_pixels);
+    EXPECT_LT(cv::norm(cv::Vec3d(descriptor.centroid) - centroid), 1.0e-3);
+    EXPECT_NEAR(cv::norm(descriptor.mean_normal), 1.0, 1.0e-5);
+    EXPECT_EQ(descriptor.instance_label, kUnassignedLabel);
+  }
+}
+
+TEST_F(DepthSegmentationTest, testSegmentMask) {
+  cv::Mat image = cv::Mat::zeros(6, 8, CV_8UC1);
+  image(cv::Rect(2, 1, 3, 4)).setTo(cv::Scalar(255));
+  std::vector<cv::Point> pixels;
+  cv::findNonZero(image, pixels);
+  SegmentMask mask;
+  for (const cv::Point& pixel : pixels) {
+    mask.addPixel(pixel.y, pixel.x);
+  }
+  // One run per row.
+  EXPECT_EQ(mask.runs.size(), 4u);
+  EXPECT_EQ(mask.size(), 12u);
+  EXPECT_EQ(mask.boundingBox(), cv::Rect(2, 1, 3, 4));
+  cv::Mat rendered;
+  mask.toMat(image.size(), &rendered);
+  EXPECT_EQ(cv::countNonZero(rendered != image), 0);
+
+  cv::Mat other = cv::Mat::zeros(image.size(), CV_8UC1);
+  other(cv::Rect(3, 0, 5, 2)).setTo(cv::Scalar(255));
+  EXPECT_EQ(mask.countOverlap(other), 2u);
+  mask.clear();
+  EXPECT_TRUE(mask.empty());
+  EXPECT_EQ(mask.countOverlap(other), 0u);
+}
+
+TEST_F(DepthSegmentationTest, testInstanceOverlap) {
+  const cv::Size image_size(8, 6);
+  std::vector<cv::Mat> masks(2u);
+  for (cv::Mat& mask : masks) {
+    mask = cv::Mat::zeros(image_size, CV_8UC1);
+  }
+  masks[0](cv::Rect(0, 0, 4, 6)).setTo(cv::Scalar(255));
+  masks[1](cv::Rect(3, 0, 5, 3)).setTo(cv::Scalar(255));
+  InstanceIdImage instance_ids;
+  instance_ids.compute(masks, image_size);
+  EXPECT_EQ(instance_ids.ids.type(), CV_16UC1);
+  EXPECT_EQ(instance_ids.ids.at<uint16_t>(5, 0), 1u);
+  // Both masks are kept where they overlap.
+  EXPECT_EQ(instance_ids.ids.at<uint16_t>(0, 3), kSharedInstanceId);
+  EXPECT_EQ(instance_ids.shared_pixels.size(), 6u);
+  EXPECT_EQ(instance_ids.ids.at<uint16_t>(5, 7), 0u);
+
+  // Segment 0 is the left half, segment 1 the right half of the image.
+  InstanceOverlap overlap;
+  overlap.reset(2u, masks.size());
+  for (int y = 0; y < image_size.height; ++y) {
+    for (int x = 0; x < image_size.width; ++x) {
+      overlap.add(x < 4 ? 0u : 1u, instance_ids, y, x);
+    }
+  }
+  EXPECT_EQ(overlap.count(0u, 0u), 0u);
+  EXPECT_EQ(overlap.count(0u, 1u), 24u);
+  EXPECT_EQ(overlap.count(0u, 2u), 3u);
+  EXPECT_EQ(overlap.count(1u, 0u), 12u);
+  EXPECT_EQ(overlap.count(1u, 2u), 12u);
+  EXPECT_EQ(overlap.assignInstance(0u, 24u, 0.8f), 1u);
+  EXPECT_EQ(overlap.assignInstance(1u, 24u, 0.8f), kUnassignedLabel);
+  EXPECT_EQ(overlap.assignInstance(1u, 24u, 0.4f), 2u);
+}
+
+TEST_F(DepthSegmentationTest, testOverlappingInstanceMasks) {
+  // Random overlapping masks, where a segment covered by several masks
+  // counts its pixels for each of them.
+  const cv::Size image_size(64, 48);
+  cv::RNG rng(42);
+  constexpr size_t kNumMasks = 6u;
+  std::vector<cv::Mat> masks(kNumMasks);
+  for (cv::Mat& mask : masks) {
+    mask = cv::Mat::zeros(image_size, CV_8UC1);
+    const cv::Point corner(rng.uniform(0, image_size.width / 2),
+                           rng.uniform(0, image_size.height / 2));
+    const cv::Size size(rng.uniform(8, image_size.width / 2),
+                        rng.uniform(8, image_size.height / 2));
+    mask(cv::Rect(corner, size)).setTo(cv::Scalar(255));
+  }
+  constexpr size_t kNumSegments = 4u;
+  std::vector<cv::Mat> segment_masks(kNumSegments);
+  cv::Mat segment_ids(image_size, CV_32SC1);
+  for (int y = 0; y < image_size.height; ++y) {
+    for (int x = 0; x < image_size.width; ++x) {
+      segment_ids.at<int32_t>(y, x) = (x * 2 / image_size.width) +
+                                      2 * (y * 2 / image_size.height);
+    }
+  }
+  for (size_t i = 0u; i < kNumSegments; ++i) {
+    segment_masks[i] = segment_ids == static_cast<int32_t>(i);
+  }
+
+  InstanceIdImage instance_ids;
+  instance_ids.compute(masks, image_size);
+  EXPECT_FALSE(instance_ids.shared_pixels.empty());
+  InstanceOverlap overlap;
+  overlap.reset(kNumSegments, kNumMasks);
+  for (int y = 0; y < image_size.height; ++y) {
+    for (int x = 0; x < image_size.width; ++x) {
+      overlap.add(segment_ids.at<int32_t>(y, x), instance_ids, y, x);
+    }
+  }
+  cv::Mat overlap_mask;
+  for (size_t i = 0u; i < kNumSegments; ++i) {
+    for (size_t j = 0u; j < kNumMasks; ++j) {
+      cv::bitwise_and(segment_masks[i], masks[j], overlap_mask);
+      EXPECT_EQ(overlap.count(i, j + 1u),
+                static_cast<size_t>(cv::countNonZero(overlap_mask)));
+    }
+  }
+}
+
+TEST_F(DepthSegmentationTest, testIncrementalGeometricMaps) {
+  params_.incremental.enable = true;
+  params_.incremental.tile_size = 64u;
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+  cv::Mat depth_map, normal_map, edge_map;
+  computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+  EXPECT_EQ(depth_segmenter_.getNumRecomputedTiles(), 80u);
+
+  // NaN values compare unequal, hence compare the raw bytes.
+  auto equal_bytes = [](const cv::Mat& a, const cv::Mat& b) {
+    return a.size() == b.size() && a.type() == b.type() &&
+           std::equal(a.datastart, a.dataend, b.datastart);
+  };
+  cv::Mat static_normal_map, static_edge_map;
+  computeMaps(depth_image, &depth_map, &static_normal_map, &static_edge_map);
+  EXPECT_EQ(depth_segmenter_.getNumRecomputedTiles(), 0u);
+  EXPECT_TRUE(equal_bytes(normal_map, static_normal_map));
+  EXPECT_TRUE(equal_bytes(edge_map, static_edge_map));
+
+  // A new box within the first tile, its neighbors are within the halo.
+  cv::Mat moved_depth_image = depth_image.clone();
+  moved_depth_image(cv::Rect(16, 16, 32, 32)).setTo(cv::Scalar(1.5f));
+  computeMaps(moved_depth_image, &depth_map, &normal_map, &edge_map);
+  EXPECT_EQ(depth_segmenter_.getNumRecomputedTiles(), 4u);
+
+  params_.incremental.enable = false;
+  cv::Mat full_depth_map, full_normal_map, full_edge_map;
+  computeMaps(moved_depth_image, &full_depth_map, &full_normal_map,
+              &full_edge_map);
+  EXPECT_TRUE(equal_bytes(depth_map, full_depth_map));
+  EXPECT_TRUE(equal_bytes(normal_map, full_normal_map));
+  EXPECT_TRUE(equal_bytes(edge_map, full_edge_map));
+}
+
+TEST_F(DepthSegmentationTest, testPyramid) {
+  cv::Mat block_depth(3, 3, CV_32FC1, cv::Scalar(2.0f));
+  block_depth.at<float>(0, 0) = 1.0f;
+  block_depth.at<float>(0, 1) = std::numeric_limits<float>::quiet_NaN();
+  block_depth.at<float>(1, 0) = 0.0f;
+  block_depth.at<float>(2, 2) = 0.0f;
+  cv::Mat downsampled_depth;
+  downsampleDepthImage(block_depth, 2, &downsampled_depth);
+  ASSERT_EQ(downsampled_depth.size(), cv::Size(2, 2));
+  // The lower median of the valid depths 1 and 2.
+  EXPECT_EQ(downsampled_depth.at<float>(0, 0), 1.0f);
+  EXPECT_EQ(downsampled_depth.at<float>(1, 0), 2.0f);
+  EXPECT_EQ(downsampled_depth.at<float>(1, 1), 0.0f);
+  cv::Mat upsampled_depth;
+  upsampleNearest(downsampled_depth, 2, block_depth.size(), &upsampled_depth);
+  ASSERT_EQ(upsampled_depth.size(), block_depth.size());
+  EXPECT_EQ(upsampled_depth.at<float>(1, 1), 1.0f);
+  EXPECT_EQ(upsampled_depth.at<float>(2, 0), 2.0f);
+
+  params_.label.display = false;
+  // The box starts and ends within the blocks of the level.
+  cv::Mat depth_image(480, 640, CV_32FC1, cv::Scalar(2.0f));
+  const cv::Rect box(201, 151, 239, 179);
+  depth_image(box).setTo(cv::Scalar(1.0f));
+  auto compute_label_image = [&](cv::Mat* label_image) {
+    cv::Mat depth_map, normal_map, edge_map;
+    computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+    EXPECT_EQ(edge_map.size(), depth_image.size());
+    std::vector<SegmentDescriptor> descriptors;
+    depth_segmenter_.labelImage(depth_image, depth_map, edge_map, normal_map,
+                                label_image, &descriptors);
+  };
+  cv::Mat reference_label_image;
+  compute_label_image(&reference_label_image);
+  EXPECT_EQ(computeLabelAgreement(reference_label_image, reference_label_image),
+            1.0);
+  params_.pyramid.level = 1u;
+  cv::Mat label_image;
+  compute_label_image(&label_image);
+  ASSERT_EQ(label_image.size(), depth_image.size());
+  EXPECT_GT(computeLabelAgreement(label_image, reference_label_image), 0.95);
+
+  // The boundary of the box is refined at full resolution: no pixel of the
+  // plane takes the label of the box and the box pixels are either labeled
+  // as the box or not at all, although the blocks of the level mix both.
+  const int32_t box_label = label_image.at<int32_t>(240, 320);
+  ASSERT_GT(box_label, 0);
+  int num_box_pixels = 0;
+  int num_mislabeled_pixels = 0;
+  for (int y = 0; y < depth_image.rows; ++y) {
+    for (int x = 0; x < depth_image.cols; ++x) {
+      const int32_t label = label_image.at<int32_t>(y, x);
+      if (box.contains(cv::Point(x, y))) {
+        num_box_pixels += label == box_label ? 1 : 0;
+        num_mislabeled_pixels += label != box_label && label != 0 ? 1 : 0;
+      } else {
+        num_mislabeled_pixels += label == box_label ? 1 : 0;
+      }
+    }
+  }
+  EXPECT_EQ(num_mislabeled_pixels, 0);
+  EXPECT_GT(num_box_pixels, 0.8 * box.area());
+}
+
+TEST_F(DepthSegmentationTest, testRoi) {
+  params_.label.display = false;
+  // Only the box is within the depth range.
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+  cv::Mat rgb_image(depth_image.size(), CV_8UC3, cv::Scalar(90, 90, 90));
+  const cv::Rect roi(100, 100, 300, 200);
+  params_.roi.enable = true;
+  params_.roi.x = roi.x;
+  params_.roi.y = roi.y;
+  params_.roi.width = roi.width;
+  params_.roi.height = roi.height;
+  params_.roi.max_depth = 1.5;
+  cv::Mat depth_map, normal_map, edge_map;
+  computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+  ASSERT_EQ(edge_map.size(), depth_image.size());
+  cv::Mat outside_roi(depth_image.size(), CV_8UC1, cv::Scalar(255));
+  outside_roi(roi).setTo(cv::Scalar(0));
+  cv::Mat edge_map_outside_roi;
+  edge_map.copyTo(edge_map_outside_roi, outside_roi);
+  EXPECT_EQ(cv::countNonZero(edge_map_outside_roi), 0);
+
+  cv::Mat label_map;
+  std::vector<SegmentMask> segment_masks;
+  SegmentTable segments;
+  depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map, edge_map,
+                            normal_map, &label_map, &segment_masks, &segments);
+  ASSERT_EQ(label_map.size(), depth_image.size());
+  ASSERT_GE(segment_masks.size(), 1u);
+  for (const SegmentMask& segment_mask : segment_masks) {
+    const cv::Rect bounding_box = segment_mask.boundingBox();
+    EXPECT_EQ(bounding_box & roi, bounding_box);
+    for (const SegmentMask::Run& run : segment_mask.runs) {
+      for (int x = run.x_begin; x < run.x_end; ++x) {
+        EXPECT_EQ(depth_image.at<float>(run.y, x), 1.0f);
+      }
+    }
+  }
+  // The points are in the coordinates of the camera of the full frame.
+  const float z = segments.points[0][2];
+  EXPECT_EQ(z, 1.0f);
+  const SegmentMask::Run& first_run = segment_masks[0].runs.front();
+  EXPECT_NEAR(segments.points[0][0],
+              (first_run.x_begin - 319.5f) * z / 574.0527954101562f, 1.0e-5);
+
+  cv::Mat label_image;
+  std::vector<SegmentDescriptor> descriptors;
+  depth_segmenter_.labelImage(depth_image, depth_map, edge_map, normal_map,
+                              &label_image, &descriptors);
+  ASSERT_EQ(label_image.size(), depth_image.size());
+  ASSERT_EQ(descriptors.size(), segment_masks.size());
+  cv::Mat label_image_outside_roi;
+  label_image.copyTo(label_image_outside_roi, outside_roi);
+  EXPECT_EQ(cv::countNonZero(label_image_outside_roi), 0);
+  for (size_t i = 0u; i < descriptors.size(); ++i) {
+    EXPECT_EQ(descriptors[i].bounding_box, segment_masks[i].boundingBox());
+  }
+}
+
+TEST_F(DepthSegmentationTest, testRayTable) {
+  const RayTable& rays = depth_camera_.getRayTable();
+  ASSERT_EQ(rays.size(), cv::Size(640, 480));
+  EXPECT_EQ(rays.backProject(0, 0, 2.0f)[2], 2.0f);
+  EXPECT_NEAR(rays.backProject(0, 0, 2.0f)[0],
+              -319.5f * 2.0f / 574.0527954101562f, 1.0e-6);
+
+  // The points of the segments are back-projected from the depth image, not
+  // from the depth map, which may be computed from a dilated depth image.
+  params_.label.display = false;
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+  cv::Mat rgb_image(depth_image.size(), CV_8UC3, cv::Scalar(90, 90, 90));
+  cv::Mat depth_map, normal_map, edge_map;
+  computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+  cv::Mat expected_depth_map;
+  cv::rgbd::depthTo3d(depth_image, depth_camera_.getCameraMatrix(),
+                      expected_depth_map);
+  depth_map.setTo(cv::Scalar::all(0.0f));
+  cv::Mat label_map;
+  std::vector<SegmentMask> segment_masks;
+  SegmentTable segments;
+  depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map, edge_map,
+                            normal_map, &label_map, &segment_masks, &segments);
+  ASSERT_GE(segments.size(), 2u);
+  for (size_t i = 0u; i < segments.size(); ++i) {
+    size_t position = segments.offsets[i];
+    for (const SegmentMask::Run& run : segment_masks[i].runs) {
+      for (int x = run.x_begin; x < run.x_end; ++x, ++position) {
+        const cv::Vec3f& expected_point =
+            expected_depth_map.at<cv::Vec3f>(run.y, x);
+        EXPECT_LT(cv::norm(segments.points[position] - expected_point),
+                  1.0e-5);
+      }
+    }
+  }
+
+  // The rays follow the camera matrix, also if it is set through the base
+  // class.
+  cv::Mat camera_matrix = depth_camera_.getCameraMatrix().clone();
+  camera_matrix.at<float>(0, 2) = 0.0f;
+  Camera& camera = depth_camera_;
+  camera.setCameraMatrix(camera_matrix);
+  EXPECT_EQ(depth_camera_.getRayTable().backProject(0, 0, 1.0f)[0], 0.0f);
+}
+
+TEST_F(DepthSegmentationTest, testCompactMaps) {
+  params_.label.display = false;
+  const cv::Mat depth_image = makePlaneWithBoxDepthImage();
+  cv::Mat rgb_image(depth_image.size(), CV_8UC3, cv::Scalar(90, 90, 90));
+
+  for (const DepthDiscontinuityMapMethod method :
+       {DepthDiscontinuityMapMethod::kFused,
+        DepthDiscontinuityMapMethod::kMorphology}) {
+    SCOPED_TRACE(static_cast<int>(method));
+    params_.depth_discontinuity.method = method;
+    params_.compact_maps = false;
+    cv::Mat depth_map, normal_map, edge_map;
+    computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+    ASSERT_EQ(edge_map.type(), CV_32FC1);
+    cv::Mat label_map;
+    std::vector<SegmentMask> segment_masks;
+    SegmentTable segments;
+    depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map,
+                              edge_map, normal_map, &label_map, &segment_masks,
+                              &segments);
+
+    params_.compact_maps = true;
+    cv::Mat compact_edge_map;
+    computeMaps(depth_image, &depth_map, &normal_map, &compact_edge_map);
+    ASSERT_EQ(compact_edge_map.type(), CV_8UC1);
+    // The negative edges of the float map saturate to zero in both.
+    cv::Mat edge_map_8u;
+    edge_map.convertTo(edge_map_8u, CV_8U);
+    EXPECT_EQ(cv::countNonZero(edge_map_8u != compact_edge_map), 0);
+    EXPECT_GT(cv::countNonZero(compact_edge_map), 0);
+
+    cv::Mat compact_label_map;
+    std::vector<SegmentMask> compact_segment_masks;
+    SegmentTable compact_segments;
+    depth_segmenter_.labelMap(rgb_image, false, depth_image, depth_map,
+                              compact_edge_map, normal_map, &compact_label_map,
+                              &compact_segment_masks, &compact_segments);
+    EXPECT_EQ(compact_segments.size(), segments.size());
+    EXPECT_EQ(compact_segments.points.size(), segments.points.size());
+  }
+
+  // The compact maps fall back to float maps if a map is not binary.
+  params_.max_distance.use_threshold = false;
+  cv::Mat depth_map, normal_map, edge_map;
+  computeMaps(depth_image, &depth_map, &normal_map, &edge_map);
+  EXPECT_EQ(edge_map.type(), CV_32FC1);
+}
 }  // namespace depth_segmentation
 DEPTH_SEGMENTATION_TESTING_ENTRYPOINT